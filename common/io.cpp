@@ -1,15 +1,56 @@
 ﻿#include "io.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Linux gets file changes pushed by inotify, everywhere else the watched files are polled every update
+#if defined(__linux__)
+#define IO_INOTIFY 1
+#endif
+
+#if IO_INOTIFY
+#include <chrono>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+// Set by CMake when liburing is installed, asynchronous reads are done by a pool of threads otherwise
+#if IO_URING
+#include <liburing.h>
+#endif
 
 namespace IO
 {
     struct FileUpdateWatcher
     {
         std::filesystem::path path;
-        std::vector<std::function<void()>> on_update_callbacks;
-        u64 last_write_time;
+        std::vector<std::function<void()>> on_update_callbacks {};
+        u64 last_write_time { 0 };
+        // Read from path.dependencies, only the callbacks given for path itself are passed on to them
+        std::vector<std::filesystem::path> dependencies {};
+        std::vector<std::function<void()>> dependency_callbacks {};
+        // Set when inotify couldn't watch the directory of path, update() then still polls it
+        bool polled { false };
 
         void check_for_update_and_callback();
+        void callback();
     };
 
     void FileUpdateWatcher::check_for_update_and_callback()
@@ -18,16 +59,292 @@ namespace IO
         if (last_write_time < new_last_write_time)
         {
             last_write_time = new_last_write_time;
-            for (const auto & on_update_callback : on_update_callbacks)
-                on_update_callback();
+            callback();
         }
     }
 
+    void FileUpdateWatcher::callback()
+    {
+        for (const auto & on_update_callback : on_update_callbacks)
+            on_update_callback();
+    }
+
+    struct ReadRequest
+    {
+        ReadResult result;
+        usize size; // 0 reads up to the end of the file
+        ReadCallback on_read;
+    };
+
+    // Reads blocked on the disk at once when there is no io_uring
+    constexpr u32 READ_THREAD_COUNT { 4 };
+#if IO_URING
+    // Also the most reads in flight at once
+    constexpr u32 READ_RING_ENTRIES { 64 };
+#endif
+
+#if IO_INOTIFY
+    // Editors often write a file several times when saving, the callbacks only run once it has been quiet this long
+    constexpr i32 FILE_WATCH_DEBOUNCE_MS { 50 };
+    // How long the watcher thread sleeps without pending files, bounds how long terminate waits for it
+    constexpr i32 FILE_WATCH_IDLE_TIMEOUT_MS { 250 };
+#endif
+
     struct
     {
         std::unordered_map<std::filesystem::path, FileUpdateWatcher> watched_files;
+
+#if IO_INOTIFY
+        i32 inotify_fd { -1 }; // Stays -1 when inotify isn't available, the files are polled then
+        bool inotify_failed { false }; // inotify_init1 is only tried once, after that every file is polled
+        std::thread watcher_thread;
+        std::atomic<bool> stopping { false };
+
+        std::mutex mutex;
+        std::unordered_map<i32, std::filesystem::path> watched_directories; // By watch descriptor, guarded by mutex
+        std::vector<std::filesystem::path> changed_files; // Canonical paths posted by the watcher thread, guarded by mutex
+        std::atomic<bool> has_changed_files { false };
+
+        // Main thread only, the same file can be watched through differently spelled paths
+        std::unordered_map<std::filesystem::path, std::vector<std::filesystem::path>> watched_files_by_canonical_path;
+#endif
+
+        // Asynchronous reads, started by the first read_async
+        std::vector<std::thread> read_threads;
+        std::mutex read_mutex;
+        std::condition_variable read_queued;
+        bool reads_stopping { false }; // Guarded by read_mutex
+        std::deque<ReadRequest> queued_reads; // Guarded by read_mutex
+        std::vector<ReadRequest> completed_reads; // Guarded by read_mutex
+        std::atomic<bool> has_completed_reads { false };
+        u32 pending_read_count { 0 }; // Main thread only
+#if IO_URING
+        io_uring read_ring {};
+        bool read_ring_initialized { false };
+#endif
     } internal;
 
+#if IO_INOTIFY
+    u64 get_milliseconds()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<u64>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+    }
+
+    // Collects the files written in the watched directories, and posts them once they stopped changing
+    void run_file_watcher()
+    {
+        std::unordered_map<std::filesystem::path, u64> pending_files; // Time of the last write
+        alignas(inotify_event) char event_buffer[4096];
+
+        while (!internal.stopping)
+        {
+            pollfd poll_fd { .fd = internal.inotify_fd, .events = POLLIN, .revents = 0 };
+            i32 timeout_ms = pending_files.empty() ? FILE_WATCH_IDLE_TIMEOUT_MS : FILE_WATCH_DEBOUNCE_MS;
+
+            if (poll(&poll_fd, 1, timeout_ms) > 0 && (poll_fd.revents & POLLIN))
+            {
+                ssize_t length = read(internal.inotify_fd, event_buffer, sizeof(event_buffer));
+                u64 now = get_milliseconds();
+
+                std::lock_guard lock(internal.mutex);
+                for (ssize_t offset = 0; offset < length;)
+                {
+                    auto* event = reinterpret_cast<inotify_event*>(event_buffer + offset);
+                    offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+                    auto directory = internal.watched_directories.find(event->wd);
+                    if (event->len == 0 || directory == internal.watched_directories.end())
+                        continue;
+
+                    pending_files[directory->second / event->name] = now;
+                }
+            }
+
+            u64 now = get_milliseconds();
+            std::lock_guard lock(internal.mutex);
+            for (auto pending_file = pending_files.begin(); pending_file != pending_files.end();)
+            {
+                if (now - pending_file->second < FILE_WATCH_DEBOUNCE_MS)
+                {
+                    ++pending_file;
+                    continue;
+                }
+
+                internal.changed_files.push_back(pending_file->first);
+                internal.has_changed_files = true;
+                pending_file = pending_files.erase(pending_file);
+            }
+        }
+    }
+
+    // inotify watches directories rather than files, so atomic saves that replace the file are seen too
+    void watch_file_events(const std::filesystem::path& path)
+    {
+        if (internal.inotify_failed)
+            return;
+
+        if (internal.inotify_fd < 0 && !internal.watcher_thread.joinable())
+        {
+            internal.inotify_fd = inotify_init1(IN_CLOEXEC);
+            if (internal.inotify_fd < 0)
+            {
+                internal.inotify_failed = true;
+                printf("inotify is not available, polling watched files instead.\n");
+                return;
+            }
+            internal.watcher_thread = std::thread(run_file_watcher);
+        }
+
+        if (internal.inotify_fd < 0)
+            return;
+
+        std::filesystem::path canonical_path = std::filesystem::weakly_canonical(path);
+        std::filesystem::path directory = canonical_path.parent_path();
+
+        i32 watch_descriptor = inotify_add_watch(internal.inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (watch_descriptor < 0)
+        {
+            printf("Failed to watch %s for changes, polling it instead.\n", directory.c_str());
+            internal.watched_files.at(path).polled = true;
+            return;
+        }
+
+        {
+            std::lock_guard lock(internal.mutex);
+            internal.watched_directories[watch_descriptor] = directory;
+        }
+        internal.watched_files_by_canonical_path[canonical_path].push_back(path);
+    }
+
+    void run_changed_file_callbacks()
+    {
+        std::vector<std::filesystem::path> changed_files;
+        {
+            std::lock_guard lock(internal.mutex);
+            changed_files.swap(internal.changed_files);
+            internal.has_changed_files = false;
+        }
+
+        for (const auto& changed_file : changed_files)
+        {
+            auto watched_paths = internal.watched_files_by_canonical_path.find(changed_file);
+            if (watched_paths == internal.watched_files_by_canonical_path.end())
+                continue;
+
+            for (const auto& watched_path : watched_paths->second)
+                internal.watched_files.at(watched_path).callback();
+        }
+    }
+#endif
+
+    MappedFile::MappedFile(const std::filesystem::path& path)
+    {
+#if _WIN32
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            printf("Failed to map file %s.\n", path.string().c_str());
+            return;
+        }
+        file_handle = file;
+
+        LARGE_INTEGER file_size {};
+        GetFileSizeEx(file, &file_size);
+        if (file_size.QuadPart == 0)
+        {
+            close();
+            return;
+        }
+
+        mapping_handle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_handle == nullptr)
+        {
+            printf("Failed to map file %s.\n", path.string().c_str());
+            close();
+            return;
+        }
+
+        data = static_cast<const u8*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+        size = data ? static_cast<usize>(file_size.QuadPart) : 0;
+#else
+        i32 file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            printf("Failed to map file %s.\n", path.string().c_str());
+            return;
+        }
+
+        struct stat file_status {};
+        if (fstat(file, &file_status) != 0 || file_status.st_size == 0)
+        {
+            ::close(file);
+            return;
+        }
+
+        // The mapping keeps the file alive, so the descriptor isn't needed past this
+        void* mapping = mmap(nullptr, static_cast<usize>(file_status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+        ::close(file);
+
+        if (mapping == MAP_FAILED)
+        {
+            printf("Failed to map file %s.\n", path.string().c_str());
+            return;
+        }
+
+        // Everything we map is read front to back once, so read ahead aggressively and drop pages behind us
+        madvise(mapping, static_cast<usize>(file_status.st_size), MADV_SEQUENTIAL);
+        madvise(mapping, static_cast<usize>(file_status.st_size), MADV_WILLNEED);
+
+        data = static_cast<const u8*>(mapping);
+        size = static_cast<usize>(file_status.st_size);
+#endif
+    }
+
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+
+    MappedFile::MappedFile(MappedFile&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            data = std::exchange(other.data, nullptr);
+            size = std::exchange(other.size, 0);
+#if _WIN32
+            file_handle = std::exchange(other.file_handle, nullptr);
+            mapping_handle = std::exchange(other.mapping_handle, nullptr);
+#endif
+        }
+        return *this;
+    }
+
+    void MappedFile::close()
+    {
+#if _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping_handle)
+            CloseHandle(mapping_handle);
+        if (file_handle)
+            CloseHandle(file_handle);
+        mapping_handle = nullptr;
+        file_handle = nullptr;
+#else
+        if (data)
+            munmap(const_cast<u8*>(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
     std::vector<u8> read_binary_file(const std::filesystem::path& path)
     {
         std::vector<u8> buffer(0);
@@ -35,7 +352,7 @@ namespace IO
 
         if (!file.is_open())
         {
-            printf("Failed to read file %ls.\n", path.c_str());
+            printf("Failed to read file %s.\n", path.string().c_str());
             return buffer;
         }
 
@@ -46,82 +363,426 @@ namespace IO
         return buffer;
     }
 
-    std::vector<std::filesystem::path> parse_dependencies_from_file(const std::string& file_data)
+    bool write_binary_file(const std::filesystem::path& path, const void* data, usize size)
     {
-        usize target_end_index = file_data.find(": ") + 1; // Skip colon and next white space
-        std::string input = file_data.substr(target_end_index, file_data.size());
+        std::filesystem::path temporary_path = path;
+        temporary_path += ".tmp";
 
-        // Normalize slash style used
-        for (char& c : input)
         {
-            if (c == '/')
-                c = '\\';
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            if (!file.is_open())
+                return false;
+
+            file.write(static_cast<const std::fstream::char_type*>(data), static_cast<std::streamsize>(size));
+            if (!file)
+                return false;
         }
 
+        std::error_code error;
+        std::filesystem::rename(temporary_path, path, error);
+        return !error;
+    }
+
+    /* Make rule written by glslc -MD, "target: dependency dependency ...".
+        Dependencies are separated by white space or line continuations, spaces within a path are escaped with a backslash.
+    */
+    std::vector<std::filesystem::path> parse_dependencies_from_file(const std::string& file_data)
+    {
+        usize target_end_index = file_data.find(": ") + 1; // Skip colon and next white space
+        std::string input = file_data.substr(target_end_index, file_data.size());
+
         std::vector<std::filesystem::path> paths;
+        std::string path;
 
-        usize i { 0 };
-        while (i < input.size())
+        auto end_path = [&paths, &path]()
         {
-            if (i + 2 < input.size() && std::isalpha(input[i]) && input[i + 1] == ':' && input[i + 2] == '\\')
-            {
-                usize start { i };
-                i += 3;
+            if (path.empty())
+                return;
 
-                // We are within the string, and the current character is printable
-                while (i < input.size() && std::isprint(input[i]) && input[i] != ' ')
-                {
-                    i++;
-                }
+#if _WIN32
+            // Normalize slash style used
+            for (char& c : path)
+            {
+                if (c == '/')
+                    c = '\\';
+            }
+#endif
+            paths.emplace_back(path);
+            path.clear();
+        };
 
-                std::filesystem::path path (input.substr(start, i - start));
+        for (usize i = 0; i < input.size(); i++)
+        {
+            char c = input[i];
+            char next = i + 1 < input.size() ? input[i + 1] : '\0';
 
-                paths.push_back(path);
-                continue;
+            if (c == '\\' && next == ' ')
+            {
+                path += ' ';
+                i++;
+            }
+            else if ((c == '\\' && (next == '\n' || next == '\r')) || std::isspace(static_cast<unsigned char>(c)))
+            {
+                end_path();
+            }
+            else
+            {
+                path += c;
             }
-            i++;
         }
+        end_path();
 
         return paths;
     }
 
+    std::vector<std::filesystem::path> read_dependencies(const std::filesystem::path& path)
+    {
+        std::filesystem::path dependencies_file = (path.string() + ".dependencies");
+        if (!std::filesystem::exists(dependencies_file))
+            return {};
+
+        auto dependencies_file_data = read_binary_file(dependencies_file);
+        std::string depfile_content(reinterpret_cast<const char*>(dependencies_file_data.data()), dependencies_file_data.size());
+
+        std::vector<std::filesystem::path> dependencies;
+        for (const auto& dependency : parse_dependencies_from_file(depfile_content))
+        {
+            if (dependency.filename() != path.filename())
+                dependencies.push_back(dependency);
+        }
+        return dependencies;
+    }
+
     void watch_for_file_update(const std::filesystem::path& path, const std::function<void()>& on_update_callback)
     {
         auto entry = internal.watched_files.find(path);
 
         if (entry == internal.watched_files.end())
         {
-            std::filesystem::path auto_full_path(path);
-
-            internal.watched_files.insert({ path, {path, std::vector<std::function<void()>>(), 0} });
+            internal.watched_files.insert({ path, { .path = path } });
             entry = internal.watched_files.find(path);
             entry->second.last_write_time = static_cast<u64>(std::filesystem::last_write_time(path).time_since_epoch().count());
+#if IO_INOTIFY
+            watch_file_events(path);
+#endif
+            entry->second.dependencies = read_dependencies(path);
+        }
+
+        entry->second.on_update_callbacks.push_back(on_update_callback);
+        entry->second.dependency_callbacks.push_back(on_update_callback);
+
+        // Watching the dependencies inserts into watched_files, which invalidates entry
+        std::vector<std::filesystem::path> dependencies = entry->second.dependencies;
+        for (const auto& dependency : dependencies)
+            watch_for_file_update(dependency, on_update_callback);
+    }
+
+    void update_file_dependencies(const std::filesystem::path& path)
+    {
+        auto entry = internal.watched_files.find(path);
+        if (entry == internal.watched_files.end())
+            return;
+
+        std::vector<std::filesystem::path> added_dependencies;
+        for (const auto& dependency : read_dependencies(path))
+        {
+            if (std::find(entry->second.dependencies.begin(), entry->second.dependencies.end(), dependency) == entry->second.dependencies.end())
+                added_dependencies.push_back(dependency);
+        }
+
+        // Dependencies that are gone stay watched, the callbacks can't be told apart to remove them again
+        entry->second.dependencies.insert(entry->second.dependencies.end(), added_dependencies.begin(), added_dependencies.end());
+
+        std::vector<std::function<void()>> callbacks = entry->second.dependency_callbacks;
+        for (const auto& dependency : added_dependencies)
+        {
+            for (const auto& callback : callbacks)
+                watch_for_file_update(dependency, callback);
+        }
+    }
+
+    // Size of the read once the file size is known, false when the range isn't inside the file
+    bool resolve_read_size(ReadRequest& request, u64 file_size)
+    {
+        if (request.result.offset > file_size || request.size > file_size - request.result.offset)
+            return false;
+
+        usize size = request.size != 0 ? request.size : static_cast<usize>(file_size - request.result.offset);
+        request.result.data.resize(size);
+        return true;
+    }
+
+    void complete_read(ReadRequest&& request)
+    {
+        std::lock_guard lock(internal.read_mutex);
+        internal.completed_reads.push_back(std::move(request));
+        internal.has_completed_reads = true;
+    }
+
+    void read_blocking(ReadRequest& request)
+    {
+        std::error_code error;
+        u64 file_size = std::filesystem::file_size(request.result.path, error);
+        if (error || !resolve_read_size(request, file_size))
+            return;
+
+        std::ifstream file(request.result.path, std::ios::binary);
+        file.seekg(static_cast<std::streamoff>(request.result.offset));
+        file.read(reinterpret_cast<std::fstream::char_type*>(request.result.data.data()), static_cast<std::streamsize>(request.result.data.size()));
+        request.result.succeeded = file.good();
+    }
+
+    // Every thread blocks on one read at a time, together they keep READ_THREAD_COUNT reads in flight
+    void run_read_thread()
+    {
+        while (true)
+        {
+            ReadRequest request;
+            {
+                std::unique_lock lock(internal.read_mutex);
+                internal.read_queued.wait(lock, []() { return internal.reads_stopping || !internal.queued_reads.empty(); });
+
+                if (internal.reads_stopping)
+                    return;
+
+                request = std::move(internal.queued_reads.front());
+                internal.queued_reads.pop_front();
+            }
+
+            read_blocking(request);
+            complete_read(std::move(request));
+        }
+    }
+
+#if IO_URING
+    struct InFlightRead
+    {
+        ReadRequest request;
+        i32 file;
+        usize bytes_read;
+    };
+
+    // The rest of the read, the kernel can return less than asked for
+    void prepare_read(std::unordered_map<u64, InFlightRead>& in_flight_reads, u64 read_id)
+    {
+        InFlightRead& read = in_flight_reads.at(read_id);
+        auto& data = read.request.result.data;
+
+        io_uring_sqe* submission = io_uring_get_sqe(&internal.read_ring);
+        io_uring_prep_read(submission, read.file, data.data() + read.bytes_read, static_cast<u32>(data.size() - read.bytes_read), read.request.result.offset + read.bytes_read);
+        io_uring_sqe_set_data64(submission, read_id);
+    }
+
+    /* Takes every queued read there is room for, submits them with one system call, then reaps whatever completed.
+        While reads are in flight it only sleeps for short waits on the completion queue, so new reads don't wait for old ones.
+    */
+    void run_uring_read_thread()
+    {
+        std::unordered_map<u64, InFlightRead> in_flight_reads; // Nodes don't move, so the buffers stay put while the kernel writes them
+        u64 next_read_id { 0 };
+        std::vector<ReadRequest> new_requests;
+
+        while (true)
+        {
+            {
+                std::unique_lock lock(internal.read_mutex);
+                if (in_flight_reads.empty())
+                    internal.read_queued.wait(lock, []() { return internal.reads_stopping || !internal.queued_reads.empty(); });
 
-            std::filesystem::path dependencies_file = (path.string() + ".dependencies");
-            if (std::filesystem::exists(dependencies_file))
+                if (internal.reads_stopping)
+                    break;
+
+                while (!internal.queued_reads.empty() && in_flight_reads.size() + new_requests.size() < READ_RING_ENTRIES)
+                {
+                    new_requests.push_back(std::move(internal.queued_reads.front()));
+                    internal.queued_reads.pop_front();
+                }
+            }
+
+            bool submit = false;
+            for (auto& request : new_requests)
+            {
+                i32 file = open(request.result.path.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat file_status {};
+                bool valid = file >= 0 && fstat(file, &file_status) == 0 && resolve_read_size(request, static_cast<u64>(file_status.st_size));
+
+                // An empty range has nothing to submit
+                if (!valid || request.result.data.empty())
+                {
+                    request.result.succeeded = valid;
+                    if (file >= 0)
+                        close(file);
+                    complete_read(std::move(request));
+                    continue;
+                }
+
+                u64 read_id = next_read_id++;
+                in_flight_reads.emplace(read_id, InFlightRead { std::move(request), file, 0 });
+                prepare_read(in_flight_reads, read_id);
+                submit = true;
+            }
+            new_requests.clear();
+
+            if (submit)
+                io_uring_submit(&internal.read_ring);
+
+            io_uring_cqe* completion = nullptr;
+            __kernel_timespec timeout { .tv_sec = 0, .tv_nsec = 1000000 };
+            if (in_flight_reads.empty() || io_uring_wait_cqe_timeout(&internal.read_ring, &completion, &timeout) != 0)
+                continue;
+
+            bool resubmit = false;
+            while (io_uring_peek_cqe(&internal.read_ring, &completion) == 0)
             {
-                auto dependencies_file_data = read_binary_file(dependencies_file);
-                std::string depfile_content(reinterpret_cast<const char*>(dependencies_file_data.data()), dependencies_file_data.size());
-                auto dependencies = parse_dependencies_from_file(depfile_content);
+                u64 read_id = io_uring_cqe_get_data64(completion);
+                i32 bytes_read = completion->res;
+                io_uring_cqe_seen(&internal.read_ring, completion);
 
-                for (const auto& dependency : dependencies)
+                InFlightRead& read = in_flight_reads.at(read_id);
+                if (bytes_read > 0 && read.bytes_read + static_cast<usize>(bytes_read) < read.request.result.data.size())
                 {
-                    if (dependency.filename() != path.filename())
-                    {
-                        watch_for_file_update(dependency, on_update_callback);
-                    }
+                    read.bytes_read += static_cast<usize>(bytes_read);
+                    prepare_read(in_flight_reads, read_id);
+                    resubmit = true;
+                    continue;
                 }
+
+                // Errors come back as negative errno, reaching the end of the file early as 0
+                read.request.result.succeeded = bytes_read > 0;
+                close(read.file);
+                complete_read(std::move(read.request));
+                in_flight_reads.erase(read_id);
             }
+
+            if (resubmit)
+                io_uring_submit(&internal.read_ring);
         }
 
-        entry->second.on_update_callbacks.push_back(on_update_callback);
+        // The kernel still writes into the buffers of reads in flight, so they have to finish before they are freed
+        while (!in_flight_reads.empty())
+        {
+            io_uring_cqe* completion = nullptr;
+            if (io_uring_wait_cqe(&internal.read_ring, &completion) != 0)
+                break;
+
+            u64 read_id = io_uring_cqe_get_data64(completion);
+            io_uring_cqe_seen(&internal.read_ring, completion);
+            close(in_flight_reads.at(read_id).file);
+            in_flight_reads.erase(read_id);
+        }
+    }
+#endif
+
+    void start_read_threads()
+    {
+#if IO_URING
+        if (io_uring_queue_init(READ_RING_ENTRIES, &internal.read_ring, 0) == 0)
+        {
+            internal.read_ring_initialized = true;
+            internal.read_threads.emplace_back(run_uring_read_thread);
+            return;
+        }
+        printf("io_uring is not available, reading files with a thread pool instead.\n");
+#endif
+
+        for (u32 i = 0; i < READ_THREAD_COUNT; i++)
+            internal.read_threads.emplace_back(run_read_thread);
+    }
+
+    void read_async(const std::filesystem::path& path, ReadCallback&& on_read, u64 offset, usize size)
+    {
+        if (internal.read_threads.empty())
+            start_read_threads();
+
+        {
+            std::lock_guard lock(internal.read_mutex);
+            internal.queued_reads.push_back(
+            {
+                .result = { .path = path, .offset = offset, .data = {}, .succeeded = false },
+                .size = size,
+                .on_read = std::move(on_read),
+            });
+        }
+        internal.pending_read_count++;
+        internal.read_queued.notify_one();
+    }
+
+    u32 get_pending_read_count()
+    {
+        return internal.pending_read_count;
+    }
+
+    void run_read_callbacks()
+    {
+        std::vector<ReadRequest> completed_reads;
+        {
+            std::lock_guard lock(internal.read_mutex);
+            completed_reads.swap(internal.completed_reads);
+            internal.has_completed_reads = false;
+        }
+
+        for (auto& read : completed_reads)
+        {
+            internal.pending_read_count--;
+            read.on_read(read.result);
+        }
     }
 
     void update()
     {
+        if (internal.has_completed_reads)
+            run_read_callbacks();
+
+#if IO_INOTIFY
+        if (internal.inotify_fd >= 0)
+        {
+            // Nothing to do on the main thread until the watcher thread posted a change, except for the files inotify couldn't watch
+            if (internal.has_changed_files)
+                run_changed_file_callbacks();
+
+            for (auto& [key,watched_file] : internal.watched_files)
+            {
+                if (watched_file.polled)
+                    watched_file.check_for_update_and_callback();
+            }
+            return;
+        }
+#endif
+
         for (auto& [key,watched_file] : internal.watched_files)
             watched_file.check_for_update_and_callback();
     }
 
+    void terminate()
+    {
+        {
+            std::lock_guard lock(internal.read_mutex);
+            internal.reads_stopping = true;
+            internal.queued_reads.clear();
+        }
+        internal.read_queued.notify_all();
+
+        for (auto& read_thread : internal.read_threads)
+            read_thread.join();
+        internal.read_threads.clear();
+        internal.completed_reads.clear();
+
+#if IO_URING
+        if (internal.read_ring_initialized)
+            io_uring_queue_exit(&internal.read_ring);
+        internal.read_ring_initialized = false;
+#endif
+
+#if IO_INOTIFY
+        internal.stopping = true;
+        if (internal.watcher_thread.joinable())
+            internal.watcher_thread.join();
+
+        if (internal.inotify_fd >= 0)
+            close(internal.inotify_fd);
+        internal.inotify_fd = -1;
+#endif
+    }
+
 
 }
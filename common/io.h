@@ -1,13 +1,66 @@
 ﻿#pragma once
 #include <filesystem>
 #include <functional>
+#include <span>
 #include <vector>
 #include "types.h"
 
 namespace IO
 {
+    /* A whole file mapped read only into memory, pages are read in by the OS as they are first touched.
+        Nothing is copied or allocated, so prefer it over read_binary_file for anything that is only read once.
+    */
+    struct MappedFile
+    {
+        const u8* data { nullptr };
+        usize size { 0 };
+#if _WIN32
+        void* file_handle { nullptr };
+        void* mapping_handle { nullptr };
+#endif
+
+        MappedFile() = default;
+        // Check is_open, a missing or empty file is not mapped
+        explicit MappedFile(const std::filesystem::path& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        MappedFile(MappedFile&& other) noexcept;
+        MappedFile& operator=(MappedFile&& other) noexcept;
+
+        bool is_open() const { return data != nullptr; }
+        std::span<const u8> get_data() const { return { data, size }; }
+        void close();
+    };
+
     std::vector<u8> read_binary_file(const std::filesystem::path& path);
+
+    struct ReadResult
+    {
+        std::filesystem::path path;
+        u64 offset;
+        std::vector<u8> data;
+        bool succeeded;
+    };
+    typedef std::function<void(ReadResult& result)> ReadCallback;
+
+    /* Queues a read of size bytes at offset, or up to the end of the file when size is 0, and returns straight away.
+        Reads are done in batches through io_uring where it is available, by a few reading threads otherwise.
+        on_read runs from update on the main thread, so many reads can be queued without waiting on the disk in between.
+    */
+    void read_async(const std::filesystem::path& path, ReadCallback&& on_read, u64 offset = 0, usize size = 0);
+    // Reads whose callback hasn't run yet
+    u32 get_pending_read_count();
+    // Written to a temporary file that then replaces path, so a crash never leaves half a file behind
+    bool write_binary_file(const std::filesystem::path& path, const void* data, usize size);
+    // The callback runs from update on the main thread, also when one of the files in file_path.dependencies changes
     void watch_for_file_update(const std::filesystem::path& file_path, const std::function<void()>& callback);
+    // Reads file_path.dependencies again and watches the files added to it, call it whenever the file rewrote them
+    void update_file_dependencies(const std::filesystem::path& file_path);
 
+    // Runs the callbacks of finished reads and polls the watched files, with inotify only the files the watcher thread saw change are handled
     void update();
+    // Stops the watcher and reading threads, the callbacks of reads still pending never run
+    void terminate();
 }
@@ -3,11 +3,14 @@
 #include <cstdio>
 
 #include "../../common/math.h"
+#include "../../renderer/profiling.h"
 
 namespace Data::AS
 {
     VoxelBrickAS build_brick_AS(const RawVoxelModel& model)
     {
+        PROFILE_HOST_SCOPE("build brick AS");
+
         VoxelBrickAS brick_as;
 
         // VOX has different space so we use X Z Y to get the size in voxels
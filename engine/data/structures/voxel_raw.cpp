@@ -1,7 +1,10 @@
 ﻿#include "voxel_raw.h"
+#include "../../renderer/profiling.h"
 
 Data::RawVoxelModel Data::build_raw_voxel_model(const ogt_vox_model& model, glm::ivec3 repeat)
 {
+    PROFILE_HOST_SCOPE("build raw voxel model");
+
     RawVoxelModel raw_model;
 
     // VOX has different space so we use X Z Y to get the size in voxels
@@ -1,6 +1,7 @@
 ﻿#include "voxel_model.h"
 #include "../renderer/renderer_core.h"
 #include "../renderer/device_resources.h"
+#include "../renderer/profiling.h"
 #include "../../common/io.h"
 #include "../../common/math.h"
 #include "../data/structures/voxel_brick.h"
@@ -40,6 +41,7 @@ struct VoxelModelData
 struct
 {
     std::unordered_map<std::string, VoxelModelData> voxel_models;
+    u32 uploaded_instance_count { 0 };
 } internal;
 
 constexpr i32 instance_count = 64;
@@ -52,6 +54,8 @@ struct
 
 void VoxelModels::upload_models_to_gpu()
 {
+    PROFILE_HOST_SCOPE("upload voxel models");
+
     for (i32 i = 0; i < instance_count; i++)
     {
         device.instances[i].size_in_bricks = glm::ivec4(0, 0, 0, 0);
@@ -71,8 +75,9 @@ void VoxelModels::upload_models_to_gpu()
 
     i32 header_data_size = instance_count * sizeof(DeviceVoxelModelInstanceData);
     i32 total_data_size = header_data_size + voxel_brick_count_of_all_models_combined * sizeof(Data::AS::VoxelOccupancyBrick);
-    u8* mapped_data { nullptr };
-    mapped_data = new u8[total_data_size];
+    // Written straight into staging memory, no host side copy of the whole thing is made
+    auto staging = DeviceResources::allocate_staging(total_data_size);
+    u8* mapped_data = static_cast<u8*>(staging.mapped_data);
 
     // Copy voxel data to GPU and set instance data
     i32 voxel_brick_offset { 0 };
@@ -96,12 +101,18 @@ void VoxelModels::upload_models_to_gpu()
         voxel_brick_offset += static_cast<i32>(brick_count);
     }
 
+    internal.uploaded_instance_count = static_cast<u32>(instance_index);
+
     // Copy instance headers to GPU
     memcpy(mapped_data, device.instances, header_data_size);
 
-    DeviceResources::immediate_copy_data_to_gpu("voxel_data", mapped_data, total_data_size);
-    delete[] mapped_data;
+    DeviceResources::queue_copy_to_gpu(staging, "voxel_data");
+
+}
 
+u32 VoxelModels::get_instance_count()
+{
+    return internal.uploaded_instance_count;
 }
 
 // Holy this is a mess, but it works
@@ -121,8 +132,11 @@ void transform_vox_transform_to_engine_transform(glm::mat4& transform)
 
 void VoxelModels::load(std::filesystem::path path, glm::ivec3 repeat)
 {
-    auto ogt_file = IO::read_binary_file(path);
-    const ogt_vox_scene* scene = ogt_vox_read_scene(ogt_file.data(), ogt_file.size());
+    PROFILE_HOST_SCOPE("load voxel models");
+
+    // ogt_vox only reads the file while parsing, so it can stay a mapping of the file on disk
+    IO::MappedFile ogt_file(path);
+    const ogt_vox_scene* scene = ogt_vox_read_scene(ogt_file.data, static_cast<u32>(ogt_file.size));
     auto filename = path.filename().string();
 
     std::vector<VoxelModelData> new_models;
@@ -1,8 +1,12 @@
 ﻿#include <filesystem>
 #include <glm/glm.hpp>
 
+#include "../../common/types.h"
+
 namespace VoxelModels
 {
     void load(std::filesystem::path path, glm::ivec3 repeat = glm::ivec3(1));
     void upload_models_to_gpu();
+    // Instances written by the last upload, the rest of the instance headers are empty
+    u32 get_instance_count();
 }
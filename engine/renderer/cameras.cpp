@@ -14,6 +14,12 @@ namespace Renderer
         return internal.camera_instances[internal.current_camera_index];
     }
 
+    void Cameras::start_of_frame_update()
+    {
+        for (auto& camera_instance : internal.camera_instances)
+            camera_instance.previous_camera_matrix = camera_instance.camera_matrix;
+    }
+
     CameraInstanceData Cameras::get_current_camera_data_copy()
     {
         return get_current_camera_ref();
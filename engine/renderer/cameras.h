@@ -8,10 +8,12 @@ namespace Renderer
     struct CameraInstanceData
     {
         glm::mat4 camera_matrix{ glm::mat4(1) };
+        glm::mat4 previous_camera_matrix{ glm::mat4(1) }; // What camera_matrix was last frame, for reprojecting
     };
 
     namespace Cameras
     {
+        // Call before the camera matrices of the frame are set
         void start_of_frame_update();
         CameraInstanceData get_current_camera_data_copy();
 
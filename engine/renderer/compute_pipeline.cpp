@@ -3,8 +3,13 @@
 #include "device_resources.h"
 #include "../../common/types.h"
 #include "renderer_core.h"
+#include "pipeline_cache.h"
 
-VkShaderModule create_shader_module(const std::vector<u8>& bytecode)
+#include <cstring>
+
+#include "SDL3/SDL_timer.h"
+
+VkShaderModule create_shader_module(std::span<const u8> bytecode)
 {
     VkShaderModuleCreateInfo shader_module_create_info
     {
@@ -20,7 +25,7 @@ VkShaderModule create_shader_module(const std::vector<u8>& bytecode)
     return shader_module;
 }
 
-void ComputePipeline::dispatch(VkCommandBuffer command_buffer, u32 group_count_x, u32 group_count_y, u32 group_count_z, void* push_constants_data_ptr)
+void ComputePipeline::bind(VkCommandBuffer command_buffer, void* push_constants_data_ptr)
 {
     vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
 
@@ -47,10 +52,20 @@ void ComputePipeline::dispatch(VkCommandBuffer command_buffer, u32 group_count_x
 
     if ((push_constants_size != 0) && push_constants_data_ptr)
         vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, push_constants_size, push_constants_data_ptr);
+}
 
+void ComputePipeline::dispatch(VkCommandBuffer command_buffer, u32 group_count_x, u32 group_count_y, u32 group_count_z, void* push_constants_data_ptr)
+{
+    bind(command_buffer, push_constants_data_ptr);
     vkCmdDispatch(command_buffer, group_count_x, group_count_y, group_count_z);
 }
 
+void ComputePipeline::dispatch_indirect(VkCommandBuffer command_buffer, VkBuffer arguments_buffer, VkDeviceSize arguments_offset, void* push_constants_data_ptr)
+{
+    bind(command_buffer, push_constants_data_ptr);
+    vkCmdDispatchIndirect(command_buffer, arguments_buffer, arguments_offset);
+}
+
 void ComputePipeline::destroy()
 {
     vkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
@@ -61,15 +76,16 @@ void ComputePipeline::destroy()
 
 ComputePipelineBuilder::ComputePipelineBuilder(const std::filesystem::path& path)
 {
-    auto comp_binary = IO::read_binary_file(path);
+    // vkCreateShaderModule copies the code, so the file only has to stay mapped until then
+    IO::MappedFile comp_binary(path);
 
-    if (comp_binary.empty())
+    if (!comp_binary.is_open())
     {
-        printf("Failed to read %s compiled binary file.\n", path.c_str());
+        printf("Failed to read %s compiled binary file.\n", path.string().c_str());
         return;
     }
 
-    shader_module = create_shader_module(comp_binary);
+    shader_module = create_shader_module(comp_binary.get_data());
 }
 
 ComputePipelineBuilder& ComputePipelineBuilder::bind_storage_image(VkImageView image_view)
@@ -116,6 +132,62 @@ ComputePipelineBuilder& ComputePipelineBuilder::set_push_constants_size(VkDevice
     return *this;
 }
 
+ComputePipelineBuilder& set_specialization_constant_data(ComputePipelineBuilder& builder, u32 constant_id, const void* data, u32 size)
+{
+    // Every constant id may only be in the map once, setting it again replaces the value
+    for (auto& entry : builder.specialization_entries)
+    {
+        if (entry.constantID != constant_id)
+            continue;
+
+        // A value of another size doesn't fit where the old one was, it moves to the end and the old bytes are left unused
+        if (entry.size != size)
+        {
+            entry.offset = static_cast<u32>(builder.specialization_data.size());
+            entry.size = size;
+            builder.specialization_data.resize(builder.specialization_data.size() + size);
+        }
+
+        memcpy(builder.specialization_data.data() + entry.offset, data, size);
+        return builder;
+    }
+
+    VkSpecializationMapEntry new_specialization_entry
+    {
+        .constantID = constant_id,
+        .offset = static_cast<u32>(builder.specialization_data.size()),
+        .size = size,
+    };
+
+    builder.specialization_entries.push_back(new_specialization_entry);
+    builder.specialization_data.resize(builder.specialization_data.size() + size);
+    memcpy(builder.specialization_data.data() + new_specialization_entry.offset, data, size);
+
+    return builder;
+}
+
+ComputePipelineBuilder& ComputePipelineBuilder::set_specialization_constant(u32 constant_id, bool value)
+{
+    // GLSL bools are 32 bits wide
+    VkBool32 bool_value = value ? VK_TRUE : VK_FALSE;
+    return set_specialization_constant_data(*this, constant_id, &bool_value, sizeof(bool_value));
+}
+
+ComputePipelineBuilder& ComputePipelineBuilder::set_specialization_constant(u32 constant_id, i32 value)
+{
+    return set_specialization_constant_data(*this, constant_id, &value, sizeof(value));
+}
+
+ComputePipelineBuilder& ComputePipelineBuilder::set_specialization_constant(u32 constant_id, u32 value)
+{
+    return set_specialization_constant_data(*this, constant_id, &value, sizeof(value));
+}
+
+ComputePipelineBuilder& ComputePipelineBuilder::set_specialization_constant(u32 constant_id, f32 value)
+{
+    return set_specialization_constant_data(*this, constant_id, &value, sizeof(value));
+}
+
 ComputePipeline ComputePipelineBuilder::create(VkDevice device)
 {
     ComputePipeline generated_pipeline;
@@ -230,6 +302,14 @@ ComputePipeline ComputePipelineBuilder::create(VkDevice device)
     VK_CHECK(vkCreatePipelineLayout(Renderer::Core::get_logical_device(), &compute_pipeline_layout_create_info, nullptr, &generated_pipeline.pipeline_layout));
 
     // Create pipeline
+    VkSpecializationInfo specialization_info
+    {
+        .mapEntryCount = static_cast<u32>(specialization_entries.size()),
+        .pMapEntries = specialization_entries.data(),
+        .dataSize = specialization_data.size(),
+        .pData = specialization_data.data(),
+    };
+
     VkPipelineShaderStageCreateInfo pipeline_shader_stage_create_info
     {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
@@ -237,6 +317,7 @@ ComputePipeline ComputePipelineBuilder::create(VkDevice device)
         .stage = VK_SHADER_STAGE_COMPUTE_BIT,
         .module = shader_module,
         .pName = "main",
+        .pSpecializationInfo = specialization_entries.empty() ? nullptr : &specialization_info,
     };
 
     VkComputePipelineCreateInfo compute_pipeline_create_info
@@ -248,9 +329,37 @@ ComputePipeline ComputePipelineBuilder::create(VkDevice device)
         .layout = generated_pipeline.pipeline_layout,
     };
 
-    VK_CHECK(vkCreateComputePipelines(Renderer::Core::get_logical_device(), nullptr, 1, &compute_pipeline_create_info, nullptr, &generated_pipeline.pipeline))  ;
+    u64 creation_start = SDL_GetPerformanceCounter();
+    VK_CHECK(vkCreateComputePipelines(Renderer::Core::get_logical_device(), PipelineCache::get_handle(), 1, &compute_pipeline_create_info, nullptr, &generated_pipeline.pipeline));
+    PipelineCache::record_pipeline_creation(static_cast<f64>(SDL_GetPerformanceCounter() - creation_start) * 1000.0 / static_cast<f64>(SDL_GetPerformanceFrequency()));
     vkDestroyShaderModule(Renderer::Core::get_logical_device(), shader_module, nullptr);
 
     generated_pipeline.device = device;
     return generated_pipeline;
+}
+
+ComputePipeline& ComputePipelineVariants::get(u32 variant_key)
+{
+    auto found = pipelines.find(variant_key);
+    if (found != pipelines.end())
+        return found->second;
+
+    return pipelines.emplace(variant_key, build(variant_key)).first->second;
+}
+
+void ComputePipelineVariants::destroy()
+{
+    for (auto& [variant_key, pipeline] : pipelines)
+        pipeline.destroy();
+
+    pipelines.clear();
+}
+
+void ComputePipelineVariants::rebuild(std::vector<ComputePipeline>& replaced_pipelines)
+{
+    for (auto& [variant_key, pipeline] : pipelines)
+    {
+        replaced_pipelines.push_back(pipeline);
+        pipeline = build(variant_key);
+    }
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 ﻿#pragma once
 
+#include <functional>
+#include <unordered_map>
 #include <vector>
 
 #include "vv_vulkan.h"
@@ -21,7 +23,10 @@ struct ComputePipeline
 
     VkDeviceSize push_constants_size { 0 };
 
+    void bind(VkCommandBuffer command_buffer, void* push_constants_data_ptr = nullptr);
     void dispatch(VkCommandBuffer command_buffer, u32 group_count_x, u32 group_count_y, u32 group_count_z, void* push_constants_data_ptr = nullptr);
+    // The group counts are a VkDispatchIndirectCommand in arguments_buffer, usually written by an earlier dispatch
+    void dispatch_indirect(VkCommandBuffer command_buffer, VkBuffer arguments_buffer, VkDeviceSize arguments_offset, void* push_constants_data_ptr = nullptr);
     void destroy();
 };
 
@@ -41,6 +46,10 @@ struct ComputePipelineBuilder
     std::vector<VkBuffer> buffers {};
     std::vector<VkDeviceSize> buffer_sizes;
 
+    // Packed back to back in specialization_data, in the order they were set
+    std::vector<VkSpecializationMapEntry> specialization_entries {};
+    std::vector<u8> specialization_data {};
+
     VkShaderModule shader_module { VK_NULL_HANDLE };
     VkDeviceSize push_constants_size { 0 };
 
@@ -48,5 +57,27 @@ struct ComputePipelineBuilder
     ComputePipelineBuilder& bind_storage_image(VkImageView image_view);
     ComputePipelineBuilder& bind_storage_buffer(const std::string& buffer_name);
     ComputePipelineBuilder& set_push_constants_size(VkDeviceSize size);
+
+    // The type has to match the declaration of constant_id in the shader, setting an id again overwrites it
+    ComputePipelineBuilder& set_specialization_constant(u32 constant_id, bool value);
+    ComputePipelineBuilder& set_specialization_constant(u32 constant_id, i32 value);
+    ComputePipelineBuilder& set_specialization_constant(u32 constant_id, u32 value);
+    ComputePipelineBuilder& set_specialization_constant(u32 constant_id, f32 value);
+
     ComputePipeline create(VkDevice device);
+};
+
+/* Differently specialized pipelines of the same shader, each one is only built the first time it is asked for.
+    The key is whatever the build function needs to tell the variants apart, usually bits of its specialization constants.
+*/
+struct ComputePipelineVariants
+{
+    std::function<ComputePipeline(u32 variant_key)> build;
+    std::unordered_map<u32, ComputePipeline> pipelines;
+
+    ComputePipeline& get(u32 variant_key);
+    // Every variant is built again when it is next asked for
+    void destroy();
+    // Builds every variant that was built before again, for hot reloading. The replaced pipelines are appended to replaced_pipelines
+    void rebuild(std::vector<ComputePipeline>& replaced_pipelines);
 };
\ No newline at end of file
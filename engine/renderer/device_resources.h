@@ -4,6 +4,9 @@
 #include "vv_vulkan.h"
 #include "vk_mem_alloc.h"
 
+// Size of the persistently mapped ring every upload is staged through, uploads larger than this get their own staging buffer
+#define DEVICE_RESOURCES_STAGING_RING_SIZE (64 * 1024 * 1024)
+
 namespace DeviceResources
 {
     struct Buffer
@@ -11,11 +14,44 @@ namespace DeviceResources
         VkBuffer handle { VK_NULL_HANDLE };
         VkDeviceSize size { 0 };
         VmaAllocation allocation { VK_NULL_HANDLE };
+        void* mapped_data { nullptr }; // Only set for readback buffers
+    };
+
+    struct StagingAllocation
+    {
+        void* mapped_data { nullptr };
+        VkDeviceSize size { 0 };
+
+        VkBuffer buffer { VK_NULL_HANDLE };
+        VkDeviceSize offset { 0 };
     };
 
     Buffer create_buffer(const std::string& buffer_name, VkDeviceSize size);
+    // Host visible and persistently mapped, call invalidate_readback_buffer before reading what the GPU wrote
+    Buffer create_readback_buffer(const std::string& buffer_name, VkDeviceSize size);
+    void invalidate_readback_buffer(const std::string& buffer_name, VkDeviceSize offset, VkDeviceSize size);
     Buffer get_buffer(const std::string& buffer_name);
-    void immediate_copy_data_to_gpu(const std::string& buffer_name, void* data, VkDeviceSize size_in_bytes);
+
+    /* For buffers whose memory is owned elsewhere (render graph transients), so pipelines can still bind them by name.
+        Registered buffers are never destroyed here, unregister them before destroying them.
+    */
+    void register_buffer(const std::string& buffer_name, const Buffer& buffer);
+    void unregister_buffer(const std::string& buffer_name);
+
+    /* Space in the staging ring that can be written to directly, it stays valid until the copy queued
+        from it has been flushed. When the ring is full it is a staging buffer of its own instead.
+        Only call from the main thread.
+    */
+    StagingAllocation allocate_staging(VkDeviceSize size);
+    void queue_copy_to_gpu(const StagingAllocation& source, const std::string& buffer_name, VkDeviceSize destination_offset = 0);
+    // Same as allocate_staging and queue_copy_to_gpu, for data that already lives somewhere else on the host
+    void copy_data_to_gpu(const std::string& buffer_name, const void* data, VkDeviceSize size_in_bytes);
+
+    /* Submits every queued copy in one transfer submit, the copies are visible to every frame begun after this.
+        Core calls this at the start of every frame before recording it, returns the timeline value of the submit (0 if nothing was queued).
+        The copies wait for the frames still in flight, so a buffer can be uploaded to again while they use it.
+    */
+    u64 flush_staging_uploads();
 
     void initialize();
     void terminate();
@@ -0,0 +1,155 @@
+﻿#include "pipeline_cache.h"
+#include "renderer_core.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../../common/io.h"
+
+/* The driver puts its own header in front of the data as well, but that has no driver version
+    and a mismatching cache is only guaranteed to be ignored, not rejected, so we check ourselves
+*/
+struct PipelineCacheFileHeader
+{
+    u32 magic;
+    u32 vendor_id;
+    u32 device_id;
+    u32 driver_version;
+    u8 pipeline_cache_uuid[VK_UUID_SIZE];
+    u64 data_size;
+};
+
+constexpr u32 PIPELINE_CACHE_FILE_MAGIC { 0x43505656 }; // "VVPC"
+
+struct
+{
+    VkPipelineCache handle { VK_NULL_HANDLE };
+    std::filesystem::path file_path;
+    bool loaded_from_disk { false };
+
+    f64 pipeline_creation_time_ms { 0.0 };
+    u32 created_pipeline_count { 0 };
+} internal;
+
+PipelineCacheFileHeader get_expected_header()
+{
+    auto& properties = Renderer::Core::get_physical_device_properties().properties.properties;
+
+    PipelineCacheFileHeader header
+    {
+        .magic = PIPELINE_CACHE_FILE_MAGIC,
+        .vendor_id = properties.vendorID,
+        .device_id = properties.deviceID,
+        .driver_version = properties.driverVersion,
+        .data_size = 0,
+    };
+    memcpy(header.pipeline_cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    return header;
+}
+
+// Returns the cache data after the header, or nothing when the file is missing or from another device or driver
+std::vector<u8> read_cache_file(const std::filesystem::path& path)
+{
+    if (!std::filesystem::exists(path))
+    {
+        printf("No pipeline cache at %s, starting cold.\n", path.string().c_str());
+        return {};
+    }
+
+    auto file_data = IO::read_binary_file(path);
+    if (file_data.size() < sizeof(PipelineCacheFileHeader))
+    {
+        printf("Pipeline cache %s is truncated, starting cold.\n", path.string().c_str());
+        return {};
+    }
+
+    PipelineCacheFileHeader header;
+    memcpy(&header, file_data.data(), sizeof(header));
+
+    PipelineCacheFileHeader expected_header = get_expected_header();
+    bool same_device = header.magic == expected_header.magic
+        && header.vendor_id == expected_header.vendor_id
+        && header.device_id == expected_header.device_id
+        && header.driver_version == expected_header.driver_version
+        && memcmp(header.pipeline_cache_uuid, expected_header.pipeline_cache_uuid, VK_UUID_SIZE) == 0;
+
+    if (!same_device)
+    {
+        printf("Pipeline cache %s was written by a different device or driver, starting cold.\n", path.string().c_str());
+        return {};
+    }
+
+    if (header.data_size != file_data.size() - sizeof(PipelineCacheFileHeader))
+    {
+        printf("Pipeline cache %s is truncated, starting cold.\n", path.string().c_str());
+        return {};
+    }
+
+    return std::vector<u8>(file_data.begin() + sizeof(PipelineCacheFileHeader), file_data.end());
+}
+
+void PipelineCache::initialize(const std::filesystem::path& cache_file_path)
+{
+    internal.file_path = cache_file_path;
+
+    std::vector<u8> initial_data = read_cache_file(cache_file_path);
+    internal.loaded_from_disk = !initial_data.empty();
+
+    VkPipelineCacheCreateInfo pipeline_cache_create_info
+    {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = initial_data.size(),
+        .pInitialData = initial_data.empty() ? nullptr : initial_data.data(),
+    };
+
+    VK_CHECK(vkCreatePipelineCache(Renderer::Core::get_logical_device(), &pipeline_cache_create_info, nullptr, &internal.handle));
+}
+
+void PipelineCache::terminate()
+{
+    VkDevice device = Renderer::Core::get_logical_device();
+
+    size_t data_size = 0;
+    VK_CHECK(vkGetPipelineCacheData(device, internal.handle, &data_size, nullptr));
+
+    std::vector<u8> file_data(sizeof(PipelineCacheFileHeader) + data_size);
+    VK_CHECK(vkGetPipelineCacheData(device, internal.handle, &data_size, file_data.data() + sizeof(PipelineCacheFileHeader)));
+    file_data.resize(sizeof(PipelineCacheFileHeader) + data_size); // Can shrink between the two calls
+
+    PipelineCacheFileHeader header = get_expected_header();
+    header.data_size = data_size;
+    memcpy(file_data.data(), &header, sizeof(header));
+
+    if (!IO::write_binary_file(internal.file_path, file_data.data(), file_data.size()))
+        printf("Failed to save pipeline cache to %s.\n", internal.file_path.string().c_str());
+
+    vkDestroyPipelineCache(device, internal.handle, nullptr);
+    internal = {};
+}
+
+VkPipelineCache PipelineCache::get_handle()
+{
+    return internal.handle;
+}
+
+bool PipelineCache::was_loaded_from_disk()
+{
+    return internal.loaded_from_disk;
+}
+
+void PipelineCache::record_pipeline_creation(f64 time_ms)
+{
+    internal.pipeline_creation_time_ms += time_ms;
+    internal.created_pipeline_count++;
+}
+
+f64 PipelineCache::get_pipeline_creation_time_ms()
+{
+    return internal.pipeline_creation_time_ms;
+}
+
+u32 PipelineCache::get_created_pipeline_count()
+{
+    return internal.created_pipeline_count;
+}
@@ -0,0 +1,25 @@
+﻿#pragma once
+
+#include <filesystem>
+
+#include "vv_vulkan.h"
+#include "../../common/types.h"
+
+/* One VkPipelineCache shared by every pipeline, kept on disk between runs so the driver
+    doesn't compile SPIR-V to device code again for pipelines it has seen before.
+    The file is only used when it was written by the same device and driver version.
+*/
+namespace PipelineCache
+{
+    void initialize(const std::filesystem::path& cache_file_path);
+    // Writes the cache back to disk, call once no more pipelines will be created
+    void terminate();
+
+    VkPipelineCache get_handle();
+    bool was_loaded_from_disk();
+
+    // Time spent in vkCreateComputePipelines since initialize, to compare cold and warm starts
+    void record_pipeline_creation(f64 time_ms);
+    f64 get_pipeline_creation_time_ms();
+    u32 get_created_pipeline_count();
+}
@@ -1,76 +1,229 @@
 ﻿#include "profiling.h"
 
 #include "renderer_core.h"
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "SDL3/SDL_timer.h"
 
-// TODO: This code is currently NOT multithread safe
-
-/* TODO: This code is also kind of scuffed at the moment, you have to get timings before it resets, but during
-    a command buffer recording (I think)
-*/
+using ProfilingQueries::ScopeId;
+using ProfilingQueries::Timing;
+using ProfilingQueries::Counter;
 
 // This is the maximum amount of queries the user can make, the device gets double to query start + end
 constexpr u32 MAX_TIMESTAMP_QUERIES { 64 };
 constexpr u32 MAX_TIMESTAMP_QUERY_SLOTS { MAX_TIMESTAMP_QUERIES * 2 };
 
-struct DeviceTimingQueryData
+// A slice is resolved when the current frame slot comes back around, so it has to outlive every frame in flight
+static_assert(ProfilingQueries::FRAME_SLICE_COUNT >= RENDERER_MAX_FRAMES_IN_FLIGHT);
+
+constexpr u32 MAX_HOST_SCOPES { 256 };
+constexpr u32 MAX_COUNTERS { 64 };
+constexpr u32 MAX_SCOPE_DEPTH { 32 };
+
+// Per thread, finished scopes that do not fit before the next end_frame are dropped
+constexpr u32 HOST_EVENT_BUFFER_SIZE { 4096 };
+
+// Upper bound of the rolling statistics window, the window itself can be changed at runtime
+constexpr u32 MAX_STATISTICS_WINDOW { 512 };
+constexpr u32 FRAME_TIME_HISTOGRAM_BUCKETS { 32 };
+constexpr u32 MAX_SPIKE_CAPTURES { 8 };
+
+struct TimingHistory
 {
     i32 frames_since_query { 0 };
     f32 last_time{ 0.0f }; // Do not set manually
 
-    u32 last_10_write_index { 0 };
-    f32 last_10_times[10] {};
+    u32 write_index { 0 };
+    f32 samples[MAX_STATISTICS_WINDOW] {};
 
     void set_new_time(f32);
-    u32 get_index() const { return index * 2; };
-
-    DeviceTimingQueryData(u32 in_index) : index(in_index) {};
-    u32 index;
+    u32 get_sample_count(u32 window) const { return std::min(write_index, window); }
+    f32 get_sample(u32 age) const { return samples[(write_index - 1 - age) % MAX_STATISTICS_WINDOW]; }
+    f32 get_average_time(u32 window) const;
+    ProfilingQueries::TimingStatistics calculate_statistics(u32 window) const;
 };
 
-void DeviceTimingQueryData::set_new_time(f32 new_time)
+void TimingHistory::set_new_time(f32 new_time)
 {
     last_time = new_time;
-    last_10_times[last_10_write_index % 10] = new_time;
-    last_10_write_index++;
+    samples[write_index % MAX_STATISTICS_WINDOW] = new_time;
+    write_index++;
+    frames_since_query = 0;
 }
 
-struct HostTimingQueryData
+f32 TimingHistory::get_average_time(u32 window) const
 {
-    i32 frames_since_query { 0 };
-    f32 last_time{ 0.0f }; // Do not set manually
-    u32 last_10_write_index { 0 };
-    f32 last_10_times[10]{};
+    u32 count = get_sample_count(window);
+    if (count == 0)
+        return 0.0f;
 
-    u64 start_time{ 0u };
-    u64 end_time{ 0u };
+    f32 average { 0.0f };
+    for (u32 i = 0; i < count; i++)
+        average += get_sample(i);
 
-    void set_new_time(f32);
-};
+    return average / static_cast<f32>(count);
+}
 
-void HostTimingQueryData::set_new_time(f32 new_time)
+ProfilingQueries::TimingStatistics TimingHistory::calculate_statistics(u32 window) const
 {
-    last_time = new_time;
-    last_10_times[last_10_write_index % 10] = new_time;
-    last_10_write_index++;
+    ProfilingQueries::TimingStatistics statistics {};
+    statistics.sample_count = get_sample_count(window);
+
+    if (statistics.sample_count == 0)
+        return statistics;
+
+    // Only ever called from the main thread
+    static f32 sorted_samples[MAX_STATISTICS_WINDOW];
+
+    f32 sum { 0.0f };
+    for (u32 i = 0; i < statistics.sample_count; i++)
+    {
+        sorted_samples[i] = get_sample(i);
+        sum += sorted_samples[i];
+    }
+
+    std::sort(sorted_samples, sorted_samples + statistics.sample_count);
+
+    auto percentile = [&](f32 fraction)
+    {
+        u32 rank = static_cast<u32>(fraction * static_cast<f32>(statistics.sample_count - 1) + 0.5f);
+        return sorted_samples[rank];
+    };
+
+    statistics.min_ms = sorted_samples[0];
+    statistics.max_ms = sorted_samples[statistics.sample_count - 1];
+    statistics.mean_ms = sum / static_cast<f32>(statistics.sample_count);
+    statistics.p50_ms = percentile(0.50f);
+    statistics.p95_ms = percentile(0.95f);
+    statistics.p99_ms = percentile(0.99f);
+
+    return statistics;
 }
 
+struct ScopeData
+{
+    std::string name;
+    u64 name_hash { 0 };
+    ScopeId parent { ProfilingQueries::INVALID_SCOPE };
+    u32 depth { 0 };
+    TimingHistory history;
+};
+
+struct DeviceTimingQueryData : ScopeData
+{
+    u64 compute_invocations { 0 };
+
+    u32 get_index(ScopeId id) const { return id * 2; };
+};
+
+struct HostTimingQueryData : ScopeData
+{
+    u64 ticks_this_frame { 0 };
+    bool stopped_this_frame { false };
+};
+
+struct HostEvent
+{
+    ScopeId id;
+    ScopeId parent;
+    u32 depth;
+    u64 start_time;
+    u64 end_time;
+};
+
+/* Single producer (the owning thread), single consumer (end_frame). Scopes are only written
+    once they are stopped, so the consumer never sees a half finished scope.
+*/
+struct ThreadEventBuffer
+{
+    HostEvent events[HOST_EVENT_BUFFER_SIZE];
+    std::atomic<u64> write_count { 0 };
+    std::atomic<u64> read_count { 0 };
+
+    // Only touched by the owning thread
+    ScopeId open_scopes[MAX_SCOPE_DEPTH];
+    u64 open_scope_start_times[MAX_SCOPE_DEPTH];
+    u32 depth { 0 };
+};
+
 struct
 {
-    std::unordered_map<std::string, DeviceTimingQueryData> device_profiling_timing_queries;
-    std::unordered_map<std::string, HostTimingQueryData> host_profiling_timing_queries;
+    // Scopes are never removed, so their data and names stay at the same address
+    std::mutex registration_mutex;
+    DeviceTimingQueryData device_scopes[MAX_TIMESTAMP_QUERIES];
+    std::atomic<u32> device_scope_count { 0 };
+    HostTimingQueryData host_scopes[MAX_HOST_SCOPES];
+    std::atomic<u32> host_scope_count { 0 };
+    ScopeData counters[MAX_COUNTERS];
+    std::atomic<u32> counter_count { 0 };
+
+    std::vector<std::unique_ptr<ThreadEventBuffer>> thread_event_buffers;
+
+    // Device scopes are recorded together with the frame's command buffer, so there is only one stack
+    ScopeId open_device_scopes[MAX_SCOPE_DEPTH];
+    u32 device_depth { 0 };
+
+    Timing device_timings[MAX_TIMESTAMP_QUERIES];
+    Timing ordered_device_timings[MAX_TIMESTAMP_QUERIES];
+    Timing host_timings[MAX_HOST_SCOPES];
+    Timing ordered_host_timings[MAX_HOST_SCOPES];
+    Counter counter_values[MAX_COUNTERS];
 
     // Command buffer time querying
     VkQueryPool timestamp_query_pool{};
     f32 device_timestamp_nanoseconds_per_query_increment{ 0.0f };
-    u32 last_query_index{ 0 };
+
+    u32 current_frame_slice{ 0 };
+    bool frame_slice_recorded[ProfilingQueries::FRAME_SLICE_COUNT]{};
+
+    /* Only one pipeline statistics query can be active at a time, so when a scope starts inside another
+        the outer query is ended early and the outer scope reports the sum of its children instead
+    */
+    VkQueryPool pipeline_statistics_query_pool{};
+    bool pipeline_statistics_supported{ false };
+    ScopeId active_pipeline_statistics_scope{ ProfilingQueries::INVALID_SCOPE };
+    bool pipeline_statistics_interrupted[ProfilingQueries::FRAME_SLICE_COUNT][MAX_TIMESTAMP_QUERIES]{};
 
     f32 host_timestamp_ticks_per_second { 0.0f };
     bool timestamp_supported_on_graphics_and_compute{ false };
+
+    u32 statistics_window { 240 };
+
+    // Frame time is measured between calls to end_frame
+    u64 frame_index { 0 };
+    u64 last_end_frame_time { 0 };
+    ScopeData frame_time;
+    Timing frame_timing;
+    f32 frame_time_samples[MAX_STATISTICS_WINDOW];
+    f32 frame_time_histogram[FRAME_TIME_HISTOGRAM_BUCKETS];
+    f32 frame_time_histogram_max_ms { 0.0f };
+
+    /* Device timings of a frame are only resolved once its query slice gets reused,
+        so a spike's device timings get filled in a few frames after its host timings
+    */
+    u64 frame_slice_frame_index[ProfilingQueries::FRAME_SLICE_COUNT]{};
+
+    struct SpikeCapture
+    {
+        u64 frame_index { 0 };
+        f32 frame_time_ms { 0.0f };
+        Timing host_timings[MAX_HOST_SCOPES];
+        u32 host_timing_count { 0 };
+        Timing device_timings[MAX_TIMESTAMP_QUERIES];
+        u32 device_timing_count { 0 };
+        bool device_timings_captured { false };
+    } spike_captures[MAX_SPIKE_CAPTURES];
+    u32 spike_capture_count { 0 };
+    f32 spike_threshold_ms { 33.3f };
 } internal;
 
+thread_local ThreadEventBuffer* thread_event_buffer { nullptr };
+
 void ProfilingQueries::initialize(VkPhysicalDevice physical_device, VkDevice device)
 {
     VkQueryPoolCreateInfo create_info = {};
@@ -78,10 +231,24 @@ void ProfilingQueries::initialize(VkPhysicalDevice physical_device, VkDevice dev
     create_info.pNext = nullptr;
     create_info.flags = {}; // Flags are reserved for future use
     create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
-    create_info.queryCount = MAX_TIMESTAMP_QUERY_SLOTS;
+    create_info.queryCount = MAX_TIMESTAMP_QUERY_SLOTS * ProfilingQueries::FRAME_SLICE_COUNT;
 
     VK_CHECK(vkCreateQueryPool(device, &create_info, nullptr, &internal.timestamp_query_pool));
 
+    internal.pipeline_statistics_supported = Renderer::Core::get_physical_device_properties().enabled_features.pipelineStatisticsQuery == VK_TRUE;
+    if (internal.pipeline_statistics_supported)
+    {
+        VkQueryPoolCreateInfo statistics_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+            .queryCount = MAX_TIMESTAMP_QUERIES * ProfilingQueries::FRAME_SLICE_COUNT,
+            .pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT,
+        };
+
+        VK_CHECK(vkCreateQueryPool(device, &statistics_create_info, nullptr, &internal.pipeline_statistics_query_pool));
+    }
+
     // Get time step of query (in nanoseconds) and support for compute timestamps
     VkPhysicalDeviceProperties properties{};
     vkGetPhysicalDeviceProperties(physical_device, &properties);
@@ -91,6 +258,7 @@ void ProfilingQueries::initialize(VkPhysicalDevice physical_device, VkDevice dev
     internal.device_timestamp_nanoseconds_per_query_increment = limits.timestampPeriod;
 
     internal.host_timestamp_ticks_per_second = static_cast<f64>(SDL_GetPerformanceFrequency());
+    internal.frame_time.name = "frame";
 
     if (!internal.timestamp_supported_on_graphics_and_compute)
     {
@@ -101,188 +269,570 @@ void ProfilingQueries::initialize(VkPhysicalDevice physical_device, VkDevice dev
 void ProfilingQueries::terminate(VkDevice device)
 {
     vkDestroyQueryPool(device, internal.timestamp_query_pool, nullptr);
+
+    if (internal.pipeline_statistics_supported)
+        vkDestroyQueryPool(device, internal.pipeline_statistics_query_pool, nullptr);
 }
 
-void ProfilingQueries::reset_device_profiling_queries(VkCommandBuffer command_buffer)
+template <typename ScopeDataType>
+ScopeId register_scope(ScopeDataType* scopes, std::atomic<u32>& scope_count, u32 max_scope_count, const char* name, u64 name_hash)
 {
-    vkCmdResetQueryPool(command_buffer, internal.timestamp_query_pool, 0, MAX_TIMESTAMP_QUERY_SLOTS);
+    std::lock_guard lock(internal.registration_mutex);
+
+    u32 count = scope_count.load(std::memory_order_relaxed);
+    for (u32 i = 0; i < count; i++)
+        if (scopes[i].name_hash == name_hash)
+            return i;
+
+    if (count == max_scope_count)
+    {
+        printf("Exceeded the maximum number of profiling scopes (%s).\n", name);
+        return ProfilingQueries::INVALID_SCOPE;
+    }
+
+    scopes[count].name = name;
+    scopes[count].name_hash = name_hash;
+    scope_count.store(count + 1, std::memory_order_release);
+
+    return count;
 }
 
-void ProfilingQueries::end_frame()
+ScopeId ProfilingQueries::register_device_scope(const char* name, u64 name_hash)
 {
-    for (auto& [key, timing_query] : internal.device_profiling_timing_queries)
-        timing_query.frames_since_query++;
-    for (auto& [key, timing_query] : internal.host_profiling_timing_queries)
-        timing_query.frames_since_query++;
+    return register_scope(internal.device_scopes, internal.device_scope_count, MAX_TIMESTAMP_QUERIES, name, name_hash);
 }
 
-void ProfilingQueries::device_start(const std::string& name, VkCommandBuffer command_buffer)
+ScopeId ProfilingQueries::register_host_scope(const char* name, u64 name_hash)
 {
-    bool can_query = internal.timestamp_supported_on_graphics_and_compute;
+    return register_scope(internal.host_scopes, internal.host_scope_count, MAX_HOST_SCOPES, name, name_hash);
+}
 
-    if (can_query)
+ScopeId ProfilingQueries::register_counter(const char* name, u64 name_hash)
+{
+    return register_scope(internal.counters, internal.counter_count, MAX_COUNTERS, name, name_hash);
+}
+
+u32 get_frame_slice_first_query(u32 frame_slice)
+{
+    return frame_slice * MAX_TIMESTAMP_QUERY_SLOTS;
+}
+
+u32 get_frame_slice_first_statistics_query(u32 frame_slice)
+{
+    return frame_slice * MAX_TIMESTAMP_QUERIES;
+}
+
+void resolve_pipeline_statistics_queries(u32 frame_slice, u32 device_scope_count)
+{
+    u64 results[MAX_TIMESTAMP_QUERIES * 2];
+
+    VkResult result = vkGetQueryPoolResults(Renderer::Core::get_logical_device(), internal.pipeline_statistics_query_pool, get_frame_slice_first_statistics_query(frame_slice), device_scope_count, sizeof(u64) * 2 * device_scope_count, results, sizeof(u64) * 2, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+
+    if (result != VK_NOT_READY)
+        VK_CHECK(result);
+
+    u64 children_invocations[MAX_TIMESTAMP_QUERIES] {};
+    bool interrupted[MAX_TIMESTAMP_QUERIES] {};
+    u32 max_depth { 0 };
+
+    for (u32 id = 0; id < device_scope_count; id++)
     {
-        auto potential_query = internal.device_profiling_timing_queries.find(name);
-        bool query_already_exists = potential_query != internal.device_profiling_timing_queries.end();
+        bool available = results[id * 2 + 1] != 0;
+        interrupted[id] = internal.pipeline_statistics_interrupted[frame_slice][id];
+        internal.device_scopes[id].compute_invocations = available ? results[id * 2] : 0;
+        max_depth = std::max(max_depth, internal.device_scopes[id].depth);
+    }
 
-        if (!query_already_exists)
+    // Deepest scopes first, so every parent has its children summed before it passes its own total up
+    for (u32 depth = max_depth + 1; depth --> 0;)
+    {
+        for (u32 id = 0; id < device_scope_count; id++)
         {
-            if (internal.last_query_index == MAX_TIMESTAMP_QUERIES)
-            {
-                printf("Exceeded the maximum number of timestamps");
-                return;
-            }
-
-            potential_query = internal.device_profiling_timing_queries.insert({ name, DeviceTimingQueryData(internal.last_query_index) }).first;
-            internal.last_query_index++;
+            auto& query = internal.device_scopes[id];
+            if (query.depth != depth)
+                continue;
+
+            if (interrupted[id])
+                query.compute_invocations = children_invocations[id];
+
+            if (query.parent < device_scope_count)
+                children_invocations[query.parent] += query.compute_invocations;
         }
+    }
+}
+
+void resolve_device_queries(u32 frame_slice)
+{
+    u32 device_scope_count = internal.device_scope_count.load(std::memory_order_acquire);
+
+    if (!internal.frame_slice_recorded[frame_slice] || device_scope_count == 0)
+        return;
+
+    // Every query gets its value followed by its availability
+    u32 query_slot_count = device_scope_count * 2;
+    u64 results[MAX_TIMESTAMP_QUERY_SLOTS * 2];
+
+    VkResult result = vkGetQueryPoolResults(Renderer::Core::get_logical_device(), internal.timestamp_query_pool, get_frame_slice_first_query(frame_slice), query_slot_count, sizeof(u64) * 2 * query_slot_count, results, sizeof(u64) * 2, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
 
-        auto& query = potential_query->second;
+    // VK_NOT_READY only means some queries were not written this frame, the availability tells us which
+    if (result != VK_NOT_READY)
+        VK_CHECK(result);
 
-        vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, internal.timestamp_query_pool, query.get_index());
+    f64 milliseconds_per_query_increment = internal.device_timestamp_nanoseconds_per_query_increment / 1000000.0f;
+
+    for (u32 id = 0; id < device_scope_count; id++)
+    {
+        auto& query = internal.device_scopes[id];
+
+        u32 start_slot = query.get_index(id);
+        u32 end_slot = start_slot + 1;
+
+        bool start_available = results[start_slot * 2 + 1] != 0;
+        bool end_available = results[end_slot * 2 + 1] != 0;
+
+        if (!start_available || !end_available)
+            continue;
+
+        f64 ms_elapsed = static_cast<f64>(results[end_slot * 2] - results[start_slot * 2]) * milliseconds_per_query_increment;
+
+        query.history.set_new_time(ms_elapsed);
     }
+
+    if (internal.pipeline_statistics_supported)
+        resolve_pipeline_statistics_queries(frame_slice, device_scope_count);
 }
 
-void ProfilingQueries::device_stop(const std::string& name, VkCommandBuffer command_buffer)
+void update_timing(Timing& timing, ScopeId id, const ScopeData& scope)
 {
-    auto potential_query = internal.device_profiling_timing_queries.find(name);
-    bool query_exists = potential_query != internal.device_profiling_timing_queries.end();
-    bool can_query = internal.timestamp_supported_on_graphics_and_compute;
+    timing.name = scope.name.c_str();
+    timing.id = id;
+    timing.parent = scope.parent;
+    timing.depth = scope.depth;
+    timing.time_ms = scope.history.last_time;
+    timing.average_10_time_ms = scope.history.get_average_time(10);
+    timing.has_been_updated_this_frame = scope.history.frames_since_query == 0;
+    timing.compute_invocations = 0;
+
+    // Sorting the window is the expensive part, so only do it when there is a new sample
+    if (timing.has_been_updated_this_frame)
+        timing.statistics = scope.history.calculate_statistics(internal.statistics_window);
+}
 
-    if (query_exists && can_query)
+u32 append_ordered_timings(const Timing* timings, u32 timing_count, ScopeId parent, bool* emitted, Timing* ordered_timings, u32 ordered_count)
+{
+    for (u32 i = 0; i < timing_count; i++)
     {
-        auto& query = potential_query->second;
-        query.frames_since_query = 0;
+        if (emitted[i] || timings[i].parent != parent)
+            continue;
 
-        u32 querying = query.get_index() + 1;
+        emitted[i] = true;
+        ordered_timings[ordered_count++] = timings[i];
+        ordered_count = append_ordered_timings(timings, timing_count, timings[i].id, emitted, ordered_timings, ordered_count);
+    }
 
-        vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, internal.timestamp_query_pool, querying);
+    return ordered_count;
+}
+
+void order_timings(const Timing* timings, u32 timing_count, Timing* ordered_timings)
+{
+    bool emitted[MAX_HOST_SCOPES] {};
+    u32 ordered_count = append_ordered_timings(timings, timing_count, ProfilingQueries::INVALID_SCOPE, emitted, ordered_timings, 0);
+
+    // Scopes that have been nested under each other in different places are not reachable from a root
+    for (u32 i = 0; i < timing_count; i++)
+    {
+        if (emitted[i])
+            continue;
+
+        emitted[i] = true;
+        ordered_timings[ordered_count++] = timings[i];
+        ordered_count = append_ordered_timings(timings, timing_count, timings[i].id, emitted, ordered_timings, ordered_count);
+    }
+}
+
+void ProfilingQueries::reset_device_profiling_queries(VkCommandBuffer command_buffer)
+{
+    // Collect whatever this slice recorded the last time it was used, then reuse it for the current frame
+    resolve_device_queries(internal.current_frame_slice);
+
+    u32 device_scope_count = internal.device_scope_count.load(std::memory_order_acquire);
+    for (u32 id = 0; id < device_scope_count; id++)
+    {
+        update_timing(internal.device_timings[id], id, internal.device_scopes[id]);
+        internal.device_timings[id].compute_invocations = internal.device_scopes[id].compute_invocations;
+    }
+
+    order_timings(internal.device_timings, device_scope_count, internal.ordered_device_timings);
+
+    u64 resolved_frame_index = internal.frame_slice_frame_index[internal.current_frame_slice];
+    for (u32 i = 0; i < std::min(internal.spike_capture_count, MAX_SPIKE_CAPTURES); i++)
+    {
+        auto& spike_capture = internal.spike_captures[i];
+        if (spike_capture.device_timings_captured || spike_capture.frame_index != resolved_frame_index)
+            continue;
+
+        std::copy_n(internal.ordered_device_timings, device_scope_count, spike_capture.device_timings);
+        spike_capture.device_timing_count = device_scope_count;
+        spike_capture.device_timings_captured = true;
+    }
+
+    vkCmdResetQueryPool(command_buffer, internal.timestamp_query_pool, get_frame_slice_first_query(internal.current_frame_slice), MAX_TIMESTAMP_QUERY_SLOTS);
+    if (internal.pipeline_statistics_supported)
+    {
+        vkCmdResetQueryPool(command_buffer, internal.pipeline_statistics_query_pool, get_frame_slice_first_statistics_query(internal.current_frame_slice), MAX_TIMESTAMP_QUERIES);
+        std::fill_n(internal.pipeline_statistics_interrupted[internal.current_frame_slice], MAX_TIMESTAMP_QUERIES, false);
     }
+
+    internal.frame_slice_recorded[internal.current_frame_slice] = true;
+    internal.frame_slice_frame_index[internal.current_frame_slice] = internal.frame_index;
 }
 
-void ProfilingQueries::host_start(const std::string& name)
+void collect_host_events(ThreadEventBuffer& buffer)
 {
-    auto potential_query = internal.host_profiling_timing_queries.find(name);
-    bool query_already_exists = potential_query != internal.host_profiling_timing_queries.end();
+    u64 read_count = buffer.read_count.load(std::memory_order_relaxed);
+    u64 write_count = buffer.write_count.load(std::memory_order_acquire);
 
-    if (!query_already_exists)
+    for (; read_count < write_count; read_count++)
     {
-        internal.host_profiling_timing_queries.insert({ name, HostTimingQueryData() });
-        potential_query = internal.host_profiling_timing_queries.find(name);
+        const HostEvent& event = buffer.events[read_count % HOST_EVENT_BUFFER_SIZE];
+        auto& scope = internal.host_scopes[event.id];
+
+        scope.ticks_this_frame += event.end_time - event.start_time;
+        scope.stopped_this_frame = true;
+        scope.parent = event.parent;
+        scope.depth = event.depth;
     }
 
-    auto& query = potential_query->second;
+    buffer.read_count.store(read_count, std::memory_order_release);
+}
 
-    query.start_time = SDL_GetPerformanceCounter();
+void capture_spike(f32 frame_time_ms, u32 host_scope_count)
+{
+    auto& spike_capture = internal.spike_captures[internal.spike_capture_count % MAX_SPIKE_CAPTURES];
+    internal.spike_capture_count++;
+
+    spike_capture.frame_index = internal.frame_index;
+    spike_capture.frame_time_ms = frame_time_ms;
+    std::copy_n(internal.ordered_host_timings, host_scope_count, spike_capture.host_timings);
+    spike_capture.host_timing_count = host_scope_count;
+    spike_capture.device_timing_count = 0;
+    spike_capture.device_timings_captured = false;
 }
 
-void ProfilingQueries::host_stop(const std::string& name)
+void update_frame_time(u32 host_scope_count)
 {
-    auto potential_query = internal.host_profiling_timing_queries.find(name);
-    bool query_exists = potential_query != internal.host_profiling_timing_queries.end();
+    u64 end_frame_time = SDL_GetPerformanceCounter();
+    u64 last_end_frame_time = internal.last_end_frame_time;
+    internal.last_end_frame_time = end_frame_time;
+
+    if (last_end_frame_time == 0)
+        return;
+
+    f64 seconds = static_cast<f64>(end_frame_time - last_end_frame_time) / internal.host_timestamp_ticks_per_second;
+    f32 frame_time_ms = static_cast<f32>(seconds * 1000.0);
+
+    auto& history = internal.frame_time.history;
+    history.set_new_time(frame_time_ms);
+    update_timing(internal.frame_timing, ProfilingQueries::INVALID_SCOPE, internal.frame_time);
 
-    if (query_exists)
+    // Oldest sample first, so the samples can be plotted as is
+    u32 sample_count = history.get_sample_count(internal.statistics_window);
+    for (u32 i = 0; i < sample_count; i++)
+        internal.frame_time_samples[i] = history.get_sample(sample_count - 1 - i);
+
+    internal.frame_time_histogram_max_ms = internal.frame_timing.statistics.max_ms;
+    std::fill_n(internal.frame_time_histogram, FRAME_TIME_HISTOGRAM_BUCKETS, 0.0f);
+    for (u32 i = 0; i < sample_count; i++)
     {
-        auto& query = potential_query->second;
-        query.frames_since_query = 0;
-        query.end_time = SDL_GetPerformanceCounter();
+        f32 normalized = internal.frame_time_samples[i] / std::max(internal.frame_time_histogram_max_ms, 0.001f);
+        u32 bucket = std::min(static_cast<u32>(normalized * FRAME_TIME_HISTOGRAM_BUCKETS), FRAME_TIME_HISTOGRAM_BUCKETS - 1);
+        internal.frame_time_histogram[bucket] += 1.0f;
     }
+
+    if (internal.spike_threshold_ms > 0.0f && frame_time_ms > internal.spike_threshold_ms)
+        capture_spike(frame_time_ms, host_scope_count);
 }
 
-ProfilingQueries::Timing ProfilingQueries::get_device_time_elapsed_ms(const std::string& name)
+void ProfilingQueries::end_frame()
 {
-    Timing current_timing;
+    internal.current_frame_slice = (internal.current_frame_slice + 1) % ProfilingQueries::FRAME_SLICE_COUNT;
 
-    auto potential_query = internal.device_profiling_timing_queries.find(name);
-    bool query_exists = potential_query != internal.device_profiling_timing_queries.end();
-    bool can_query = internal.timestamp_supported_on_graphics_and_compute;
+    u32 device_scope_count = internal.device_scope_count.load(std::memory_order_acquire);
+    for (u32 id = 0; id < device_scope_count; id++)
+        internal.device_scopes[id].history.frames_since_query++;
 
-    if (!query_exists or !can_query)
-        return current_timing;
+    {
+        std::lock_guard lock(internal.registration_mutex);
+        for (auto& buffer : internal.thread_event_buffers)
+            collect_host_events(*buffer);
+    }
 
-    auto& query = potential_query->second;
-    bool new_timing = query.frames_since_query <= 1;
-    if (new_timing)
+    u32 host_scope_count = internal.host_scope_count.load(std::memory_order_acquire);
+    for (u32 id = 0; id < host_scope_count; id++)
     {
-        u32 query_start = query.get_index();
+        auto& scope = internal.host_scopes[id];
 
-        u64 buffer[2];
-        VK_CHECK(vkGetQueryPoolResults(Renderer::Core::get_logical_device(), internal.timestamp_query_pool, query_start, 2, sizeof(u64) * 2, buffer, sizeof(u64), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        if (scope.stopped_this_frame)
+        {
+            f64 seconds = static_cast<f64>(scope.ticks_this_frame) / internal.host_timestamp_ticks_per_second;
+            scope.history.set_new_time(seconds * 1000.0f);
+        }
+        else
+        {
+            scope.history.frames_since_query++;
+        }
 
-        f64 milliseconds_per_query_increment = internal.device_timestamp_nanoseconds_per_query_increment / 1000000.0f;
-        f64 ms_elapsed = static_cast<f64>(buffer[1] - buffer[0]) * milliseconds_per_query_increment;
+        scope.ticks_this_frame = 0;
+        scope.stopped_this_frame = false;
 
-        query.set_new_time(ms_elapsed);
+        update_timing(internal.host_timings[id], id, scope);
     }
 
-    current_timing.has_been_updated_this_frame = new_timing;
-    current_timing.time_ms = query.last_time;
+    order_timings(internal.host_timings, host_scope_count, internal.ordered_host_timings);
 
-    current_timing.average_10_time_ms = 0.0f;
-    for (i32 i = 0; i < std::min(query.last_10_write_index, 10u); i++)
-        current_timing.average_10_time_ms += query.last_10_times[i];
-    current_timing.average_10_time_ms /= static_cast<f32>(std::min(query.last_10_write_index, 10u));
+    u32 counter_count = internal.counter_count.load(std::memory_order_acquire);
+    for (u32 id = 0; id < counter_count; id++)
+    {
+        auto& counter = internal.counters[id];
+        auto& counter_value = internal.counter_values[id];
 
-    current_timing.name = name;
+        counter_value.name = counter.name.c_str();
+        counter_value.id = id;
+        counter_value.value = counter.history.last_time;
+        counter_value.average_10_value = counter.history.get_average_time(10);
+        counter_value.has_been_updated_this_frame = counter.history.frames_since_query == 0;
 
-    return current_timing;
+        counter.history.frames_since_query++;
+    }
+
+    update_frame_time(host_scope_count);
+    internal.frame_index++;
 }
 
-ProfilingQueries::Timing ProfilingQueries::get_host_time_elapsed_ms(const std::string& name)
+void ProfilingQueries::device_start(ScopeId id, VkCommandBuffer command_buffer)
 {
-    Timing current_timing;
+    if (id == INVALID_SCOPE)
+        return;
 
-    auto potential_query = internal.host_profiling_timing_queries.find(name);
-    bool query_exists = potential_query != internal.host_profiling_timing_queries.end();
+    bool can_query = internal.timestamp_supported_on_graphics_and_compute;
 
-    if (!query_exists)
-        return current_timing;
+    if (internal.device_depth < MAX_SCOPE_DEPTH)
+    {
+        auto& query = internal.device_scopes[id];
+        query.parent = internal.device_depth == 0 ? INVALID_SCOPE : internal.open_device_scopes[internal.device_depth - 1];
+        query.depth = internal.device_depth;
+        internal.open_device_scopes[internal.device_depth] = id;
+    }
+    internal.device_depth++;
 
-    auto& query = potential_query->second;
+    if (can_query)
+    {
+        auto& query = internal.device_scopes[id];
+        u32 querying = get_frame_slice_first_query(internal.current_frame_slice) + query.get_index(id);
 
-    bool new_timing = query.frames_since_query <= 1;
-    if (new_timing)
+        vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, internal.timestamp_query_pool, querying);
+    }
+
+    if (internal.pipeline_statistics_supported)
     {
-        u64 diff = (query.end_time - query.start_time);
-        f64 smaller = static_cast<f64>(diff) / internal.host_timestamp_ticks_per_second;
-        query.set_new_time(smaller * 1000.0f);
+        u32 first_statistics_query = get_frame_slice_first_statistics_query(internal.current_frame_slice);
+
+        if (internal.active_pipeline_statistics_scope != INVALID_SCOPE)
+        {
+            vkCmdEndQuery(command_buffer, internal.pipeline_statistics_query_pool, first_statistics_query + internal.active_pipeline_statistics_scope);
+            internal.pipeline_statistics_interrupted[internal.current_frame_slice][internal.active_pipeline_statistics_scope] = true;
+        }
+
+        vkCmdBeginQuery(command_buffer, internal.pipeline_statistics_query_pool, first_statistics_query + id, 0);
+        internal.active_pipeline_statistics_scope = id;
     }
+}
 
-    current_timing.has_been_updated_this_frame = new_timing;
-    current_timing.time_ms = query.last_time;
+void ProfilingQueries::device_stop(ScopeId id, VkCommandBuffer command_buffer)
+{
+    if (id == INVALID_SCOPE)
+        return;
 
-    current_timing.average_10_time_ms = 0.0f;
-    for (i32 i = 0; i < query.last_10_write_index && i < 10; i++)
-        current_timing.average_10_time_ms += query.last_10_times[i];
-    current_timing.average_10_time_ms /= static_cast<f32>(std::min(query.last_10_write_index, 10u));
+    bool can_query = internal.timestamp_supported_on_graphics_and_compute;
 
-    current_timing.name = name;
+    if (internal.device_depth > 0)
+        internal.device_depth--;
 
-    return current_timing;
+    if (internal.pipeline_statistics_supported && internal.active_pipeline_statistics_scope == id)
+    {
+        u32 first_statistics_query = get_frame_slice_first_statistics_query(internal.current_frame_slice);
+        vkCmdEndQuery(command_buffer, internal.pipeline_statistics_query_pool, first_statistics_query + id);
+        internal.active_pipeline_statistics_scope = INVALID_SCOPE;
+    }
+
+    if (can_query)
+    {
+        auto& query = internal.device_scopes[id];
+        u32 querying = get_frame_slice_first_query(internal.current_frame_slice) + query.get_index(id) + 1;
+
+        vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, internal.timestamp_query_pool, querying);
+    }
 }
 
-std::vector<ProfilingQueries::Timing> ProfilingQueries::get_all_device_times_elapsed_ms()
+ThreadEventBuffer& get_thread_event_buffer()
 {
-    std::vector<Timing> timings;
-    timings.reserve(internal.device_profiling_timing_queries.size());
-
-    for (auto& [key, timing_entry] : internal.device_profiling_timing_queries)
+    if (thread_event_buffer == nullptr)
     {
-        timings.push_back(get_device_time_elapsed_ms(key));
+        std::lock_guard lock(internal.registration_mutex);
+        internal.thread_event_buffers.push_back(std::make_unique<ThreadEventBuffer>());
+        thread_event_buffer = internal.thread_event_buffers.back().get();
     }
 
-    return timings;
+    return *thread_event_buffer;
 }
 
-std::vector<ProfilingQueries::Timing> ProfilingQueries::get_all_host_times_elapsed_ms()
+void ProfilingQueries::host_start(ScopeId id)
 {
-    std::vector<Timing> timings;
-    timings.reserve(internal.host_profiling_timing_queries.size());
+    auto& buffer = get_thread_event_buffer();
 
-    for (auto& [key, timing_entry] : internal.host_profiling_timing_queries)
+    // Scopes nested deeper than we can track are still counted, so their stops line up
+    if (buffer.depth < MAX_SCOPE_DEPTH)
     {
-        timings.push_back(get_host_time_elapsed_ms(key));
+        buffer.open_scopes[buffer.depth] = id;
+        buffer.open_scope_start_times[buffer.depth] = SDL_GetPerformanceCounter();
     }
+    buffer.depth++;
+}
+
+void ProfilingQueries::host_stop(ScopeId id)
+{
+    u64 end_time = SDL_GetPerformanceCounter();
+    auto& buffer = get_thread_event_buffer();
+
+    if (buffer.depth == 0)
+        return;
+
+    buffer.depth--;
+
+    if (buffer.depth >= MAX_SCOPE_DEPTH || id == INVALID_SCOPE)
+        return;
+
+    u64 write_count = buffer.write_count.load(std::memory_order_relaxed);
+    if (write_count - buffer.read_count.load(std::memory_order_acquire) >= HOST_EVENT_BUFFER_SIZE)
+        return;
+
+    HostEvent& event = buffer.events[write_count % HOST_EVENT_BUFFER_SIZE];
+    event.id = buffer.open_scopes[buffer.depth];
+    event.parent = buffer.depth == 0 ? INVALID_SCOPE : buffer.open_scopes[buffer.depth - 1];
+    event.depth = buffer.depth;
+    event.start_time = buffer.open_scope_start_times[buffer.depth];
+    event.end_time = end_time;
+
+    buffer.write_count.store(write_count + 1, std::memory_order_release);
+}
 
-    return timings;
+const ProfilingQueries::Timing& ProfilingQueries::get_device_time_elapsed_ms(ScopeId id)
+{
+    static const Timing invalid_timing {};
+
+    if (id >= internal.device_scope_count.load(std::memory_order_acquire) || !internal.timestamp_supported_on_graphics_and_compute)
+        return invalid_timing;
+
+    return internal.device_timings[id];
+}
+
+const ProfilingQueries::Timing& ProfilingQueries::get_host_time_elapsed_ms(ScopeId id)
+{
+    static const Timing invalid_timing {};
+
+    if (id >= internal.host_scope_count.load(std::memory_order_acquire))
+        return invalid_timing;
+
+    return internal.host_timings[id];
+}
+
+std::span<const ProfilingQueries::Timing> ProfilingQueries::get_all_device_times_elapsed_ms()
+{
+    if (!internal.timestamp_supported_on_graphics_and_compute)
+        return {};
+
+    return { internal.ordered_device_timings, internal.device_scope_count.load(std::memory_order_acquire) };
+}
+
+std::span<const ProfilingQueries::Timing> ProfilingQueries::get_all_host_times_elapsed_ms()
+{
+    return { internal.ordered_host_timings, internal.host_scope_count.load(std::memory_order_acquire) };
+}
+
+void ProfilingQueries::set_counter(ScopeId id, f64 value)
+{
+    if (id == INVALID_SCOPE)
+        return;
+
+    internal.counters[id].history.set_new_time(static_cast<f32>(value));
+}
+
+std::span<const ProfilingQueries::Counter> ProfilingQueries::get_all_counters()
+{
+    return { internal.counter_values, internal.counter_count.load(std::memory_order_acquire) };
+}
+
+u32 ProfilingQueries::get_current_frame_slice()
+{
+    return internal.current_frame_slice;
+}
+
+const ProfilingQueries::Timing& ProfilingQueries::get_frame_time_ms()
+{
+    return internal.frame_timing;
+}
+
+std::span<const f32> ProfilingQueries::get_frame_time_samples_ms()
+{
+    return { internal.frame_time_samples, internal.frame_time.history.get_sample_count(internal.statistics_window) };
+}
+
+ProfilingQueries::FrameTimeHistogram ProfilingQueries::get_frame_time_histogram()
+{
+    return { std::span<const f32>(internal.frame_time_histogram), internal.frame_time_histogram_max_ms };
+}
+
+void ProfilingQueries::set_statistics_window(u32 frame_count)
+{
+    internal.statistics_window = std::clamp(frame_count, 10u, MAX_STATISTICS_WINDOW);
+}
+
+u32 ProfilingQueries::get_statistics_window()
+{
+    return internal.statistics_window;
+}
+
+u32 ProfilingQueries::get_max_statistics_window()
+{
+    return MAX_STATISTICS_WINDOW;
+}
+
+void ProfilingQueries::set_spike_threshold_ms(f32 threshold_ms)
+{
+    internal.spike_threshold_ms = threshold_ms;
+}
+
+f32 ProfilingQueries::get_spike_threshold_ms()
+{
+    return internal.spike_threshold_ms;
+}
+
+u32 ProfilingQueries::get_spike_capture_count()
+{
+    return std::min(internal.spike_capture_count, MAX_SPIKE_CAPTURES);
+}
+
+ProfilingQueries::SpikeCapture ProfilingQueries::get_spike_capture(u32 index)
+{
+    // Index 0 is the most recent spike
+    u32 capture_index = (internal.spike_capture_count - 1 - index) % MAX_SPIKE_CAPTURES;
+    const auto& spike_capture = internal.spike_captures[capture_index];
+
+    return
+    {
+        .frame_index = spike_capture.frame_index,
+        .frame_time_ms = spike_capture.frame_time_ms,
+        .host_timings = { spike_capture.host_timings, spike_capture.host_timing_count },
+        .device_timings = { spike_capture.device_timings, spike_capture.device_timing_count },
+    };
 }
@@ -1,32 +1,158 @@
 ﻿#pragma once
 
-#include <string>
-#include <vector>
+#include <span>
+#include <type_traits>
 #include "../../common/types.h"
 #include "vv_vulkan.h"
 
 namespace ProfilingQueries
 {
+    typedef u32 ScopeId;
+    constexpr ScopeId INVALID_SCOPE { ~0u };
+
+    /* Device results are recorded into one slice per frame, a slice is only read back right before it gets reused.
+        By then the frame that wrote it has finished on the GPU, so we never have to wait for results.
+    */
+    constexpr u32 FRAME_SLICE_COUNT { 3 };
+
+    // FNV-1a, constexpr so the profiling macros can hash scope names at compile time
+    constexpr u64 hash_scope_name(const char* name)
+    {
+        u64 hash { 14695981039346656037ull };
+        while (*name != '\0')
+        {
+            hash ^= static_cast<u8>(*name++);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    struct TimingStatistics
+    {
+        f32 min_ms { 0.0f };
+        f32 max_ms { 0.0f };
+        f32 mean_ms { 0.0f };
+        f32 p50_ms { 0.0f };
+        f32 p95_ms { 0.0f };
+        f32 p99_ms { 0.0f };
+        u32 sample_count { 0 };
+    };
+
     struct Timing
     {
-        std::string name;
+        const char* name { "" };
+        ScopeId id { INVALID_SCOPE };
+        ScopeId parent { INVALID_SCOPE };
+        u32 depth { 0 };
         f32 time_ms{ 0.0f };
         f32 average_10_time_ms{ 0.0f };
+        TimingStatistics statistics {}; // Over the last get_statistics_window() samples
+        u64 compute_invocations { 0 }; // Device only, when pipeline statistics queries are supported
         bool has_been_updated_this_frame{ false };
     };
 
+    struct Counter
+    {
+        const char* name { "" };
+        ScopeId id { INVALID_SCOPE };
+        f64 value { 0.0 };
+        f64 average_10_value { 0.0 };
+        bool has_been_updated_this_frame { false };
+    };
+
+    struct FrameTimeHistogram
+    {
+        std::span<const f32> bucket_counts;
+        f32 max_ms { 0.0f }; // Buckets evenly divide 0 to max_ms
+    };
+
+    // Timings of every scope in the first frame that took longer than the spike threshold
+    struct SpikeCapture
+    {
+        u64 frame_index { 0 };
+        f32 frame_time_ms { 0.0f };
+        std::span<const Timing> host_timings;
+        std::span<const Timing> device_timings; // Empty until the frame's device timings have been resolved
+    };
+
     void initialize(VkPhysicalDevice physical_device, VkDevice device);
     void terminate(VkDevice device);
     void reset_device_profiling_queries(VkCommandBuffer command_buffer);
     void end_frame();
 
-    void device_start(const std::string& name, VkCommandBuffer command_buffer);
-    void device_stop(const std::string& name, VkCommandBuffer command_buffer);
-    void host_start(const std::string& name);
-    void host_stop(const std::string& name);
+    // Registering is thread safe and returns the same id for the same name
+    ScopeId register_device_scope(const char* name, u64 name_hash);
+    ScopeId register_host_scope(const char* name, u64 name_hash);
+    ScopeId register_counter(const char* name, u64 name_hash);
+
+    void device_start(ScopeId id, VkCommandBuffer command_buffer);
+    void device_stop(ScopeId id, VkCommandBuffer command_buffer);
+
+    // Host scopes can be used from any thread, but have to be stopped on the thread that started them
+    void host_start(ScopeId id);
+    void host_stop(ScopeId id);
+
+    const Timing& get_device_time_elapsed_ms(ScopeId id);
+    const Timing& get_host_time_elapsed_ms(ScopeId id);
+
+    // Timings are ordered so that children directly follow their parent
+    std::span<const Timing> get_all_device_times_elapsed_ms();
+    std::span<const Timing> get_all_host_times_elapsed_ms();
+
+    // Counters are for derived per frame metrics, only set them from the main thread
+    void set_counter(ScopeId id, f64 value);
+    std::span<const Counter> get_all_counters();
+
+    // Per frame device data (query slices, readback buffers) should be indexed with this
+    u32 get_current_frame_slice();
+
+    const Timing& get_frame_time_ms();
+    std::span<const f32> get_frame_time_samples_ms(); // Oldest first
+    FrameTimeHistogram get_frame_time_histogram();
+
+    void set_statistics_window(u32 frame_count);
+    u32 get_statistics_window();
+    u32 get_max_statistics_window();
+
+    // A threshold of 0 disables spike captures, index 0 is the most recent capture
+    void set_spike_threshold_ms(f32 threshold_ms);
+    f32 get_spike_threshold_ms();
+    u32 get_spike_capture_count();
+    SpikeCapture get_spike_capture(u32 index);
+
+    struct HostScope
+    {
+        ScopeId id;
+
+        HostScope(ScopeId in_id) : id(in_id) { host_start(id); }
+        ~HostScope() { host_stop(id); }
+    };
+
+    struct DeviceScope
+    {
+        ScopeId id;
+        VkCommandBuffer command_buffer;
+
+        DeviceScope(ScopeId in_id, VkCommandBuffer in_command_buffer) : id(in_id), command_buffer(in_command_buffer) { device_start(id, command_buffer); }
+        ~DeviceScope() { device_stop(id, command_buffer); }
+    };
+}
+
+#define PROFILING_CONCATENATE_IMPL(a, b) a##b
+#define PROFILING_CONCATENATE(a, b) PROFILING_CONCATENATE_IMPL(a, b)
+#define PROFILING_SCOPE_NAME_HASH(name) std::integral_constant<u64, ProfilingQueries::hash_scope_name(name)>::value
+
+// The scope id is registered once per call site, after that starting a scope does no lookups or allocations
+#define PROFILE_HOST_SCOPE(name) \
+    static const ProfilingQueries::ScopeId PROFILING_CONCATENATE(profiling_scope_id_, __LINE__) = ProfilingQueries::register_host_scope(name, PROFILING_SCOPE_NAME_HASH(name)); \
+    ProfilingQueries::HostScope PROFILING_CONCATENATE(profiling_scope_, __LINE__)(PROFILING_CONCATENATE(profiling_scope_id_, __LINE__))
+
+#define PROFILE_DEVICE_SCOPE(name, command_buffer) \
+    static const ProfilingQueries::ScopeId PROFILING_CONCATENATE(profiling_scope_id_, __LINE__) = ProfilingQueries::register_device_scope(name, PROFILING_SCOPE_NAME_HASH(name)); \
+    ProfilingQueries::DeviceScope PROFILING_CONCATENATE(profiling_scope_, __LINE__)(PROFILING_CONCATENATE(profiling_scope_id_, __LINE__), command_buffer)
 
-    Timing get_device_time_elapsed_ms(const std::string& name);
-    Timing get_host_time_elapsed_ms(const std::string& name);
-    std::vector<Timing> get_all_device_times_elapsed_ms();
-    std::vector<Timing> get_all_host_times_elapsed_ms();
-}
\ No newline at end of file
+#define PROFILE_COUNTER(name, value) \
+    { \
+        static const ProfilingQueries::ScopeId profiling_counter_id = ProfilingQueries::register_counter(name, PROFILING_SCOPE_NAME_HASH(name)); \
+        ProfilingQueries::set_counter(profiling_counter_id, value); \
+    }
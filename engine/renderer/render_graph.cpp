@@ -0,0 +1,632 @@
+﻿#include "render_graph.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "device_resources.h"
+
+/* Frames in flight share transient memory and imported buffers, so every resource starts a frame as if
+    the previous frame had just written it. Only the first pass touching a stage has to wait for that,
+    later first touches in the same stage are already ordered behind its barrier.
+*/
+constexpr VkPipelineStageFlags2 PREVIOUS_FRAME_STAGES { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT };
+constexpr VkAccessFlags2 PREVIOUS_FRAME_WRITE_ACCESS { VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT };
+
+constexpr VkAccessFlags2 WRITE_ACCESS_MASK
+{
+    VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT |
+    VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT
+};
+
+inline VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+bool lifetimes_overlap(const RenderGraphResource& a, const RenderGraphResource& b)
+{
+    return a.first_pass <= b.last_pass && b.first_pass <= a.last_pass;
+}
+
+bool memory_overlaps(VkDeviceSize a_offset, VkDeviceSize a_size, VkDeviceSize b_offset, VkDeviceSize b_size)
+{
+    return a_offset < b_offset + b_size && b_offset < a_offset + a_size;
+}
+
+void reset_resource_states(RenderGraph& graph)
+{
+    graph.previous_frame_synchronized_stages = VK_PIPELINE_STAGE_2_NONE;
+    graph.previous_frame_visible_access = VK_ACCESS_2_NONE;
+
+    for (u32 i = 0; i < graph.resources.size(); i++)
+    {
+        auto& resource = graph.resources[i];
+        auto& resource_state = graph.resource_states[i];
+        resource_state = {};
+
+        if (resource.is_image && !resource.is_transient)
+        {
+            resource_state.write_stage = resource.initial_stage;
+            resource_state.layout = resource.initial_layout;
+        }
+        else
+        {
+            resource_state.write_stage = PREVIOUS_FRAME_STAGES;
+            resource_state.write_access = PREVIOUS_FRAME_WRITE_ACCESS;
+            resource_state.read_stages = PREVIOUS_FRAME_STAGES;
+        }
+    }
+}
+
+/* Adds whatever has to happen before the access to the pass' barrier batch.
+    Buffer hazards all go into one global memory barrier, images need their own for layout transitions.
+*/
+void synchronize_access(RenderGraph& graph, const RenderGraphAccess& access, VkMemoryBarrier2& memory_barrier)
+{
+    auto& resource = graph.resources[access.resource];
+    auto& resource_state = graph.resource_states[access.resource];
+
+    bool is_first_touch = !resource_state.touched;
+    if (is_first_touch)
+    {
+        resource_state.touched = true;
+
+        bool waits_for_previous_frame = resource_state.write_stage == PREVIOUS_FRAME_STAGES;
+        bool previous_frame_synchronized = (graph.previous_frame_synchronized_stages & access.stage) == access.stage &&
+            (graph.previous_frame_visible_access & access.access) == access.access;
+        if (waits_for_previous_frame && previous_frame_synchronized)
+        {
+            // Layout transitions still need a source stage to chain onto the earlier barrier
+            resource_state.write_stage = resource.is_image ? access.stage : VK_PIPELINE_STAGE_2_NONE;
+            resource_state.write_access = VK_ACCESS_2_NONE;
+            resource_state.read_stages = VK_PIPELINE_STAGE_2_NONE;
+        }
+
+        // Memory shared with a transient that was used earlier this frame, it has to be done before we reuse it
+        for (auto alias : resource.aliases)
+        {
+            auto& alias_state = graph.resource_states[alias];
+            if (!alias_state.touched)
+                continue;
+
+            resource_state.write_stage |= alias_state.write_stage | alias_state.read_stages;
+            resource_state.write_access |= alias_state.write_access;
+        }
+    }
+
+    bool is_write = (access.access & WRITE_ACCESS_MASK) != 0;
+    bool needs_layout_transition = resource.is_image && resource_state.layout != access.layout;
+
+    VkPipelineStageFlags2 source_stage { VK_PIPELINE_STAGE_2_NONE };
+    VkAccessFlags2 source_access { VK_ACCESS_2_NONE };
+    if (is_write || needs_layout_transition)
+    {
+        // Writes (layout transitions are writes too) have to wait for every read and write since the last write
+        source_stage = resource_state.write_stage | resource_state.read_stages;
+        source_access = resource_state.write_access;
+    }
+    else if ((resource_state.synchronized_stages & access.stage) != access.stage || (resource_state.visible_access & access.access) != access.access)
+    {
+        // Reads only wait for the last write, and only once per stage
+        source_stage = resource_state.write_stage;
+        source_access = resource_state.write_access;
+    }
+
+    if (needs_layout_transition)
+    {
+        graph.image_barriers.push_back(VkImageMemoryBarrier2
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = source_stage,
+            .srcAccessMask = source_access,
+            .dstStageMask = access.stage,
+            .dstAccessMask = access.access,
+            .oldLayout = resource_state.layout,
+            .newLayout = access.layout,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = resource.image.image,
+            .subresourceRange = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1
+            }
+        });
+    }
+    else if (source_stage != VK_PIPELINE_STAGE_2_NONE)
+    {
+        memory_barrier.srcStageMask |= source_stage;
+        memory_barrier.srcAccessMask |= source_access;
+        memory_barrier.dstStageMask |= access.stage;
+        memory_barrier.dstAccessMask |= access.access;
+    }
+
+    if (is_first_touch && (source_stage & PREVIOUS_FRAME_STAGES) == PREVIOUS_FRAME_STAGES)
+    {
+        graph.previous_frame_synchronized_stages |= access.stage;
+        graph.previous_frame_visible_access |= access.access;
+    }
+
+    if (is_write || needs_layout_transition)
+    {
+        resource_state.write_stage = access.stage;
+        resource_state.write_access = access.access & WRITE_ACCESS_MASK;
+        resource_state.read_stages = is_write ? VK_PIPELINE_STAGE_2_NONE : access.stage;
+        resource_state.synchronized_stages = access.stage;
+        resource_state.visible_access = access.access;
+        resource_state.layout = access.layout;
+    }
+    else
+    {
+        resource_state.read_stages |= access.stage;
+        resource_state.synchronized_stages |= access.stage;
+        resource_state.visible_access |= access.access;
+    }
+}
+
+void flush_barriers(RenderGraph& graph, VkCommandBuffer command_buffer, const VkMemoryBarrier2& memory_barrier)
+{
+    bool has_memory_barrier = memory_barrier.srcStageMask != VK_PIPELINE_STAGE_2_NONE;
+    if (!has_memory_barrier && graph.image_barriers.empty())
+        return;
+
+    VkDependencyInfo dependency_info
+    {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .dependencyFlags = {},
+        .memoryBarrierCount = has_memory_barrier ? 1u : 0u,
+        .pMemoryBarriers = &memory_barrier,
+        .imageMemoryBarrierCount = static_cast<u32>(graph.image_barriers.size()),
+        .pImageMemoryBarriers = graph.image_barriers.data()
+    };
+
+    vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+    graph.image_barriers.clear();
+}
+
+void RenderGraph::set_imported_image(RenderGraphResourceHandle handle, VkImage image, VkImageView view)
+{
+    resources[handle].image.image = image;
+    resources[handle].image.view = view;
+}
+
+const Renderer::AllocatedImage& RenderGraph::get_image(RenderGraphResourceHandle handle) const
+{
+    return resources[handle].image;
+}
+
+VkBuffer RenderGraph::get_buffer(RenderGraphResourceHandle handle) const
+{
+    return resources[handle].buffer;
+}
+
+void RenderGraph::execute(VkCommandBuffer command_buffer)
+{
+    reset_resource_states(*this);
+
+    ProfilingQueries::ScopeId active_group_scope_id { ProfilingQueries::INVALID_SCOPE };
+    for (auto& pass : passes)
+    {
+        if (pass.enabled && !pass.enabled())
+            continue;
+
+        if (pass.group_scope_id != active_group_scope_id)
+        {
+            if (active_group_scope_id != ProfilingQueries::INVALID_SCOPE)
+                ProfilingQueries::device_stop(active_group_scope_id, command_buffer);
+
+            active_group_scope_id = pass.group_scope_id;
+            if (active_group_scope_id != ProfilingQueries::INVALID_SCOPE)
+                ProfilingQueries::device_start(active_group_scope_id, command_buffer);
+        }
+
+        // Barrier waits are part of the pass' time, that is where the stall shows up
+        ProfilingQueries::device_start(pass.scope_id, command_buffer);
+
+        VkMemoryBarrier2 memory_barrier { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+        for (auto& access : pass.accesses)
+            synchronize_access(*this, access, memory_barrier);
+        flush_barriers(*this, command_buffer, memory_barrier);
+
+        pass.record(command_buffer);
+
+        ProfilingQueries::device_stop(pass.scope_id, command_buffer);
+    }
+
+    if (active_group_scope_id != ProfilingQueries::INVALID_SCOPE)
+        ProfilingQueries::device_stop(active_group_scope_id, command_buffer);
+
+    VkMemoryBarrier2 memory_barrier { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+    for (auto& resource : resources)
+    {
+        if (resource.is_exported)
+            synchronize_access(*this, resource.export_access, memory_barrier);
+    }
+    flush_barriers(*this, command_buffer, memory_barrier);
+}
+
+void RenderGraph::destroy()
+{
+    for (auto& resource : resources)
+    {
+        if (!resource.is_transient)
+            continue;
+
+        if (resource.is_image)
+        {
+            vkDestroyImageView(device, resource.image.view, nullptr);
+            vkDestroyImage(device, resource.image.image, nullptr);
+        }
+        else
+        {
+            DeviceResources::unregister_buffer(resource.name);
+            vkDestroyBuffer(device, resource.buffer, nullptr);
+        }
+
+        if (resource.dedicated_allocation != VK_NULL_HANDLE)
+            vmaFreeMemory(Renderer::Core::get_vma_allocator(), resource.dedicated_allocation);
+    }
+
+    if (transient_allocation != VK_NULL_HANDLE)
+        vmaFreeMemory(Renderer::Core::get_vma_allocator(), transient_allocation);
+
+    *this = {};
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::access(RenderGraphResourceHandle handle, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout)
+{
+    graph_builder.passes[pass_index].accesses.push_back({ .resource = handle, .stage = stage, .access = access, .layout = layout });
+    return *this;
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::read_buffer(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::write_buffer(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::read_write_buffer(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::transfer_read_buffer(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::transfer_write_buffer(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::indirect_read_buffer(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::write_storage_image(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::read_storage_image(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::read_write_storage_image(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::transfer_read_image(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::transfer_write_image(RenderGraphResourceHandle handle)
+{
+    return access(handle, VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::profile_group(const char* group_name)
+{
+    graph_builder.passes[pass_index].profile_group = group_name;
+    return *this;
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::enabled_if(std::function<bool()>&& predicate)
+{
+    graph_builder.passes[pass_index].enabled = std::move(predicate);
+    return *this;
+}
+
+RenderGraphPassBuilder& RenderGraphPassBuilder::execute(std::function<void(VkCommandBuffer command_buffer)>&& record)
+{
+    graph_builder.passes[pass_index].record = std::move(record);
+    return *this;
+}
+
+RenderGraphResourceHandle RenderGraphBuilder::create_transient_buffer(const std::string& name, VkDeviceSize size)
+{
+    resources.push_back({ .name = name, .is_image = false, .is_transient = true, .size = size });
+    return static_cast<RenderGraphResourceHandle>(resources.size() - 1);
+}
+
+RenderGraphResourceHandle RenderGraphBuilder::create_transient_image(const std::string& name, VkExtent2D extent, VkFormat format, VkImageUsageFlags usage)
+{
+    RenderGraphResource resource { .name = name, .is_image = true, .is_transient = true };
+    resource.image.extent = VkExtent3D(extent.width, extent.height, 1);
+    resource.image.format = format;
+    resource.image_usage = usage;
+
+    resources.push_back(resource);
+    return static_cast<RenderGraphResourceHandle>(resources.size() - 1);
+}
+
+RenderGraphResourceHandle RenderGraphBuilder::import_buffer(const std::string& buffer_name)
+{
+    auto buffer = DeviceResources::get_buffer(buffer_name);
+    resources.push_back({ .name = buffer_name, .is_image = false, .is_transient = false, .buffer = buffer.handle, .size = buffer.size });
+    return static_cast<RenderGraphResourceHandle>(resources.size() - 1);
+}
+
+RenderGraphResourceHandle RenderGraphBuilder::import_image(const std::string& name, VkImageLayout initial_layout, VkPipelineStageFlags2 initial_stage)
+{
+    resources.push_back({ .name = name, .is_image = true, .is_transient = false, .initial_stage = initial_stage, .initial_layout = initial_layout });
+    return static_cast<RenderGraphResourceHandle>(resources.size() - 1);
+}
+
+RenderGraphBuilder& RenderGraphBuilder::export_resource(RenderGraphResourceHandle handle, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout)
+{
+    resources[handle].is_exported = true;
+    resources[handle].export_access = { .resource = handle, .stage = stage, .access = access, .layout = layout };
+    return *this;
+}
+
+RenderGraphPassBuilder RenderGraphBuilder::add_pass(const std::string& name)
+{
+    passes.push_back({ .name = name });
+    return RenderGraphPassBuilder { *this, static_cast<u32>(passes.size() - 1) };
+}
+
+void create_transient_handles(VkDevice device, RenderGraphResource& resource)
+{
+    if (resource.is_image)
+    {
+        VkImageCreateInfo image_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = resource.image.format,
+            .extent = resource.image.extent,
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = resource.image_usage,
+        };
+
+        VK_CHECK(vkCreateImage(device, &image_create_info, nullptr, &resource.image.image));
+        vkGetImageMemoryRequirements(device, resource.image.image, &resource.memory_requirements);
+        VK_NAME(device, resource.image.image, VK_OBJECT_TYPE_IMAGE, resource.name);
+    }
+    else
+    {
+        VkBufferCreateInfo buffer_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = resource.size,
+            .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        };
+
+        VK_CHECK(vkCreateBuffer(device, &buffer_create_info, nullptr, &resource.buffer));
+        vkGetBufferMemoryRequirements(device, resource.buffer, &resource.memory_requirements);
+        VK_NAME(device, resource.buffer, VK_OBJECT_TYPE_BUFFER, resource.name);
+    }
+}
+
+void bind_transient_memory(VkDevice device, RenderGraphResource& resource, VmaAllocation allocation, VkDeviceSize offset)
+{
+    auto& allocator = Renderer::Core::get_vma_allocator();
+    if (resource.is_image)
+    {
+        VK_CHECK(vmaBindImageMemory2(allocator, allocation, offset, resource.image.image, nullptr));
+
+        VkImageViewCreateInfo image_view_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = resource.image.image,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = resource.image.format,
+            .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            }
+        };
+
+        VK_CHECK(vkCreateImageView(device, &image_view_create_info, nullptr, &resource.image.view));
+    }
+    else
+    {
+        VK_CHECK(vmaBindBufferMemory2(allocator, allocation, offset, resource.buffer, nullptr));
+        DeviceResources::register_buffer(resource.name, { .handle = resource.buffer, .size = resource.size });
+    }
+}
+
+/* Greedy first fit, largest first. A transient only has to stay clear of the transients that are
+    alive at the same time, anything else can share its memory.
+*/
+void place_transient_resources(RenderGraph& graph, std::vector<RenderGraphResourceHandle>& transients, VkDeviceSize granularity)
+{
+    std::sort(transients.begin(), transients.end(), [&graph](RenderGraphResourceHandle a, RenderGraphResourceHandle b)
+    {
+        return graph.resources[a].memory_requirements.size > graph.resources[b].memory_requirements.size;
+    });
+
+    std::vector<RenderGraphResourceHandle> placed;
+    for (auto handle : transients)
+    {
+        auto& resource = graph.resources[handle];
+        // Padded to the buffer/image granularity, as buffers and images may end up next to each other
+        VkDeviceSize alignment = std::max(resource.memory_requirements.alignment, granularity);
+        VkDeviceSize size = align_up(resource.memory_requirements.size, granularity);
+
+        VkDeviceSize offset = 0;
+        bool moved = true;
+        while (moved)
+        {
+            moved = false;
+            offset = align_up(offset, alignment);
+            for (auto other_handle : placed)
+            {
+                auto& other = graph.resources[other_handle];
+                VkDeviceSize other_size = align_up(other.memory_requirements.size, granularity);
+                if (lifetimes_overlap(resource, other) && memory_overlaps(offset, size, other.memory_offset, other_size))
+                {
+                    offset = other.memory_offset + other_size;
+                    moved = true;
+                }
+            }
+        }
+
+        for (auto other_handle : placed)
+        {
+            auto& other = graph.resources[other_handle];
+            if (memory_overlaps(offset, size, other.memory_offset, align_up(other.memory_requirements.size, granularity)))
+            {
+                resource.aliases.push_back(other_handle);
+                other.aliases.push_back(handle);
+            }
+        }
+
+        resource.memory_offset = offset;
+        graph.transient_memory_size = std::max(graph.transient_memory_size, offset + size);
+        graph.unaliased_transient_memory_size += size;
+        placed.push_back(handle);
+    }
+}
+
+RenderGraph RenderGraphBuilder::create(VkDevice device)
+{
+    RenderGraph graph {};
+    graph.device = device;
+    graph.resources = std::move(resources);
+    graph.passes = std::move(passes);
+    graph.resource_states.resize(graph.resources.size());
+
+    // A group's scope can only be started once per frame, so every group has to be one run of consecutive passes
+    std::vector<ProfilingQueries::ScopeId> closed_group_scope_ids;
+    ProfilingQueries::ScopeId previous_group_scope_id { ProfilingQueries::INVALID_SCOPE };
+
+    for (u32 pass_index = 0; pass_index < graph.passes.size(); pass_index++)
+    {
+        auto& pass = graph.passes[pass_index];
+        pass.scope_id = ProfilingQueries::register_device_scope(pass.name.c_str(), ProfilingQueries::hash_scope_name(pass.name.c_str()));
+        if (pass.profile_group)
+            pass.group_scope_id = ProfilingQueries::register_device_scope(pass.profile_group, ProfilingQueries::hash_scope_name(pass.profile_group));
+
+        if (pass.group_scope_id != previous_group_scope_id)
+        {
+            if (std::find(closed_group_scope_ids.begin(), closed_group_scope_ids.end(), pass.group_scope_id) != closed_group_scope_ids.end())
+            {
+                fprintf(stderr, "[render graph] Pass \"%s\" reopens profile group \"%s\" after other passes interrupted it\n", pass.name.c_str(), pass.profile_group);
+                abort();
+            }
+
+            if (previous_group_scope_id != ProfilingQueries::INVALID_SCOPE)
+                closed_group_scope_ids.push_back(previous_group_scope_id);
+            previous_group_scope_id = pass.group_scope_id;
+        }
+
+        for (auto& access : pass.accesses)
+        {
+            auto& resource = graph.resources[access.resource];
+            resource.first_pass = std::min(resource.first_pass, pass_index);
+            resource.last_pass = std::max(resource.last_pass, pass_index);
+        }
+    }
+
+    u32 memory_type_bits { ~0u };
+    std::vector<RenderGraphResourceHandle> transients;
+    std::vector<RenderGraphResourceHandle> dedicated_transients;
+    for (u32 i = 0; i < graph.resources.size(); i++)
+    {
+        auto& resource = graph.resources[i];
+        if (!resource.is_transient)
+            continue;
+
+        // Never used by a pass, keep it alive for the whole frame rather than guess
+        if (resource.first_pass > resource.last_pass)
+        {
+            resource.first_pass = 0;
+            resource.last_pass = static_cast<u32>(graph.passes.size());
+        }
+
+        create_transient_handles(device, resource);
+
+        // Resources that can't live in the same memory type as the rest get their own allocation
+        if ((memory_type_bits & resource.memory_requirements.memoryTypeBits) == 0)
+        {
+            printf("Transient resource (%s) can't share a memory type with the others, it won't be aliased\n", resource.name.c_str());
+            dedicated_transients.push_back(i);
+            continue;
+        }
+
+        memory_type_bits &= resource.memory_requirements.memoryTypeBits;
+        transients.push_back(i);
+    }
+
+    VkDeviceSize granularity = Renderer::Core::get_physical_device_properties().properties.properties.limits.bufferImageGranularity;
+    place_transient_resources(graph, transients, granularity);
+
+    VmaAllocationCreateInfo allocation_create_info
+    {
+        .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    };
+
+    if (!transients.empty())
+    {
+        VkDeviceSize alignment = granularity;
+        for (auto handle : transients)
+            alignment = std::max(alignment, graph.resources[handle].memory_requirements.alignment);
+
+        VkMemoryRequirements memory_requirements
+        {
+            .size = graph.transient_memory_size,
+            .alignment = alignment,
+            .memoryTypeBits = memory_type_bits,
+        };
+
+        VK_CHECK(vmaAllocateMemory(Renderer::Core::get_vma_allocator(), &memory_requirements, &allocation_create_info, &graph.transient_allocation, nullptr));
+
+        for (auto handle : transients)
+            bind_transient_memory(device, graph.resources[handle], graph.transient_allocation, graph.resources[handle].memory_offset);
+    }
+
+    for (auto handle : dedicated_transients)
+    {
+        auto& resource = graph.resources[handle];
+        VK_CHECK(vmaAllocateMemory(Renderer::Core::get_vma_allocator(), &resource.memory_requirements, &allocation_create_info, &resource.dedicated_allocation, nullptr));
+        bind_transient_memory(device, resource, resource.dedicated_allocation, 0);
+        graph.unaliased_transient_memory_size += resource.memory_requirements.size;
+    }
+
+    printf("Render graph transient memory: %.2fMB (%.2fMB without aliasing)\n",
+        graph.transient_memory_size / (1024.0 * 1024.0), graph.unaliased_transient_memory_size / (1024.0 * 1024.0));
+
+    return graph;
+}
@@ -0,0 +1,150 @@
+﻿#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "vv_vulkan.h"
+#include "vk_mem_alloc.h"
+
+#include "../../common/types.h"
+#include "renderer_core.h"
+#include "profiling.h"
+
+/* Passes declare which resources they touch and how, the graph records the barriers between them when executing.
+    Transient resources only live between their first and last pass, ones whose lifetimes don't overlap share memory.
+*/
+
+typedef u32 RenderGraphResourceHandle;
+constexpr RenderGraphResourceHandle INVALID_RENDER_GRAPH_RESOURCE { ~0u };
+
+struct RenderGraphAccess
+{
+    RenderGraphResourceHandle resource { INVALID_RENDER_GRAPH_RESOURCE };
+    VkPipelineStageFlags2 stage { VK_PIPELINE_STAGE_2_NONE };
+    VkAccessFlags2 access { VK_ACCESS_2_NONE };
+    VkImageLayout layout { VK_IMAGE_LAYOUT_UNDEFINED }; // Images only
+};
+
+struct RenderGraphResource
+{
+    std::string name;
+    bool is_image { false };
+    bool is_transient { false };
+
+    VkBuffer buffer { VK_NULL_HANDLE };
+    VkDeviceSize size { 0 };
+
+    Renderer::AllocatedImage image {};
+    VkImageUsageFlags image_usage { 0 };
+
+    // Imported resources start every frame in this state, transient ones start undefined
+    VkPipelineStageFlags2 initial_stage { VK_PIPELINE_STAGE_2_NONE };
+    VkImageLayout initial_layout { VK_IMAGE_LAYOUT_UNDEFINED };
+
+    // Barrier recorded at the end of the graph, for resources used by whatever comes after it
+    bool is_exported { false };
+    RenderGraphAccess export_access {};
+
+    // Transient memory
+    VkMemoryRequirements memory_requirements {};
+    VkDeviceSize memory_offset { 0 };
+    VmaAllocation dedicated_allocation { VK_NULL_HANDLE }; // Only when it couldn't share the memory type of the others
+    u32 first_pass { ~0u };
+    u32 last_pass { 0 };
+    std::vector<RenderGraphResourceHandle> aliases; // Transient resources placed in overlapping memory
+};
+
+struct RenderGraphPass
+{
+    std::string name;
+    const char* profile_group { nullptr }; // Consecutive passes in the same group are also timed together, create aborts when a group is split up
+    std::vector<RenderGraphAccess> accesses;
+    std::function<void(VkCommandBuffer command_buffer)> record;
+    std::function<bool()> enabled; // Always enabled when empty
+    ProfilingQueries::ScopeId scope_id { ProfilingQueries::INVALID_SCOPE };
+    ProfilingQueries::ScopeId group_scope_id { ProfilingQueries::INVALID_SCOPE };
+};
+
+// Tracked per resource while executing, reset at the start of every execute
+struct RenderGraphResourceState
+{
+    VkPipelineStageFlags2 write_stage { VK_PIPELINE_STAGE_2_NONE };
+    VkAccessFlags2 write_access { VK_ACCESS_2_NONE };
+    VkPipelineStageFlags2 read_stages { VK_PIPELINE_STAGE_2_NONE }; // Since the last write, the next write waits for these
+    VkPipelineStageFlags2 synchronized_stages { VK_PIPELINE_STAGE_2_NONE }; // Stages that already waited for the last write
+    VkAccessFlags2 visible_access { VK_ACCESS_2_NONE };
+    VkImageLayout layout { VK_IMAGE_LAYOUT_UNDEFINED };
+    bool touched { false };
+};
+
+struct RenderGraph
+{
+    std::vector<RenderGraphResource> resources;
+    std::vector<RenderGraphPass> passes;
+
+    VmaAllocation transient_allocation { VK_NULL_HANDLE };
+    VkDeviceSize transient_memory_size { 0 };
+    VkDeviceSize unaliased_transient_memory_size { 0 }; // What the transient resources would take without aliasing
+
+    VkDevice device { VK_NULL_HANDLE };
+
+    // Kept around so executing doesn't allocate
+    std::vector<RenderGraphResourceState> resource_states;
+    std::vector<VkImageMemoryBarrier2> image_barriers;
+    VkPipelineStageFlags2 previous_frame_synchronized_stages { VK_PIPELINE_STAGE_2_NONE };
+    VkAccessFlags2 previous_frame_visible_access { VK_ACCESS_2_NONE };
+
+    // For imported images that change every frame (swapchain)
+    void set_imported_image(RenderGraphResourceHandle handle, VkImage image, VkImageView view);
+    const Renderer::AllocatedImage& get_image(RenderGraphResourceHandle handle) const;
+    VkBuffer get_buffer(RenderGraphResourceHandle handle) const;
+
+    void execute(VkCommandBuffer command_buffer);
+    void destroy();
+};
+
+struct RenderGraphBuilder;
+
+struct RenderGraphPassBuilder
+{
+    RenderGraphBuilder& graph_builder;
+    u32 pass_index;
+
+    RenderGraphPassBuilder& access(RenderGraphResourceHandle handle, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+    RenderGraphPassBuilder& read_buffer(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& write_buffer(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& read_write_buffer(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& transfer_read_buffer(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& transfer_write_buffer(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& indirect_read_buffer(RenderGraphResourceHandle handle); // Dispatch indirect arguments
+
+    RenderGraphPassBuilder& write_storage_image(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& read_storage_image(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& read_write_storage_image(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& transfer_read_image(RenderGraphResourceHandle handle);
+    RenderGraphPassBuilder& transfer_write_image(RenderGraphResourceHandle handle);
+
+    RenderGraphPassBuilder& profile_group(const char* group_name);
+    RenderGraphPassBuilder& enabled_if(std::function<bool()>&& predicate);
+    RenderGraphPassBuilder& execute(std::function<void(VkCommandBuffer command_buffer)>&& record);
+};
+
+struct RenderGraphBuilder
+{
+    std::vector<RenderGraphResource> resources;
+    std::vector<RenderGraphPass> passes;
+
+    // Transient buffers are registered with DeviceResources under their name, so pipelines can bind them like any other
+    RenderGraphResourceHandle create_transient_buffer(const std::string& name, VkDeviceSize size);
+    RenderGraphResourceHandle create_transient_image(const std::string& name, VkExtent2D extent, VkFormat format, VkImageUsageFlags usage);
+    RenderGraphResourceHandle import_buffer(const std::string& buffer_name);
+    RenderGraphResourceHandle import_image(const std::string& name, VkImageLayout initial_layout, VkPipelineStageFlags2 initial_stage);
+    RenderGraphBuilder& export_resource(RenderGraphResourceHandle handle, VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+    // Passes execute in the order they are added
+    RenderGraphPassBuilder add_pass(const std::string& name);
+
+    RenderGraph create(VkDevice device);
+};
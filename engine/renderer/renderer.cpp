@@ -2,9 +2,12 @@
 #include "renderer_core.h"
 
 #include <algorithm>
+#include <cfloat>
 #include <cmath>
+#include <cstddef>
 #include <cstdio>
 #include <span>
+#include <string>
 #include <vector>
 
 #include "../../common/types.h"
@@ -16,12 +19,16 @@
 #include "imgui.h"
 #include "SDL3/SDL_vulkan.h"
 #include <glm/mat4x4.hpp> // glm::mat4
+#include <glm/matrix.hpp> // glm::inverse
 
 #include "../data/voxel_model.h"
 #include "device_resources.h"
 #include "compute_pipeline.h"
 #include "profiling.h"
 #include "cameras.h"
+#include "render_graph.h"
+#include "pipeline_cache.h"
+#include "shader_compiler.h"
 
 #define OGT_VOX_IMPLEMENTATION
 #include <ogt_vox.h>
@@ -39,8 +46,6 @@ enum FunctionQueueLifetime
 #define HOTRELOAD 1
 #if HOTRELOAD
 #define HOTRELOAD_WORKING_DIRECTORY "../"
-// Have to use \\ for windows
-#define SHADER_COMPILE_SCRIPT_PATH "\"..\\compile_shaders.bat\""
 #define SHADER_SOURCE_PATH HOTRELOAD_WORKING_DIRECTORY "shaders/compute/"
 #define SHADER_COMPILED_PATH HOTRELOAD_WORKING_DIRECTORY "shaders/spirv-out/"
 #else
@@ -50,30 +55,380 @@ enum FunctionQueueLifetime
 struct
 {
     ComputePipeline raygen_pipeline;
-    ComputePipeline intersect_pipeline;
+    ComputePipeline beam_pipeline;
+    ComputePipeline history_scatter_pipeline;
+    ComputePipelineVariants intersect_pipelines; // Keyed by TraversalVariant
     ComputePipeline shade_pipeline;
+    ComputePipeline reduce_pipeline;
+    ComputePipelineVariants primary_pipelines; // Keyed by TraversalVariant
+    ComputePipeline path_setup_pipeline;
+    ComputePipeline path_prepare_pipeline;
+    ComputePipeline path_shadow_pipeline;
+    ComputePipeline path_extend_pipeline;
 
-    Renderer::AllocatedImage draw_image {};
+    RenderGraph render_graph {};
+    RenderGraphResourceHandle draw_image { INVALID_RENDER_GRAPH_RESOURCE };
+    RenderGraphResourceHandle swapchain_image { INVALID_RENDER_GRAPH_RESOURCE };
+
+    // Generate, trace and shade primary rays in one dispatch instead of the raygen/intersect/shade wavefront
+    bool fused_primary { false };
+    bool linear_pixel_order { false }; // Row major pixels instead of Morton ordered tiles, for comparing the two
+    bool soa_layout { false }; // Ray and hit records split into one plane per word
+    bool bit_parallel_bricks { false }; // Find the hit voxel in a brick with masks of the ray's path instead of stepping through it
+
+    // Diffuse bounces traced by the path passes after the primary hit, 0 keeps the direct shading of rt_shade.comp
+    u32 path_bounce_count { 0 };
+    bool any_hit_shadows { true }; // Shadow rays stop at the first hit, off makes them look for the closest hit like extension rays
+    bool path_ray_counts_recorded[ProfilingQueries::FRAME_SLICE_COUNT] {};
+    bool path_ray_counts_any_hit[ProfilingQueries::FRAME_SLICE_COUNT] {};
+    // Of every bounce, summed for the ray rates of the path passes
+    std::vector<ProfilingQueries::ScopeId> path_shadow_scope_ids;
+    std::vector<ProfilingQueries::ScopeId> path_extension_scope_ids;
+    u32 frame_index { 0 }; // Seeds the path sampling
+
+    // Only 1 in trace_interleave tiles is traced every frame, the others reproject their hit from the last frame
+    u32 trace_interleave { 1 };
+    // Traced rays first try starting just before last frame's hits around them, and trace again from the camera if that fails
+    bool temporal_start { false };
+    // What hit_history was last written with, it can only be reprojected from when the record layout is the same
+    bool hit_history_written { false };
+    glm::ivec2 hit_history_extent { 0 };
+    u32 hit_history_layout_flags { 0 };
+    // hit_history has a half for last frame's hits and one for this frame's, they swap every frame it is written
+    u32 hit_history_half_words { 0 };
+    u32 hit_history_read_half { 0 };
+
+    // Primary rays start at a distance the beam pass found nothing before for their tile, instead of at the camera
+    bool beam_prepass { false };
+    // Whether the intersect timing of the slice was with beam start distances, so both can be shown side by side
+    bool intersect_recorded[ProfilingQueries::FRAME_SLICE_COUNT] {};
+    bool intersect_beam_start[ProfilingQueries::FRAME_SLICE_COUNT] {};
+
+    bool traversal_counters_enabled { false };
+    bool traversal_counters_recorded[ProfilingQueries::FRAME_SLICE_COUNT] {};
+    bool traversal_counters_fused[ProfilingQueries::FRAME_SLICE_COUNT] {}; // Which path traced the rays of the slice
+    bool traversal_counters_linear[ProfilingQueries::FRAME_SLICE_COUNT] {}; // And in which pixel order
+    bool traversal_counters_bit_parallel[ProfilingQueries::FRAME_SLICE_COUNT] {}; // And how bricks were traversed
+    ProfilingQueries::ScopeId intersect_scope_id { ProfilingQueries::INVALID_SCOPE };
+    ProfilingQueries::ScopeId beam_scope_id { ProfilingQueries::INVALID_SCOPE };
+    ProfilingQueries::ScopeId primary_scope_id { ProfilingQueries::INVALID_SCOPE };
+
+    u32 view_mode { 0 };
+    bool debug_view_reduction_recorded[ProfilingQueries::FRAME_SLICE_COUNT] {};
+    f32 debug_view_mean { 0.0f };
+    f32 debug_view_max { 0.0f };
+
+    u32 frames_in_flight_request { 0 };
+
+    // Fraction of the swapchain extent that is traced, the blit scales it up. Buffers are always sized for a scale of 1
+    f32 render_scale { 1.0f };
+    bool dynamic_resolution { false }; // Lets update_dynamic_resolution pick render_scale
+    f32 dynamic_resolution_budget_ms { 8.0f };
+    u32 frames_since_render_scale_change { 0 };
+    ProfilingQueries::ScopeId trace_scope_id { ProfilingQueries::INVALID_SCOPE };
+    ProfilingQueries::ScopeId path_trace_scope_id { ProfilingQueries::INVALID_SCOPE };
+
+    // Pipelines replaced by hot reloading, destroyed once no frame in flight can still be using them
+    struct RetiredPipeline
+    {
+        ComputePipeline pipeline;
+        u32 frame_index;
+    };
+    std::vector<RetiredPipeline> retired_pipelines;
 } state;
 
+// Bits of debug_flags, mirrored in common.glsl
+enum DebugFlags : u32
+{
+    DEBUG_FLAG_TRAVERSAL_COUNTERS = 1 << 0,
+    DEBUG_FLAG_LINEAR_PIXEL_ORDER = 1 << 1,
+    DEBUG_FLAG_SOA_LAYOUT = 1 << 2,
+    DEBUG_FLAG_BEAM_START = 1 << 3,
+    DEBUG_FLAG_CLOSEST_HIT_SHADOWS = 1 << 4,
+};
+
+// Values of view_mode, mirrored in common.glsl
+enum ViewMode : u32
+{
+    VIEW_MODE_SHADED,
+    VIEW_MODE_NORMALS,
+    VIEW_MODE_DEPTH,
+    VIEW_MODE_CLOCK_COST,
+    VIEW_MODE_BRICK_STEPS,
+    VIEW_MODE_INSTANCE_TESTS,
+    VIEW_MODE_COUNT
+};
+
+const char* view_mode_names[VIEW_MODE_COUNT] { "Shaded", "Normals", "Depth", "Clock cost", "Brick steps", "Instance tests" };
+
+// Heatmap range used until the first reduction of a view mode has been read back
+const f32 view_mode_default_max[VIEW_MODE_COUNT] { 1.0f, 1.0f, 256.0f, 270000.0f, 64.0f, 64.0f };
+
+bool view_mode_has_debug_value(u32 view_mode)
+{
+    return view_mode >= VIEW_MODE_DEPTH;
+}
+
+// Specialization constant ids of traversal.glsl
+enum TraversalConstant : u32
+{
+    TRAVERSAL_CONSTANT_INSTRUMENTED = 0,
+    TRAVERSAL_CONSTANT_MODEL_INSTANCE_COUNT = 1,
+    TRAVERSAL_CONSTANT_BIT_PARALLEL_BRICKS = 2,
+};
+
+// Bits of the key of the traversal pipeline variants
+enum TraversalVariant : u32
+{
+    TRAVERSAL_VARIANT_INSTRUMENTED = 1 << 0,
+    TRAVERSAL_VARIANT_BIT_PARALLEL_BRICKS = 1 << 1,
+};
+
+// Only pay for counting steps and reading the clock when something looks at the result
+u32 get_traversal_variant()
+{
+    bool instrumented = state.traversal_counters_enabled
+        || state.view_mode == VIEW_MODE_CLOCK_COST
+        || state.view_mode == VIEW_MODE_BRICK_STEPS
+        || state.view_mode == VIEW_MODE_INSTANCE_TESTS;
+    return (instrumented ? TRAVERSAL_VARIANT_INSTRUMENTED : 0)
+        | (state.bit_parallel_bricks ? TRAVERSAL_VARIANT_BIT_PARALLEL_BRICKS : 0);
+}
+
+// Path rays are never counted or timed, so they only follow the brick traversal of the primary rays
+u32 get_path_traversal_variant()
+{
+    return state.bit_parallel_bricks ? TRAVERSAL_VARIANT_BIT_PARALLEL_BRICKS : 0;
+}
+
+ComputePipelineBuilder& specialize_traversal(ComputePipelineBuilder& builder, u32 traversal_variant)
+{
+    return builder
+        .set_specialization_constant(TRAVERSAL_CONSTANT_INSTRUMENTED, (traversal_variant & TRAVERSAL_VARIANT_INSTRUMENTED) != 0)
+        .set_specialization_constant(TRAVERSAL_CONSTANT_MODEL_INSTANCE_COUNT, VoxelModels::get_instance_count())
+        .set_specialization_constant(TRAVERSAL_CONSTANT_BIT_PARALLEL_BRICKS, (traversal_variant & TRAVERSAL_VARIANT_BIT_PARALLEL_BRICKS) != 0);
+}
+
+// The frames still in flight keep rendering with the old pipeline, so it can't be destroyed yet
+void swap_pipeline(ComputePipeline& pipeline, const ComputePipeline& new_pipeline)
+{
+    state.retired_pipelines.push_back({ pipeline, state.frame_index });
+    pipeline = new_pipeline;
+}
+
+void swap_pipeline_variants(ComputePipelineVariants& variants)
+{
+    std::vector<ComputePipeline> replaced_pipelines;
+    variants.rebuild(replaced_pipelines);
+
+    for (const auto& pipeline : replaced_pipelines)
+        state.retired_pipelines.push_back({ pipeline, state.frame_index });
+}
+
+// Called after the fence of the oldest frame in flight was waited on
+void destroy_retired_pipelines(bool destroy_all = false)
+{
+    std::erase_if(state.retired_pipelines, [destroy_all](auto& retired)
+    {
+        if (!destroy_all && state.frame_index - retired.frame_index < RENDERER_MAX_FRAMES_IN_FLIGHT)
+            return false;
+
+        retired.pipeline.destroy();
+        return true;
+    });
+}
+
+#if HOTRELOAD
+/* Recompiles just this shader on the ShaderCompiler thread when it changes, or anything in its .dependencies does.
+    on_compiled runs between frames and should swap in the new pipeline.
+*/
+void watch_shader(const char* shader_file_name, std::function<void()>&& on_compiled)
+{
+    std::filesystem::path source_path = std::string(SHADER_SOURCE_PATH) + shader_file_name;
+    std::filesystem::path output_path = std::string(SHADER_COMPILED_PATH) + shader_file_name + ".spv";
+
+    IO::watch_for_file_update(source_path,
+        [source_path, output_path, on_compiled]()
+        {
+            // The compile wrote new .dependencies, includes added since the watch started are watched from now on
+            ShaderCompiler::compile_async(source_path, output_path,
+                [source_path, on_compiled]()
+                {
+                    IO::update_file_dependencies(source_path);
+                    on_compiled();
+                });
+        });
+}
+#endif
+
+// The path passes start from the intersection results of the wavefront, and only shade
+bool path_tracing_active()
+{
+    return !state.fused_primary && state.path_bounce_count > 0 && state.view_mode == VIEW_MODE_SHADED;
+}
+
 struct alignas(16)
 {
     glm::mat4 camera_matrix { glm::mat4(1) };
     glm::ivec2 render_extent;
+    u32 debug_flags { 0 };
+    u32 view_mode { VIEW_MODE_SHADED };
+    f32 debug_view_max { 1.0f };
 } compute_push_constants;
 
-struct alignas(16) Ray
+struct
+{
+    u32 element_count;
+    u32 pixel_count;
+    u32 pass_index;
+} reduce_push_constants;
+
+constexpr u32 REDUCE_GROUP_SIZE { 256 }; // Matches rt_reduce.comp
+
+// Per pixel kernels run one workgroup per tile, matches pixel_order.glsl
+constexpr u32 PIXEL_TILE_SIZE { 8 };
+constexpr u32 PIXEL_TILE_PIXELS { PIXEL_TILE_SIZE * PIXEL_TILE_SIZE };
+
+u32 get_pixel_tile_count(u32 width, u32 height)
+{
+    return ((width + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE) * ((height + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE);
+}
+
+// Workgroups of a per pixel dispatch, linear order needs fewer but every buffer is sized for the tiles anyway
+u32 get_pixel_dispatch_size(glm::ivec2 render_extent)
+{
+    return get_pixel_tile_count(render_extent.x, render_extent.y);
+}
+
+constexpr f32 MIN_RENDER_SCALE { 0.25f };
+// Scale changes smaller than this are ignored, so timing noise doesn't make the resolution wobble
+constexpr f32 RENDER_SCALE_DEADBAND { 0.02f };
+
+glm::ivec2 get_render_extent()
+{
+    VkExtent2D surface_extent = Renderer::Core::get_swapchain_data().surface_extent;
+    return glm::ivec2(
+        std::max(static_cast<i32>(static_cast<f32>(surface_extent.width) * state.render_scale + 0.5f), 1),
+        std::max(static_cast<i32>(static_cast<f32>(surface_extent.height) * state.render_scale + 0.5f), 1));
+}
+
+/* Steers render_scale so the passes whose cost follows the pixel count take dynamic_resolution_budget_ms on the GPU.
+    Timings are resolved FRAME_SLICE_COUNT frames late, so after a change it waits until they were measured at the new scale.
+*/
+void update_dynamic_resolution()
 {
-    glm::vec3 position;
-    glm::vec3 direction;
+    state.frames_since_render_scale_change++;
+    if (!state.dynamic_resolution || state.frames_since_render_scale_change <= ProfilingQueries::FRAME_SLICE_COUNT)
+        return;
+
+    // Either group can be disabled, then its timing is stale
+    f32 scaled_passes_ms = 0.0f;
+    for (ProfilingQueries::ScopeId scope_id : { state.trace_scope_id, state.path_trace_scope_id })
+    {
+        auto& timing = ProfilingQueries::get_device_time_elapsed_ms(scope_id);
+        if (timing.has_been_updated_this_frame)
+            scaled_passes_ms += timing.time_ms;
+    }
+
+    if (scaled_passes_ms <= 0.0f)
+        return;
+
+    // The cost is roughly proportional to the pixel count, which goes with the square of the scale
+    f32 target_scale = std::clamp(state.render_scale * std::sqrt(state.dynamic_resolution_budget_ms / scaled_passes_ms), MIN_RENDER_SCALE, 1.0f);
+    if (std::abs(target_scale - state.render_scale) < RENDER_SCALE_DEADBAND)
+        return;
+
+    // Only go half way, so one slow frame doesn't drop the resolution all at once
+    state.render_scale += (target_scale - state.render_scale) * 0.5f;
+    state.frames_since_render_scale_change = 0;
+}
+
+struct alignas(16)
+{
+    glm::mat4 camera_matrix { glm::mat4(1) };
+    glm::ivec2 render_extent;
+    u32 bounce_index;
+    u32 bounce_count;
+    u32 frame_index;
+    u32 queue_capacity;
+    u32 debug_flags;
+} path_push_constants;
+
+constexpr u32 PATH_GROUP_SIZE { 64 }; // Matches path.glsl
+constexpr u32 MAX_PATH_BOUNCES { 4 }; // Passes are recorded for this many, the ones past path_bounce_count are disabled
+
+// Per pixel records, mirrored in common.glsl. Primary rays start at the camera so only the direction is stored
+struct PackedRay
+{
+    glm::vec2 octahedral_direction;
+};
+
+struct PackedHit
+{
+    f32 hit_distance;
+    u32 face_and_instance;
 };
 
-struct alignas(16) IntersectionResult
+// Mirrored in rt_intersect.comp
+struct ReprojectionData
+{
+    glm::mat4 previous_camera_matrix;
+    glm::mat4 inverse_camera_matrix;
+    u32 interleave;
+    u32 phase;
+    u32 history_valid;
+    u32 camera_static;
+    u32 temporal_start;
+    u32 history_read_offset;
+    u32 history_write_offset;
+} reprojection_data;
+
+const char* trace_interleave_names[] { "Every tile", "Checkerboard", "1 in 4 tiles" };
+const u32 trace_interleave_values[] { 1, 2, 4 };
+
+struct alignas(16) DebugViewReduction
 {
-    glm::vec4 incoming_direction_and_distance;
-    glm::vec4 normal;
+    glm::vec4 mean_max_sum_count;
 };
 
+struct alignas(16) QueuedRay
+{
+    glm::vec4 position_and_pixel;
+    glm::vec4 direction_and_weight;
+};
+
+// Mirrored in path.glsl, rt_path_prepare.comp writes the indirect dispatches of each bounce
+struct PathQueueState
+{
+    u32 extension_counts[2];
+    u32 shadow_count;
+    u32 active_extension_count;
+    u32 active_shadow_count;
+    VkDispatchIndirectCommand extension_dispatch;
+    VkDispatchIndirectCommand shadow_dispatch;
+    u32 traced_extension_count;
+    u32 traced_shadow_count;
+};
+
+struct PathRayCounts
+{
+    u32 traced_extension_count;
+    u32 traced_shadow_count;
+};
+
+struct alignas(16) TraversalCounters
+{
+    u32 rays;
+    u32 brick_steps;
+    u32 voxel_steps;
+    u32 instance_tests;
+    u32 brick_fetches;
+};
+
+// Sizes of what rt_intersect.comp reads for each counted fetch, used to estimate voxel_data traffic
+constexpr u32 VOXEL_BRICK_FETCH_BYTES { sizeof(u64) };
+constexpr u32 MODEL_HEADER_FETCH_BYTES { sizeof(glm::ivec4) * 2 + sizeof(glm::mat4) };
+
 void create_raygen_pipeline()
 {
     state.raygen_pipeline = ComputePipelineBuilder(SHADER_COMPILED_PATH "rt_raygen.comp.spv")
@@ -88,114 +443,205 @@ void create_raygen_pipeline()
     QUEUE_FUNCTION(FunctionQueueLifetime::CORE, state.raygen_pipeline.destroy());
 }
 
-void create_intersection_pipeline()
+constexpr u32 BEAM_GROUP_SIZE { 64 }; // Matches rt_beam.comp
+
+// The beam pass is never counted and marches whole bricks, so it always runs the default traversal
+ComputePipeline build_beam_pipeline()
 {
-    state.intersect_pipeline = ComputePipelineBuilder( SHADER_COMPILED_PATH "rt_intersect.comp.spv")
-        .bind_storage_buffer("raygen_buffer")
+    ComputePipelineBuilder builder(SHADER_COMPILED_PATH "rt_beam.comp.spv");
+    return specialize_traversal(builder, 0)
+        .bind_storage_buffer("beam_distances")
         .bind_storage_buffer("voxel_data")
-        .bind_storage_buffer("intersection_results")
+        .bind_storage_buffer("traversal_counters")
         .set_push_constants_size(sizeof(compute_push_constants))
         .create(Renderer::Core::get_logical_device());
+}
+
+void create_beam_pipeline()
+{
+    state.beam_pipeline = build_beam_pipeline();
 
-    /* TODO: When we are hot-reloading and live reconstructing the pipelines,
-        we cannot rely on the deletion queue (unless we can specify a key to
-        remove the pipline from it if we have to destroy the pipeline early)
-    */
 #if HOTRELOAD
-    IO::watch_for_file_update(SHADER_SOURCE_PATH "rt_intersect.comp",
-        []()
-        {
-            system(SHADER_COMPILE_SCRIPT_PATH);
-
-            state.intersect_pipeline.destroy();
-            state.intersect_pipeline = ComputePipelineBuilder(SHADER_COMPILED_PATH "rt_intersect.comp.spv")
-                .bind_storage_buffer("raygen_buffer")
-                .bind_storage_buffer("voxel_data")
-                .bind_storage_buffer("intersection_results")
-                .set_push_constants_size(sizeof(compute_push_constants))
-                .create(Renderer::Core::get_logical_device());
-        });
+    watch_shader("rt_beam.comp", []() { swap_pipeline(state.beam_pipeline, build_beam_pipeline()); });
 #endif
 }
 
-void create_shade_pipeline()
+ComputePipeline build_history_scatter_pipeline()
+{
+    return ComputePipelineBuilder(SHADER_COMPILED_PATH "rt_history_scatter.comp.spv")
+        .bind_storage_buffer("hit_history")
+        .bind_storage_buffer("reprojection")
+        .bind_storage_buffer("reprojected_distances")
+        .set_push_constants_size(sizeof(compute_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
+
+void create_history_scatter_pipeline()
+{
+    state.history_scatter_pipeline = build_history_scatter_pipeline();
+
+#if HOTRELOAD
+    watch_shader("rt_history_scatter.comp", []() { swap_pipeline(state.history_scatter_pipeline, build_history_scatter_pipeline()); });
+#endif
+}
+
+ComputePipeline build_intersection_pipeline(u32 traversal_variant)
 {
-    state.shade_pipeline = ComputePipelineBuilder( SHADER_COMPILED_PATH "rt_shade.comp.spv")
-        .bind_storage_image(state.draw_image.view)
+    ComputePipelineBuilder builder(SHADER_COMPILED_PATH "rt_intersect.comp.spv");
+    return specialize_traversal(builder, traversal_variant)
+        .bind_storage_buffer("raygen_buffer")
+        .bind_storage_buffer("voxel_data")
         .bind_storage_buffer("intersection_results")
+        .bind_storage_buffer("traversal_counters")
+        .bind_storage_buffer("debug_values")
+        .bind_storage_buffer("hit_history")
+        .bind_storage_buffer("reprojection")
+        .bind_storage_buffer("beam_distances")
+        .bind_storage_buffer("reprojected_distances")
         .set_push_constants_size(sizeof(compute_push_constants))
         .create(Renderer::Core::get_logical_device());
+}
+
+void create_intersection_pipeline()
+{
+    // Variants are built the first time a frame uses them
+    state.intersect_pipelines.build = build_intersection_pipeline;
 
     /* TODO: When we are hot-reloading and live reconstructing the pipelines,
         we cannot rely on the deletion queue (unless we can specify a key to
         remove the pipline from it if we have to destroy the pipeline early)
     */
 #if HOTRELOAD
-    IO::watch_for_file_update(SHADER_SOURCE_PATH "rt_shade.comp",
-        []()
-        {
-            system(SHADER_COMPILE_SCRIPT_PATH);
-
-            state.shade_pipeline.destroy();
-            state.shade_pipeline = ComputePipelineBuilder( SHADER_COMPILED_PATH "rt_shade.comp.spv")
-                .bind_storage_image(state.draw_image.view)
-                .bind_storage_buffer("intersection_results")
-                .set_push_constants_size(sizeof(compute_push_constants))
-                .create(Renderer::Core::get_logical_device());
-        });
+    watch_shader("rt_intersect.comp", []() { swap_pipeline_variants(state.intersect_pipelines); });
 #endif
 }
 
-void Renderer::initialize(SDL_Window* sdl_window_ptr)
+ComputePipeline build_path_setup_pipeline()
 {
-    Core::initialize(sdl_window_ptr);
-    auto swapchain_data = Core::get_swapchain_data();
+    return ComputePipelineBuilder(SHADER_COMPILED_PATH "rt_path_setup.comp.spv")
+        .bind_storage_image(state.render_graph.get_image(state.draw_image).view)
+        .bind_storage_buffer("intersection_results")
+        .bind_storage_buffer("path_queue_state")
+        .bind_storage_buffer("path_extension_queue")
+        .bind_storage_buffer("path_shadow_queue")
+        .bind_storage_buffer("voxel_data")
+        .set_push_constants_size(sizeof(path_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
 
-    state.draw_image = Renderer::Core::create_image(swapchain_data.surface_extent, VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT, VK_IMAGE_ASPECT_COLOR_BIT, "compute_draw_image");
+ComputePipeline build_path_prepare_pipeline()
+{
+    return ComputePipelineBuilder(SHADER_COMPILED_PATH "rt_path_prepare.comp.spv")
+        .bind_storage_buffer("path_queue_state")
+        .set_push_constants_size(sizeof(path_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
 
-    DeviceResources::create_buffer("raygen_buffer", sizeof(Ray) * swapchain_data.surface_extent.width * swapchain_data.surface_extent.height);
-    DeviceResources::create_buffer("intersection_results", sizeof(IntersectionResult) * swapchain_data.surface_extent.width * swapchain_data.surface_extent.height);
+ComputePipeline build_path_shadow_pipeline()
+{
+    ComputePipelineBuilder builder(SHADER_COMPILED_PATH "rt_path_shadow.comp.spv");
+    return specialize_traversal(builder, get_path_traversal_variant())
+        .bind_storage_image(state.render_graph.get_image(state.draw_image).view)
+        .bind_storage_buffer("voxel_data")
+        .bind_storage_buffer("traversal_counters")
+        .bind_storage_buffer("path_queue_state")
+        .bind_storage_buffer("path_shadow_queue")
+        .set_push_constants_size(sizeof(path_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
 
-    VoxelModels::load("../monu1.vox", glm::ivec3(6));
-    VoxelModels::upload_models_to_gpu();
+ComputePipeline build_path_extend_pipeline()
+{
+    ComputePipelineBuilder builder(SHADER_COMPILED_PATH "rt_path_extend.comp.spv");
+    return specialize_traversal(builder, get_path_traversal_variant())
+        .bind_storage_image(state.render_graph.get_image(state.draw_image).view)
+        .bind_storage_buffer("voxel_data")
+        .bind_storage_buffer("traversal_counters")
+        .bind_storage_buffer("path_queue_state")
+        .bind_storage_buffer("path_extension_queue")
+        .bind_storage_buffer("path_shadow_queue")
+        .set_push_constants_size(sizeof(path_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
 
-    create_raygen_pipeline();
-    create_intersection_pipeline();
-    create_shade_pipeline();
+void destroy_path_pipelines()
+{
+    state.path_setup_pipeline.destroy();
+    state.path_prepare_pipeline.destroy();
+    state.path_shadow_pipeline.destroy();
+    state.path_extend_pipeline.destroy();
 }
 
-void transition_image_layout(VkCommandBuffer cmd_buffer, VkImage image, VkImageLayout old_layout, VkImageLayout new_layout, VkAccessFlags2 src_access_mask, VkAccessFlags2 dst_access_mask, VkPipelineStageFlags2 src_stage_mask, VkPipelineStageFlags2 dst_stage_mask)
+void create_path_pipelines()
 {
-    VkImageMemoryBarrier2 barrier
-    {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
-        .srcStageMask = src_stage_mask,
-        .srcAccessMask = src_access_mask,
-        .dstStageMask = dst_stage_mask,
-        .dstAccessMask = dst_access_mask,
-        .oldLayout = old_layout,
-        .newLayout = new_layout,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = image,
-        .subresourceRange = {
-            .aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1
-        }
-    };
+    state.path_setup_pipeline = build_path_setup_pipeline();
+    state.path_prepare_pipeline = build_path_prepare_pipeline();
+    state.path_shadow_pipeline = build_path_shadow_pipeline();
+    state.path_extend_pipeline = build_path_extend_pipeline();
 
-    VkDependencyInfo dependency_info
-    {
-        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-        .dependencyFlags = {},
-        .imageMemoryBarrierCount = 1,
-        .pImageMemoryBarriers = &barrier
-    };
+#if HOTRELOAD
+    // path.glsl and traversal.glsl are in the .dependencies of the kernels including them, so only those are compiled again
+    watch_shader("rt_path_setup.comp", []() { swap_pipeline(state.path_setup_pipeline, build_path_setup_pipeline()); });
+    watch_shader("rt_path_prepare.comp", []() { swap_pipeline(state.path_prepare_pipeline, build_path_prepare_pipeline()); });
+    watch_shader("rt_path_shadow.comp", []() { swap_pipeline(state.path_shadow_pipeline, build_path_shadow_pipeline()); });
+    watch_shader("rt_path_extend.comp", []() { swap_pipeline(state.path_extend_pipeline, build_path_extend_pipeline()); });
+#endif
+}
+
+ComputePipeline build_primary_pipeline(u32 traversal_variant)
+{
+    ComputePipelineBuilder builder(SHADER_COMPILED_PATH "rt_primary.comp.spv");
+    return specialize_traversal(builder, traversal_variant)
+        .bind_storage_image(state.render_graph.get_image(state.draw_image).view)
+        .bind_storage_buffer("voxel_data")
+        .bind_storage_buffer("debug_values")
+        .bind_storage_buffer("traversal_counters")
+        .set_push_constants_size(sizeof(compute_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
+
+void create_primary_pipeline()
+{
+    state.primary_pipelines.build = build_primary_pipeline;
+
+#if HOTRELOAD
+    watch_shader("rt_primary.comp", []() { swap_pipeline_variants(state.primary_pipelines); });
+#endif
+}
 
-    vkCmdPipelineBarrier2(cmd_buffer, &dependency_info);
+ComputePipeline build_shade_pipeline()
+{
+    return ComputePipelineBuilder( SHADER_COMPILED_PATH "rt_shade.comp.spv")
+        .bind_storage_image(state.render_graph.get_image(state.draw_image).view)
+        .bind_storage_buffer("intersection_results")
+        .bind_storage_buffer("debug_values")
+        .bind_storage_buffer("voxel_data")
+        .set_push_constants_size(sizeof(compute_push_constants))
+        .create(Renderer::Core::get_logical_device());
+}
+
+void create_shade_pipeline()
+{
+    state.shade_pipeline = build_shade_pipeline();
+
+    /* TODO: When we are hot-reloading and live reconstructing the pipelines,
+        we cannot rely on the deletion queue (unless we can specify a key to
+        remove the pipline from it if we have to destroy the pipeline early)
+    */
+#if HOTRELOAD
+    watch_shader("rt_shade.comp", []() { swap_pipeline(state.shade_pipeline, build_shade_pipeline()); });
+#endif
+}
+
+void create_reduce_pipeline()
+{
+    state.reduce_pipeline = ComputePipelineBuilder(SHADER_COMPILED_PATH "rt_reduce.comp.spv")
+        .bind_storage_buffer("debug_values")
+        .bind_storage_buffer("debug_view_reduction")
+        .set_push_constants_size(sizeof(reduce_push_constants))
+        .create(Renderer::Core::get_logical_device());
+
+    QUEUE_FUNCTION(FunctionQueueLifetime::CORE, state.reduce_pipeline.destroy());
 }
 
 void copy_image_to_image(VkCommandBuffer cmd_buffer, VkImage source, VkImage destination, VkExtent2D srcSize, VkExtent2D dstSize)
@@ -232,12 +678,695 @@ void copy_image_to_image(VkCommandBuffer cmd_buffer, VkImage source, VkImage des
     vkCmdBlitImage2(cmd_buffer, &blitInfo);
 }
 
+/* raygen_buffer and intersection_results are both alive during intersect, so they can't share memory,
+    but the draw image and the reduction scratch are only needed once the rays are gone and reuse raygen_buffer's
+*/
+void create_render_graph()
+{
+    // Sized for the whole swapchain extent, lower render scales only use the start of every buffer and a corner of the draw image
+    auto swapchain_data = Renderer::Core::get_swapchain_data();
+    u32 pixel_count = swapchain_data.surface_extent.width * swapchain_data.surface_extent.height;
+    // Per pixel buffers hold whole tiles, the padding past the edges of the image is written as misses
+    u32 tiled_pixel_count = get_pixel_tile_count(swapchain_data.surface_extent.width, swapchain_data.surface_extent.height) * PIXEL_TILE_PIXELS;
+    // One partial sum and max per reduction workgroup follows the final result
+    u32 reduction_partial_count = (tiled_pixel_count + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE;
+
+    RenderGraphBuilder builder;
+    auto raygen_buffer = builder.create_transient_buffer("raygen_buffer", sizeof(PackedRay) * tiled_pixel_count);
+    auto intersection_results = builder.create_transient_buffer("intersection_results", sizeof(PackedHit) * tiled_pixel_count);
+    // Only written in view modes with a debug value, kept out of the hit record so shading doesn't pay for it
+    auto debug_values = builder.create_transient_buffer("debug_values", sizeof(f32) * tiled_pixel_count);
+    auto reprojection = builder.create_transient_buffer("reprojection", sizeof(ReprojectionData));
+    auto beam_distances = builder.create_transient_buffer("beam_distances", sizeof(f32) * tiled_pixel_count / PIXEL_TILE_PIXELS);
+    // Closest of last frame's hits landing in each pixel, as float bits so they can be kept with atomicMin
+    auto reprojected_distances = builder.create_transient_buffer("reprojected_distances", sizeof(u32) * tiled_pixel_count);
+    auto debug_view_reduction = builder.create_transient_buffer("debug_view_reduction", sizeof(DebugViewReduction) + sizeof(glm::vec2) * reduction_partial_count);
+    // Every pixel queues at most one ray of each kind per bounce, extension rays ping-pong between two halves
+    auto path_queue_state = builder.create_transient_buffer("path_queue_state", sizeof(PathQueueState));
+    auto path_extension_queue = builder.create_transient_buffer("path_extension_queue", sizeof(QueuedRay) * pixel_count * 2);
+    auto path_shadow_queue = builder.create_transient_buffer("path_shadow_queue", sizeof(QueuedRay) * pixel_count);
+    state.draw_image = builder.create_transient_image("compute_draw_image", swapchain_data.surface_extent, VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+
+    auto voxel_data = builder.import_buffer("voxel_data");
+    auto traversal_counters = builder.import_buffer("traversal_counters");
+    auto hit_history = builder.import_buffer("hit_history");
+    auto traversal_counters_readback = builder.import_buffer("traversal_counters_readback");
+    auto path_ray_counts_readback = builder.import_buffer("path_ray_counts_readback");
+    auto debug_view_reduction_readback = builder.import_buffer("debug_view_reduction_readback");
+    // The acquire semaphore is waited on at the color attachment output stage
+    state.swapchain_image = builder.import_image("swapchain", VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+    // Core draws ImGui on top of the swapchain image after us, and the readbacks are read on the host
+    builder.export_resource(state.swapchain_image, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    builder.export_resource(traversal_counters_readback, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+    builder.export_resource(path_ray_counts_readback, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+    builder.export_resource(debug_view_reduction_readback, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+
+    builder.add_pass("clear traversal counters")
+        .transfer_write_buffer(traversal_counters)
+        .enabled_if([]() { return state.traversal_counters_enabled; })
+        .execute([traversal_counters](VkCommandBuffer cmd)
+        {
+            vkCmdFillBuffer(cmd, state.render_graph.get_buffer(traversal_counters), 0, VK_WHOLE_SIZE, 0);
+        });
+
+    builder.add_pass("raygen")
+        .write_buffer(raygen_buffer)
+        .enabled_if([]() { return !state.fused_primary; })
+        .profile_group("trace")
+        .execute([](VkCommandBuffer cmd)
+        {
+            state.raygen_pipeline.dispatch(cmd, get_pixel_dispatch_size(compute_push_constants.render_extent), 1, 1, &compute_push_constants);
+        });
+
+    // In the trace group like the passes around it, a pass outside of it would split the group's timing in two
+    builder.add_pass("update reprojection")
+        .transfer_write_buffer(reprojection)
+        .enabled_if([]() { return !state.fused_primary; })
+        .profile_group("trace")
+        .execute([reprojection](VkCommandBuffer cmd)
+        {
+            vkCmdUpdateBuffer(cmd, state.render_graph.get_buffer(reprojection), 0, sizeof(reprojection_data), &reprojection_data);
+        });
+
+    builder.add_pass("beam")
+        .read_buffer(voxel_data)
+        .write_buffer(beam_distances)
+        .enabled_if([]() { return !state.fused_primary && state.beam_prepass; })
+        .profile_group("trace")
+        .execute([](VkCommandBuffer cmd)
+        {
+            u32 tile_count = get_pixel_dispatch_size(compute_push_constants.render_extent);
+            state.beam_pipeline.dispatch(cmd, (tile_count + BEAM_GROUP_SIZE - 1) / BEAM_GROUP_SIZE, 1, 1, &compute_push_constants);
+        });
+
+    // Only tiles that aren't traced look at the reprojected hits, and with every tile traced there are none
+    builder.add_pass("clear reprojected distances")
+        .transfer_write_buffer(reprojected_distances)
+        .enabled_if([]() { return !state.fused_primary && state.trace_interleave > 1; })
+        .profile_group("trace")
+        .execute([reprojected_distances](VkCommandBuffer cmd)
+        {
+            constexpr u32 FLT_MAX_BITS { 0x7F800000 }; // FLT_MAX in the shaders is infinity
+            vkCmdFillBuffer(cmd, state.render_graph.get_buffer(reprojected_distances), 0, VK_WHOLE_SIZE, FLT_MAX_BITS);
+        });
+
+    builder.add_pass("history scatter")
+        .read_buffer(hit_history)
+        .read_buffer(reprojection)
+        .read_write_buffer(reprojected_distances)
+        .enabled_if([]() { return !state.fused_primary && state.trace_interleave > 1; })
+        .profile_group("trace")
+        .execute([](VkCommandBuffer cmd)
+        {
+            state.history_scatter_pipeline.dispatch(cmd, get_pixel_dispatch_size(compute_push_constants.render_extent), 1, 1, &compute_push_constants);
+        });
+
+    builder.add_pass("intersect")
+        .read_buffer(raygen_buffer)
+        .read_buffer(reprojection)
+        .read_buffer(beam_distances)
+        .read_buffer(reprojected_distances)
+        .read_write_buffer(hit_history)
+        .read_buffer(voxel_data)
+        .write_buffer(intersection_results)
+        .write_buffer(debug_values)
+        .read_write_buffer(traversal_counters)
+        .enabled_if([]() { return !state.fused_primary; })
+        .profile_group("trace")
+        .execute([](VkCommandBuffer cmd)
+        {
+            u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+            state.intersect_recorded[frame_slice] = true;
+            state.intersect_beam_start[frame_slice] = state.beam_prepass;
+
+            state.intersect_pipelines.get(get_traversal_variant()).dispatch(cmd, get_pixel_dispatch_size(compute_push_constants.render_extent), 1, 1, &compute_push_constants);
+        });
+
+    builder.add_pass("shade")
+        .read_buffer(intersection_results)
+        .read_buffer(debug_values)
+        .read_buffer(voxel_data)
+        .write_storage_image(state.draw_image)
+        .enabled_if([]() { return !state.fused_primary && !path_tracing_active(); })
+        .profile_group("trace")
+        .execute([](VkCommandBuffer cmd)
+        {
+            state.shade_pipeline.dispatch(cmd, get_pixel_dispatch_size(compute_push_constants.render_extent), 1, 1, &compute_push_constants);
+        });
+
+    builder.add_pass("primary (fused)")
+        .read_buffer(voxel_data)
+        .write_buffer(debug_values)
+        .read_write_buffer(traversal_counters)
+        .write_storage_image(state.draw_image)
+        .enabled_if([]() { return state.fused_primary; })
+        .profile_group("trace")
+        .execute([](VkCommandBuffer cmd)
+        {
+            state.primary_pipelines.get(get_traversal_variant()).dispatch(cmd, get_pixel_dispatch_size(compute_push_constants.render_extent), 1, 1, &compute_push_constants);
+        });
+
+    /* Wavefront path tracing, every bounce only dispatches over the rays still alive in the compacted queues.
+        Radiance is added straight into the draw image, a pixel has at most one ray of each kind in flight per pass.
+    */
+    builder.add_pass("clear ray queues")
+        .transfer_write_buffer(path_queue_state)
+        .enabled_if(path_tracing_active)
+        .profile_group("path trace")
+        .execute([path_queue_state](VkCommandBuffer cmd)
+        {
+            vkCmdFillBuffer(cmd, state.render_graph.get_buffer(path_queue_state), 0, VK_WHOLE_SIZE, 0);
+        });
+
+    builder.add_pass("path setup")
+        .read_buffer(intersection_results)
+        .read_buffer(voxel_data)
+        .read_write_buffer(path_queue_state)
+        .write_buffer(path_extension_queue)
+        .write_buffer(path_shadow_queue)
+        .write_storage_image(state.draw_image)
+        .enabled_if(path_tracing_active)
+        .profile_group("path trace")
+        .execute([pixel_count](VkCommandBuffer cmd)
+        {
+            path_push_constants.camera_matrix = compute_push_constants.camera_matrix;
+            path_push_constants.render_extent = compute_push_constants.render_extent;
+            path_push_constants.bounce_index = 0;
+            path_push_constants.bounce_count = state.path_bounce_count;
+            path_push_constants.frame_index = state.frame_index;
+            path_push_constants.queue_capacity = pixel_count;
+            path_push_constants.debug_flags = compute_push_constants.debug_flags;
+
+            state.path_setup_pipeline.dispatch(cmd, get_pixel_dispatch_size(compute_push_constants.render_extent), 1, 1, &path_push_constants);
+        });
+
+    // Bounce i traces the shadow rays queued by the previous hit, then extends the paths that are still alive
+    for (u32 bounce_index = 0; bounce_index <= MAX_PATH_BOUNCES; bounce_index++)
+    {
+        std::string bounce_name = "bounce " + std::to_string(bounce_index);
+
+        builder.add_pass(bounce_name + " prepare")
+            .read_write_buffer(path_queue_state)
+            .enabled_if([bounce_index]() { return path_tracing_active() && bounce_index <= state.path_bounce_count; })
+            .profile_group("path trace")
+            .execute([bounce_index](VkCommandBuffer cmd)
+            {
+                path_push_constants.bounce_index = bounce_index;
+                state.path_prepare_pipeline.dispatch(cmd, 1, 1, 1, &path_push_constants);
+            });
+
+        builder.add_pass(bounce_name + " shadow rays")
+            .indirect_read_buffer(path_queue_state)
+            .read_buffer(path_queue_state)
+            .read_buffer(path_shadow_queue)
+            .read_buffer(voxel_data)
+            .read_write_storage_image(state.draw_image)
+            .enabled_if([bounce_index]() { return path_tracing_active() && bounce_index <= state.path_bounce_count; })
+            .profile_group("path trace")
+            .execute([path_queue_state](VkCommandBuffer cmd)
+            {
+                state.path_shadow_pipeline.dispatch_indirect(cmd, state.render_graph.get_buffer(path_queue_state), offsetof(PathQueueState, shadow_dispatch), &path_push_constants);
+            });
+
+        if (bounce_index == MAX_PATH_BOUNCES)
+            break;
+
+        builder.add_pass(bounce_name + " extension rays")
+            .indirect_read_buffer(path_queue_state)
+            .read_write_buffer(path_queue_state)
+            .read_write_buffer(path_extension_queue)
+            .read_write_buffer(path_shadow_queue)
+            .read_buffer(voxel_data)
+            .read_write_storage_image(state.draw_image)
+            .enabled_if([bounce_index]() { return path_tracing_active() && bounce_index < state.path_bounce_count; })
+            .profile_group("path trace")
+            .execute([path_queue_state](VkCommandBuffer cmd)
+            {
+                state.path_extend_pipeline.dispatch_indirect(cmd, state.render_graph.get_buffer(path_queue_state), offsetof(PathQueueState, extension_dispatch), &path_push_constants);
+            });
+    }
+
+    builder.add_pass("copy path ray counts")
+        .transfer_read_buffer(path_queue_state)
+        .transfer_write_buffer(path_ray_counts_readback)
+        .enabled_if(path_tracing_active)
+        .profile_group("path trace")
+        .execute([path_queue_state, path_ray_counts_readback](VkCommandBuffer cmd)
+        {
+            u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+            VkBufferCopy copy
+            {
+                .srcOffset = offsetof(PathQueueState, traced_extension_count),
+                .dstOffset = sizeof(PathRayCounts) * frame_slice,
+                .size = sizeof(PathRayCounts),
+            };
+            vkCmdCopyBuffer(cmd, state.render_graph.get_buffer(path_queue_state), state.render_graph.get_buffer(path_ray_counts_readback), 1, &copy);
+            state.path_ray_counts_recorded[frame_slice] = true;
+            state.path_ray_counts_any_hit[frame_slice] = state.any_hit_shadows;
+        });
+
+    // Runs after the path passes, which also count, so it can't be in the trace group without opening it a second time
+    builder.add_pass("copy traversal counters")
+        .transfer_read_buffer(traversal_counters)
+        .transfer_write_buffer(traversal_counters_readback)
+        .enabled_if([]() { return state.traversal_counters_enabled; })
+        .execute([traversal_counters, traversal_counters_readback](VkCommandBuffer cmd)
+        {
+            u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+            VkBufferCopy copy
+            {
+                .srcOffset = 0,
+                .dstOffset = sizeof(TraversalCounters) * frame_slice,
+                .size = sizeof(TraversalCounters),
+            };
+            vkCmdCopyBuffer(cmd, state.render_graph.get_buffer(traversal_counters), state.render_graph.get_buffer(traversal_counters_readback), 1, &copy);
+            state.traversal_counters_recorded[frame_slice] = true;
+            state.traversal_counters_fused[frame_slice] = state.fused_primary;
+            state.traversal_counters_linear[frame_slice] = state.linear_pixel_order;
+            state.traversal_counters_bit_parallel[frame_slice] = state.bit_parallel_bricks;
+        });
+
+    // Only the tiles of the render extent were written this frame
+    builder.add_pass("reduce partials")
+        .read_buffer(debug_values)
+        .write_buffer(debug_view_reduction)
+        .enabled_if([]() { return view_mode_has_debug_value(state.view_mode); })
+        .profile_group("debug view reduce")
+        .execute([](VkCommandBuffer cmd)
+        {
+            glm::ivec2 render_extent = compute_push_constants.render_extent;
+            u32 tiled_pixel_count = get_pixel_dispatch_size(render_extent) * PIXEL_TILE_PIXELS;
+            reduce_push_constants = { .element_count = tiled_pixel_count, .pixel_count = static_cast<u32>(render_extent.x * render_extent.y), .pass_index = 0 };
+            state.reduce_pipeline.dispatch(cmd, (tiled_pixel_count + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE, 1, 1, &reduce_push_constants);
+        });
+
+    builder.add_pass("reduce final")
+        .read_write_buffer(debug_view_reduction)
+        .enabled_if([]() { return view_mode_has_debug_value(state.view_mode); })
+        .profile_group("debug view reduce")
+        .execute([](VkCommandBuffer cmd)
+        {
+            reduce_push_constants.element_count = (reduce_push_constants.element_count + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE;
+            reduce_push_constants.pass_index = 1;
+            state.reduce_pipeline.dispatch(cmd, 1, 1, 1, &reduce_push_constants);
+        });
+
+    builder.add_pass("copy debug view reduction")
+        .transfer_read_buffer(debug_view_reduction)
+        .transfer_write_buffer(debug_view_reduction_readback)
+        .enabled_if([]() { return view_mode_has_debug_value(state.view_mode); })
+        .profile_group("debug view reduce")
+        .execute([debug_view_reduction, debug_view_reduction_readback](VkCommandBuffer cmd)
+        {
+            u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+            VkBufferCopy copy
+            {
+                .srcOffset = 0,
+                .dstOffset = sizeof(DebugViewReduction) * frame_slice,
+                .size = sizeof(DebugViewReduction),
+            };
+            vkCmdCopyBuffer(cmd, state.render_graph.get_buffer(debug_view_reduction), state.render_graph.get_buffer(debug_view_reduction_readback), 1, &copy);
+            state.debug_view_reduction_recorded[frame_slice] = true;
+        });
+
+    builder.add_pass("blit")
+        .transfer_read_image(state.draw_image)
+        .transfer_write_image(state.swapchain_image)
+        .execute([](VkCommandBuffer cmd)
+        {
+            // Scales the traced part of the draw image up to the whole swapchain image
+            auto extent = Renderer::Core::get_swapchain_data().surface_extent;
+            VkExtent2D render_extent { static_cast<u32>(compute_push_constants.render_extent.x), static_cast<u32>(compute_push_constants.render_extent.y) };
+            copy_image_to_image(cmd, state.render_graph.get_image(state.draw_image).image, state.render_graph.get_image(state.swapchain_image).image, render_extent, extent);
+        });
+
+    state.render_graph = builder.create(Renderer::Core::get_logical_device());
+
+    state.path_shadow_scope_ids.clear();
+    state.path_extension_scope_ids.clear();
+    for (auto& pass : state.render_graph.passes)
+    {
+        if (pass.name.ends_with(" shadow rays"))
+            state.path_shadow_scope_ids.push_back(pass.scope_id);
+        else if (pass.name.ends_with(" extension rays"))
+            state.path_extension_scope_ids.push_back(pass.scope_id);
+    }
+}
+
+void Renderer::initialize(SDL_Window* sdl_window_ptr)
+{
+    Core::initialize(sdl_window_ptr);
+    PipelineCache::initialize("pipeline_cache.bin"); // In the working directory
+#if HOTRELOAD
+    ShaderCompiler::initialize();
+#endif
+
+    DeviceResources::create_buffer("traversal_counters", sizeof(TraversalCounters));
+    // Outlives the frame, so it can't be a transient of the render graph
+    auto surface_extent = Core::get_swapchain_data().surface_extent;
+    u32 hit_history_half_size = sizeof(PackedHit) * get_pixel_tile_count(surface_extent.width, surface_extent.height) * PIXEL_TILE_PIXELS;
+    DeviceResources::create_buffer("hit_history", hit_history_half_size * 2);
+    state.hit_history_half_words = hit_history_half_size / sizeof(u32);
+    DeviceResources::create_readback_buffer("traversal_counters_readback", sizeof(TraversalCounters) * ProfilingQueries::FRAME_SLICE_COUNT);
+    DeviceResources::create_readback_buffer("path_ray_counts_readback", sizeof(PathRayCounts) * ProfilingQueries::FRAME_SLICE_COUNT);
+    DeviceResources::create_readback_buffer("debug_view_reduction_readback", sizeof(DebugViewReduction) * ProfilingQueries::FRAME_SLICE_COUNT);
+
+    state.intersect_scope_id = ProfilingQueries::register_device_scope("intersect", PROFILING_SCOPE_NAME_HASH("intersect"));
+    state.beam_scope_id = ProfilingQueries::register_device_scope("beam", PROFILING_SCOPE_NAME_HASH("beam"));
+    state.primary_scope_id = ProfilingQueries::register_device_scope("primary (fused)", PROFILING_SCOPE_NAME_HASH("primary (fused)"));
+    // The profile groups of the render graph passes that run per pixel
+    state.trace_scope_id = ProfilingQueries::register_device_scope("trace", PROFILING_SCOPE_NAME_HASH("trace"));
+    state.path_trace_scope_id = ProfilingQueries::register_device_scope("path trace", PROFILING_SCOPE_NAME_HASH("path trace"));
+
+    VoxelModels::load("../monu1.vox", glm::ivec3(6));
+    VoxelModels::upload_models_to_gpu();
+
+    // Creates the per pixel buffers, which the pipelines bind by name
+    create_render_graph();
+
+    create_raygen_pipeline();
+    create_beam_pipeline();
+    create_history_scatter_pipeline();
+    create_intersection_pipeline();
+    create_shade_pipeline();
+    create_reduce_pipeline();
+    create_primary_pipeline();
+    create_path_pipelines();
+
+    // The default traversal variants, so the first frame doesn't stall on them
+    state.intersect_pipelines.get(0);
+    state.primary_pipelines.get(0);
+
+    printf("Created %u pipelines in %.2fms (%s pipeline cache)\n", PipelineCache::get_created_pipeline_count(), PipelineCache::get_pipeline_creation_time_ms(), PipelineCache::was_loaded_from_disk() ? "warm" : "cold");
+}
+
+void draw_timings_table(const char* table_id, std::span<const ProfilingQueries::Timing> timings, bool show_invocations = false)
+{
+    if (!ImGui::BeginTable(table_id, show_invocations ? 8 : 7, ImGuiTableFlags_SizingFixedFit | ImGuiTableFlags_RowBg))
+        return;
+
+    ImGui::TableSetupColumn("Scope");
+    ImGui::TableSetupColumn("Time");
+    ImGui::TableSetupColumn("10 avg");
+    ImGui::TableSetupColumn("p50");
+    ImGui::TableSetupColumn("p95");
+    ImGui::TableSetupColumn("p99");
+    ImGui::TableSetupColumn("Max");
+    if (show_invocations)
+        ImGui::TableSetupColumn("Invocations");
+    ImGui::TableHeadersRow();
+
+    for (auto& timing : timings)
+    {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::Text("%*s%s", static_cast<i32>(timing.depth) * 2, "", timing.name);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fms", timing.time_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fms", timing.average_10_time_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fms", timing.statistics.p50_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fms", timing.statistics.p95_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fms", timing.statistics.p99_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.2fms", timing.statistics.max_ms);
+        if (show_invocations)
+        {
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(timing.compute_invocations));
+        }
+    }
+
+    ImGui::EndTable();
+}
+
+void draw_frame_time_window()
+{
+    ImGui::Begin("Frame Time", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+
+    auto& frame_time = ProfilingQueries::get_frame_time_ms();
+    auto& statistics = frame_time.statistics;
+    ImGui::Text("Frame time: %.2fms (%u frames)", frame_time.time_ms, statistics.sample_count);
+    ImGui::Text("min %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f", statistics.min_ms, statistics.p50_ms, statistics.p95_ms, statistics.p99_ms, statistics.max_ms);
+
+    auto samples = ProfilingQueries::get_frame_time_samples_ms();
+    ImGui::PlotLines("## Frame time graph", samples.data(), static_cast<i32>(samples.size()), 0, "frame time", 0.0f, statistics.max_ms, ImVec2(400, 80));
+
+    auto histogram = ProfilingQueries::get_frame_time_histogram();
+    char histogram_label[32];
+    snprintf(histogram_label, sizeof(histogram_label), "0 - %.1fms", histogram.max_ms);
+    ImGui::PlotHistogram("## Frame time histogram", histogram.bucket_counts.data(), static_cast<i32>(histogram.bucket_counts.size()), 0, histogram_label, 0.0f, FLT_MAX, ImVec2(400, 80));
+
+    i32 window = static_cast<i32>(ProfilingQueries::get_statistics_window());
+    if (ImGui::SliderInt("Window (frames)", &window, 10, static_cast<i32>(ProfilingQueries::get_max_statistics_window())))
+        ProfilingQueries::set_statistics_window(static_cast<u32>(window));
+
+    f32 spike_threshold_ms = ProfilingQueries::get_spike_threshold_ms();
+    if (ImGui::SliderFloat("Spike threshold", &spike_threshold_ms, 0.0f, 100.0f, "%.1fms"))
+        ProfilingQueries::set_spike_threshold_ms(spike_threshold_ms);
+
+    u32 spike_capture_count = ProfilingQueries::get_spike_capture_count();
+    for (u32 i = 0; i < spike_capture_count; i++)
+    {
+        auto spike_capture = ProfilingQueries::get_spike_capture(i);
+
+        ImGui::PushID(static_cast<i32>(i));
+        if (ImGui::TreeNode("spike", "Frame %llu: %.2fms", static_cast<unsigned long long>(spike_capture.frame_index), spike_capture.frame_time_ms))
+        {
+            draw_timings_table("## Spike CPU timings", spike_capture.host_timings);
+            if (spike_capture.device_timings.empty())
+                ImGui::Text("GPU timings pending");
+            else
+                draw_timings_table("## Spike GPU timings", spike_capture.device_timings);
+            ImGui::TreePop();
+        }
+        ImGui::PopID();
+    }
+
+    ImGui::End();
+}
+
+void draw_counters_window()
+{
+    ImGui::Begin("Counters", nullptr, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_AlwaysAutoResize);
+
+    if (ImGui::BeginTable("## Counters table", 3, ImGuiTableFlags_SizingFixedFit | ImGuiTableFlags_RowBg))
+    {
+        ImGui::TableSetupColumn("Counter");
+        ImGui::TableSetupColumn("Value");
+        ImGui::TableSetupColumn("10 avg");
+        ImGui::TableHeadersRow();
+
+        for (auto& counter : ProfilingQueries::get_all_counters())
+        {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", counter.name);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f", counter.value);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f", counter.average_10_value);
+        }
+
+        ImGui::EndTable();
+    }
+
+    ImGui::End();
+}
+
+/* The readback slice being reused this frame was written FRAME_SLICE_COUNT frames ago,
+    which is the same frame the profiler just resolved the intersect timing for
+*/
+void update_traversal_counters()
+{
+    u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+    if (!state.traversal_counters_recorded[frame_slice])
+        return;
+
+    state.traversal_counters_recorded[frame_slice] = false;
+
+    DeviceResources::invalidate_readback_buffer("traversal_counters_readback", sizeof(TraversalCounters) * frame_slice, sizeof(TraversalCounters));
+    auto readback_buffer = DeviceResources::get_buffer("traversal_counters_readback");
+    TraversalCounters counters = static_cast<TraversalCounters*>(readback_buffer.mapped_data)[frame_slice];
+
+    if (counters.rays == 0)
+        return;
+
+    f64 rays = counters.rays;
+    bool fused = state.traversal_counters_fused[frame_slice];
+    // The fused time includes ray generation and shading, which is the point of comparing the two
+    f64 intersect_ms = ProfilingQueries::get_device_time_elapsed_ms(fused ? state.primary_scope_id : state.intersect_scope_id).time_ms;
+    f64 voxel_data_bytes = static_cast<f64>(counters.brick_fetches) * VOXEL_BRICK_FETCH_BYTES + static_cast<f64>(counters.instance_tests) * MODEL_HEADER_FETCH_BYTES;
+
+    // Separate counters per pixel order and brick traversal, so the averages of each stay visible side by side
+    f64 mrays_per_second = intersect_ms > 0.0 ? rays / (intersect_ms * 1000.0) : 0.0;
+    bool linear = state.traversal_counters_linear[frame_slice];
+    bool bit_parallel = state.traversal_counters_bit_parallel[frame_slice];
+    if (fused)
+    {
+        if (linear && bit_parallel)
+        {
+            PROFILE_COUNTER("primary (fused) Mrays/s, linear order, bit-parallel bricks", mrays_per_second);
+        }
+        else if (linear)
+        {
+            PROFILE_COUNTER("primary (fused) Mrays/s, linear order", mrays_per_second);
+        }
+        else if (bit_parallel)
+        {
+            PROFILE_COUNTER("primary (fused) Mrays/s, bit-parallel bricks", mrays_per_second);
+        }
+        else
+        {
+            PROFILE_COUNTER("primary (fused) Mrays/s", mrays_per_second);
+        }
+    }
+    else
+    {
+        if (linear && bit_parallel)
+        {
+            PROFILE_COUNTER("intersect Mrays/s, linear order, bit-parallel bricks", mrays_per_second);
+        }
+        else if (linear)
+        {
+            PROFILE_COUNTER("intersect Mrays/s, linear order", mrays_per_second);
+        }
+        else if (bit_parallel)
+        {
+            PROFILE_COUNTER("intersect Mrays/s, bit-parallel bricks", mrays_per_second);
+        }
+        else
+        {
+            PROFILE_COUNTER("intersect Mrays/s", mrays_per_second);
+        }
+    }
+    PROFILE_COUNTER("brick steps/ray", counters.brick_steps / rays);
+    PROFILE_COUNTER("voxel steps/ray", counters.voxel_steps / rays);
+    PROFILE_COUNTER("instance tests/ray", counters.instance_tests / rays);
+    PROFILE_COUNTER("voxel_data MB/frame", voxel_data_bytes / (1024.0 * 1024.0));
+    PROFILE_COUNTER("voxel_data GB/s", intersect_ms > 0.0 ? voxel_data_bytes / (intersect_ms * 1.0e6) : 0.0);
+}
+
+/* Intersect with and without beam start distances go to separate counters, so the averages of both stay visible side by side.
+    With them the beam pass has to be paid for as well, which is what the total is for
+*/
+void update_beam_prepass_counters()
+{
+    u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+    if (!state.intersect_recorded[frame_slice])
+        return;
+
+    state.intersect_recorded[frame_slice] = false;
+
+    f64 intersect_ms = ProfilingQueries::get_device_time_elapsed_ms(state.intersect_scope_id).time_ms;
+    if (state.intersect_beam_start[frame_slice])
+    {
+        f64 beam_ms = ProfilingQueries::get_device_time_elapsed_ms(state.beam_scope_id).time_ms;
+        PROFILE_COUNTER("intersect ms, beam start", intersect_ms);
+        PROFILE_COUNTER("beam + intersect ms", beam_ms + intersect_ms);
+    }
+    else
+    {
+        PROFILE_COUNTER("intersect ms", intersect_ms);
+    }
+}
+
+// Bounces past path_bounce_count are disabled, then their timing is stale
+f64 get_updated_time_ms(std::span<const ProfilingQueries::ScopeId> scope_ids)
+{
+    f64 time_ms = 0.0;
+    for (ProfilingQueries::ScopeId scope_id : scope_ids)
+    {
+        auto& timing = ProfilingQueries::get_device_time_elapsed_ms(scope_id);
+        if (timing.has_been_updated_this_frame)
+            time_ms += timing.time_ms;
+    }
+    return time_ms;
+}
+
+/* Extension rays always look for the closest hit, shadow rays for any hit unless any_hit_shadows is off.
+    Like the intersect rates, the shadow rate of both goes to its own counter so they can be compared side by side
+*/
+void update_path_ray_counters()
+{
+    u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+    if (!state.path_ray_counts_recorded[frame_slice])
+        return;
+
+    state.path_ray_counts_recorded[frame_slice] = false;
+
+    DeviceResources::invalidate_readback_buffer("path_ray_counts_readback", sizeof(PathRayCounts) * frame_slice, sizeof(PathRayCounts));
+    auto readback_buffer = DeviceResources::get_buffer("path_ray_counts_readback");
+    PathRayCounts counts = static_cast<PathRayCounts*>(readback_buffer.mapped_data)[frame_slice];
+
+    f64 extension_ms = get_updated_time_ms(state.path_extension_scope_ids);
+    if (counts.traced_extension_count > 0 && extension_ms > 0.0)
+        PROFILE_COUNTER("extension rays Mrays/s, closest hit", counts.traced_extension_count / (extension_ms * 1000.0));
+
+    f64 shadow_ms = get_updated_time_ms(state.path_shadow_scope_ids);
+    if (counts.traced_shadow_count == 0 || shadow_ms <= 0.0)
+        return;
+
+    f64 shadow_mrays_per_second = counts.traced_shadow_count / (shadow_ms * 1000.0);
+    if (state.path_ray_counts_any_hit[frame_slice])
+    {
+        PROFILE_COUNTER("shadow rays Mrays/s, any hit", shadow_mrays_per_second);
+    }
+    else
+    {
+        PROFILE_COUNTER("shadow rays Mrays/s, closest hit", shadow_mrays_per_second);
+    }
+}
+
+void update_debug_view_reduction()
+{
+    u32 frame_slice = ProfilingQueries::get_current_frame_slice();
+    if (!state.debug_view_reduction_recorded[frame_slice])
+        return;
+
+    state.debug_view_reduction_recorded[frame_slice] = false;
+
+    DeviceResources::invalidate_readback_buffer("debug_view_reduction_readback", sizeof(DebugViewReduction) * frame_slice, sizeof(DebugViewReduction));
+    auto readback_buffer = DeviceResources::get_buffer("debug_view_reduction_readback");
+    DebugViewReduction reduction = static_cast<DebugViewReduction*>(readback_buffer.mapped_data)[frame_slice];
+
+    state.debug_view_mean = reduction.mean_max_sum_count.x;
+    state.debug_view_max = reduction.mean_max_sum_count.y;
+}
+
+void draw_debug_view_window()
+{
+    ImGui::Begin("Debug View", nullptr, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_AlwaysAutoResize);
+    ImGui::Text("%s", view_mode_names[state.view_mode]);
+    ImGui::Text("mean %.2f  max %.2f", state.debug_view_mean, state.debug_view_max);
+    ImGui::End();
+}
+
 void Renderer::begin_frame()
 {
     auto per_frame_data = Renderer::Core::begin_frame();
+    Renderer::Cameras::start_of_frame_update();
+
+#if HOTRELOAD
+    // Between frames, so no pass is recorded with half of the pipelines of a reload
+    ShaderCompiler::update();
+#endif
+    destroy_retired_pipelines();
+
+    update_traversal_counters();
+    update_beam_prepass_counters();
+    update_path_ray_counters();
+    update_debug_view_reduction();
+    update_dynamic_resolution();
 
     static bool display_cpu_queries = true;
     static bool display_gpu_queries = true;
+    static bool display_frame_time = true;
+    static bool display_counters = false;
 
     ImGui::SetWindowPos(ImVec2(0, 0));
     ImGui::BeginMainMenuBar();
@@ -254,6 +1383,45 @@ void Renderer::begin_frame()
             // ImGui::MenuItem("Enabled", "", &enabled);
             ImGui::Checkbox("CPU Profiling queries", &display_cpu_queries);
             ImGui::Checkbox("GPU Profiling queries", &display_gpu_queries);
+            ImGui::Checkbox("Frame time statistics", &display_frame_time);
+            ImGui::Checkbox("Traversal counters", &state.traversal_counters_enabled);
+            ImGui::Checkbox("Fused primary rays", &state.fused_primary);
+            ImGui::Checkbox("Linear pixel order", &state.linear_pixel_order);
+            ImGui::Checkbox("SoA ray and hit records", &state.soa_layout);
+            // The primary rays pick their variant every frame, the path pipelines only have the one and are built again
+            if (ImGui::Checkbox("Bit-parallel bricks", &state.bit_parallel_bricks))
+            {
+                swap_pipeline(state.path_shadow_pipeline, build_path_shadow_pipeline());
+                swap_pipeline(state.path_extend_pipeline, build_path_extend_pipeline());
+            }
+            ImGui::Checkbox("Beam pre-pass", &state.beam_prepass);
+            i32 path_bounce_count = static_cast<i32>(state.path_bounce_count);
+            if (ImGui::SliderInt("Path bounces", &path_bounce_count, 0, MAX_PATH_BOUNCES))
+                state.path_bounce_count = static_cast<u32>(path_bounce_count);
+            ImGui::Checkbox("Any hit shadow rays", &state.any_hit_shadows);
+            i32 trace_interleave_index = static_cast<i32>(std::find(std::begin(trace_interleave_values), std::end(trace_interleave_values), state.trace_interleave) - std::begin(trace_interleave_values));
+            if (ImGui::Combo("Traced tiles", &trace_interleave_index, trace_interleave_names, IM_ARRAYSIZE(trace_interleave_names)))
+                state.trace_interleave = trace_interleave_values[trace_interleave_index];
+            ImGui::Checkbox("Temporal start distance", &state.temporal_start);
+            ImGui::Checkbox("Dynamic resolution", &state.dynamic_resolution);
+            ImGui::SliderFloat("Trace budget", &state.dynamic_resolution_budget_ms, 1.0f, 33.0f, "%.1fms");
+            if (ImGui::SliderFloat("Render scale", &state.render_scale, MIN_RENDER_SCALE, 1.0f, "%.2f"))
+                state.frames_since_render_scale_change = 0;
+
+            i32 frames_in_flight = static_cast<i32>(Renderer::Core::get_frames_in_flight());
+            if (ImGui::SliderInt("Frames in flight", &frames_in_flight, 1, RENDERER_MAX_FRAMES_IN_FLIGHT))
+                state.frames_in_flight_request = static_cast<u32>(frames_in_flight); // Applied after this frame has been submitted
+            ImGui::Checkbox("Counters", &display_counters);
+
+            i32 view_mode = static_cast<i32>(state.view_mode);
+            if (ImGui::Combo("View", &view_mode, view_mode_names, VIEW_MODE_COUNT))
+            {
+                state.view_mode = static_cast<u32>(view_mode);
+                // The last reduction belongs to a different view mode, so its range means nothing here
+                state.debug_view_mean = 0.0f;
+                state.debug_view_max = 0.0f;
+                std::fill_n(state.debug_view_reduction_recorded, ProfilingQueries::FRAME_SLICE_COUNT, false);
+            }
             ImGui::EndMenu();
         }
         ImGui::Separator();
@@ -274,99 +1442,92 @@ void Renderer::begin_frame()
     if (display_gpu_queries)
     {
         ImGui::Begin("GPU Timings", nullptr, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_AlwaysAutoResize);
-        auto all_gpu_timings = ProfilingQueries::get_all_device_times_elapsed_ms();
-        for (auto& timing : all_gpu_timings)
-        {
-            ImGui::Text("%s 10 avg time: %.2fms", timing.name.c_str(), timing.average_10_time_ms);
-            ImGui::Text("%s        time: %.2fms", timing.name.c_str(), timing.time_ms);
-        }
+        bool show_invocations = Renderer::Core::get_physical_device_properties().enabled_features.pipelineStatisticsQuery == VK_TRUE;
+        draw_timings_table("## GPU timings table", ProfilingQueries::get_all_device_times_elapsed_ms(), show_invocations);
         ImGui::End();
     }
 
     if (display_cpu_queries)
     {
         ImGui::Begin("CPU Timings", nullptr, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_AlwaysAutoResize);
-        auto all_cpu_timings = ProfilingQueries::get_all_host_times_elapsed_ms();
-        for (auto& timing : all_cpu_timings)
-        {
-            ImGui::Text("%s 10 avg time: %.2fms", timing.name.c_str(), timing.average_10_time_ms);
-            ImGui::Text("%s        time: %.2fms", timing.name.c_str(), timing.time_ms);
-        }
+        draw_timings_table("## CPU timings table", ProfilingQueries::get_all_host_times_elapsed_ms());
         ImGui::End();
     }
+
+    if (display_frame_time)
+    {
+        draw_frame_time_window();
+    }
+
+    if (display_counters)
+    {
+        draw_counters_window();
+    }
+
+    if (view_mode_has_debug_value(state.view_mode))
+    {
+        draw_debug_view_window();
+    }
+}
+
+// Tells rt_intersect.comp which tiles to trace this frame, and whether last frame's hits can be reprojected or started from
+void update_reprojection_data()
+{
+    auto camera = Renderer::Cameras::get_current_camera_data_copy();
+    u32 layout_flags = compute_push_constants.debug_flags & (DEBUG_FLAG_LINEAR_PIXEL_ORDER | DEBUG_FLAG_SOA_LAYOUT);
+
+    reprojection_data.previous_camera_matrix = camera.previous_camera_matrix;
+    reprojection_data.inverse_camera_matrix = glm::inverse(camera.camera_matrix);
+    reprojection_data.interleave = state.trace_interleave;
+    reprojection_data.phase = state.frame_index % state.trace_interleave;
+    reprojection_data.history_valid = state.hit_history_written
+        && state.hit_history_extent == compute_push_constants.render_extent
+        && state.hit_history_layout_flags == layout_flags;
+    reprojection_data.camera_static = camera.camera_matrix == camera.previous_camera_matrix;
+    reprojection_data.temporal_start = state.temporal_start;
+    reprojection_data.history_read_offset = state.hit_history_read_half * state.hit_history_half_words;
+    reprojection_data.history_write_offset = (1 - state.hit_history_read_half) * state.hit_history_half_words;
+
+    // The fused path never writes the history
+    state.hit_history_written = !state.fused_primary && (state.trace_interleave > 1 || state.temporal_start);
+    if (state.hit_history_written)
+        state.hit_history_read_half = 1 - state.hit_history_read_half;
+    state.hit_history_extent = compute_push_constants.render_extent;
+    state.hit_history_layout_flags = layout_flags;
 }
 
 void Renderer::end_frame()
 {
     auto per_frame_data = Renderer::Core::get_current_frame_data();
-    auto swapchain_data = Renderer::Core::get_swapchain_data();
-    ProfilingQueries::host_start("frame submit");
-    compute_push_constants.camera_matrix = Renderer::Cameras::get_current_camera_data_copy().camera_matrix;
-
-    transition_image_layout(per_frame_data.command_buffer,
-       per_frame_data.swapchain_image,
-       VK_IMAGE_LAYOUT_UNDEFINED,
-       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-       {},
-       VK_ACCESS_2_TRANSFER_WRITE_BIT,
-       VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT,
-       VK_PIPELINE_STAGE_2_TRANSFER_BIT
-    );
-
-    transition_image_layout(per_frame_data.command_buffer,
-       state.draw_image.image,
-       VK_IMAGE_LAYOUT_UNDEFINED,
-       VK_IMAGE_LAYOUT_GENERAL,
-       {},
-       VK_ACCESS_2_SHADER_WRITE_BIT,
-       VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT,
-       VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT
-    );
-
-    u32 dispatch_width = std::ceil(swapchain_data.surface_extent.width / 16.0);
-    u32 dispatch_height = std::ceil(swapchain_data.surface_extent.height / 16.0);
-    u32 dispatch_width2 = std::ceil(swapchain_data.surface_extent.width / 8.0);
-    u32 dispatch_height2 = std::ceil(swapchain_data.surface_extent.height / 16.0);
-
-    compute_push_constants.render_extent = glm::ivec2(swapchain_data.surface_extent.width, swapchain_data.surface_extent.height);
-
-    ProfilingQueries::device_start("raygen", per_frame_data.command_buffer);
-    state.raygen_pipeline.dispatch(per_frame_data.command_buffer, dispatch_width, dispatch_height, 1, &compute_push_constants);
-    ProfilingQueries::device_stop("raygen", per_frame_data.command_buffer);
-
-    ProfilingQueries::device_start("intersect", per_frame_data.command_buffer);
-    state.intersect_pipeline.dispatch(per_frame_data.command_buffer, dispatch_width2, dispatch_height2, 1, &compute_push_constants);
-    ProfilingQueries::device_stop("intersect", per_frame_data.command_buffer);
-
-    ProfilingQueries::device_start("shade", per_frame_data.command_buffer);
-    state.shade_pipeline.dispatch(per_frame_data.command_buffer, dispatch_width, dispatch_height, 1, &compute_push_constants);
-    ProfilingQueries::device_stop("shade", per_frame_data.command_buffer);
-
-    transition_image_layout(per_frame_data.command_buffer,
-       state.draw_image.image,
-       VK_IMAGE_LAYOUT_GENERAL,
-       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-       {},
-       VK_ACCESS_2_TRANSFER_READ_BIT,
-       VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-       VK_PIPELINE_STAGE_2_TRANSFER_BIT
-    );
-
-    copy_image_to_image(per_frame_data.command_buffer, state.draw_image.image, per_frame_data.swapchain_image, swapchain_data.surface_extent, swapchain_data.surface_extent);
-
-    transition_image_layout(per_frame_data.command_buffer,
-       per_frame_data.swapchain_image,
-       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-       VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-       VK_ACCESS_2_TRANSFER_WRITE_BIT,
-       {},
-       VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-       VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT
-    );
-
-    ProfilingQueries::host_stop("frame submit");
+
+    {
+        PROFILE_HOST_SCOPE("frame submit");
+        compute_push_constants.camera_matrix = Renderer::Cameras::get_current_camera_data_copy().camera_matrix;
+        compute_push_constants.render_extent = get_render_extent();
+        compute_push_constants.debug_flags = (state.traversal_counters_enabled ? DEBUG_FLAG_TRAVERSAL_COUNTERS : 0)
+            | (state.linear_pixel_order ? DEBUG_FLAG_LINEAR_PIXEL_ORDER : 0)
+            | (state.soa_layout ? DEBUG_FLAG_SOA_LAYOUT : 0)
+            | (state.beam_prepass ? DEBUG_FLAG_BEAM_START : 0)
+            | (state.any_hit_shadows ? 0 : DEBUG_FLAG_CLOSEST_HIT_SHADOWS);
+        compute_push_constants.view_mode = state.view_mode;
+        // The heatmap is scaled by the max of a previous frame, that is close enough and saves a second pass
+        compute_push_constants.debug_view_max = state.debug_view_max > 0.0f ? state.debug_view_max : view_mode_default_max[state.view_mode];
+
+        update_reprojection_data();
+
+        state.render_graph.set_imported_image(state.swapchain_image, per_frame_data.swapchain_image, per_frame_data.swapchain_image_view);
+        state.render_graph.execute(per_frame_data.command_buffer);
+        state.frame_index++;
+    }
+
     Renderer::Core::end_frame();
     //SDL_Delay(30);
+
+    if (state.frames_in_flight_request != 0)
+    {
+        Renderer::Core::set_frames_in_flight(state.frames_in_flight_request);
+        state.frames_in_flight_request = 0;
+    }
 }
 
 void Renderer::terminate()
@@ -376,9 +1537,20 @@ void Renderer::terminate()
         FunctionQueueLifetime::CORE lifetime is up. Maybe some
         key system to remove stuff from the queue if need be?
     */
-    state.intersect_pipeline.destroy();
+#if HOTRELOAD
+    ShaderCompiler::terminate();
+#endif
+    vkDeviceWaitIdle(Renderer::Core::get_logical_device());
+    destroy_retired_pipelines(true);
+    state.beam_pipeline.destroy();
+    state.history_scatter_pipeline.destroy();
+    state.intersect_pipelines.destroy();
     state.shade_pipeline.destroy();
+    state.primary_pipelines.destroy();
+    destroy_path_pipelines();
     QUEUE_FLUSH(FunctionQueueLifetime::CORE);
+    state.render_graph.destroy();
+    PipelineCache::terminate();
 
     Renderer::Core::terminate();
 }
\ No newline at end of file
@@ -2,10 +2,17 @@
 
 #define RENDERER_DEBUG 1
 
+/* How many frames the CPU can record ahead of the GPU, the actual count can be changed at runtime
+    (see Core::set_frames_in_flight) but never above this
+*/
+#define RENDERER_MAX_FRAMES_IN_FLIGHT 3
+#define RENDERER_DEFAULT_FRAMES_IN_FLIGHT 2
+
 #include "vv_vulkan.h"
 #include "vk_mem_alloc.h"
 #include <string>
 #include <functional>
+#include <vector>
 #include "../../common/types.h"
 
 #if RENDERER_DEBUG
@@ -35,11 +42,13 @@ struct SDL_Window;
 
 namespace Renderer
 {
+    // One per frame in flight, the swapchain image is whichever one was acquired for the frame
     struct PerFrameData
     {
-        VkSemaphore render_semaphore { VK_NULL_HANDLE };
+        VkSemaphore acquire_semaphore { VK_NULL_HANDLE };
         VkFence render_fence { VK_NULL_HANDLE };
         VkCommandBuffer command_buffer { VK_NULL_HANDLE };
+        u32 frame_slot { 0 };
 
         VkImage swapchain_image { VK_NULL_HANDLE };
         VkImageView swapchain_image_view { VK_NULL_HANDLE };
@@ -49,6 +58,7 @@ namespace Renderer
     {
         VkPhysicalDeviceDescriptorBufferPropertiesEXT descriptor_buffer_properties;
         VkPhysicalDeviceProperties2 properties;
+        VkPhysicalDeviceFeatures enabled_features; // What was turned on when creating the device
     };
 
     struct SwapchainData
@@ -75,6 +85,16 @@ namespace Renderer
 
         void submit_immediate_command(std::function<void(VkCommandBuffer cmd)>&& function);
 
+        /* Records commands onto the transfer queue without waiting for them and returns the timeline value
+            the upload signals. The commands only start once every frame submitted so far is done with written_buffers,
+            which are released by the main queue for them and handed back afterwards. The next frame acquires them and
+            waits for the upload on the GPU, on_complete is called from begin_frame once the device is done with the commands.
+            Call it between frames, the frame being recorded would still use the buffers after they were released.
+        */
+        u64 submit_transfer_command(std::function<void(VkCommandBuffer cmd)>&& function, std::vector<VkBuffer>&& written_buffers, std::function<void()>&& on_complete = {});
+        bool is_transfer_complete(u64 timeline_value);
+        void wait_for_transfer(u64 timeline_value);
+
         const PerFrameData& begin_frame();
         void end_frame();
 
@@ -83,5 +103,9 @@ namespace Renderer
         const PhysicalDeviceProperties& get_physical_device_properties();
         const VmaAllocator& get_vma_allocator();
         const PerFrameData& get_current_frame_data();
+
+        // Waits for the device to go idle, so only call this outside of begin_frame/end_frame
+        void set_frames_in_flight(u32 frame_count);
+        u32 get_frames_in_flight();
     }
 }
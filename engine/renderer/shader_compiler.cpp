@@ -0,0 +1,269 @@
+﻿#include "shader_compiler.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SDL3/SDL_timer.h"
+
+#include "../../common/io.h"
+
+#if VV_USE_SHADERC
+#include <shaderc/shaderc.hpp>
+#endif
+
+struct CompileJob
+{
+    std::filesystem::path source_path;
+    std::filesystem::path output_path;
+    std::function<void()> on_compiled;
+    bool succeeded { false };
+};
+
+struct
+{
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable job_queued;
+    bool stopping { false };
+
+    // Both guarded by mutex
+    std::deque<CompileJob> queued_jobs;
+    std::vector<CompileJob> finished_jobs;
+} internal;
+
+#if VV_USE_SHADERC
+// Resolves includes relative to the including file, and remembers every file it opened for the .dependencies file
+class DependencyRecordingIncluder : public shaderc::CompileOptions::IncluderInterface
+{
+public:
+    explicit DependencyRecordingIncluder(std::vector<std::filesystem::path>& dependencies) : dependencies(dependencies) {}
+
+    shaderc_include_result* GetInclude(const char* requested_source, shaderc_include_type type, const char* requesting_source, size_t) override
+    {
+        std::filesystem::path path = type == shaderc_include_type_relative
+            ? std::filesystem::path(requesting_source).parent_path() / requested_source
+            : std::filesystem::path(requested_source);
+
+        auto* include = new IncludedFile();
+        if (std::filesystem::exists(path))
+        {
+            path = std::filesystem::absolute(path);
+            auto file_data = IO::read_binary_file(path);
+            include->name = path.string();
+            include->content.assign(reinterpret_cast<const char*>(file_data.data()), file_data.size());
+            dependencies.push_back(path);
+        }
+        else
+        {
+            // An empty name tells shaderc the include failed, the content is the error message
+            include->content = "Cannot find include file " + std::string(requested_source);
+        }
+
+        include->result = shaderc_include_result
+        {
+            .source_name = include->name.c_str(),
+            .source_name_length = include->name.size(),
+            .content = include->content.c_str(),
+            .content_length = include->content.size(),
+            .user_data = include,
+        };
+        return &include->result;
+    }
+
+    void ReleaseInclude(shaderc_include_result* data) override
+    {
+        delete static_cast<IncludedFile*>(data->user_data);
+    }
+
+private:
+    struct IncludedFile
+    {
+        std::string name;
+        std::string content;
+        shaderc_include_result result;
+    };
+
+    std::vector<std::filesystem::path>& dependencies;
+};
+
+shaderc_shader_kind get_shader_kind(const std::filesystem::path& source_path)
+{
+    auto extension = source_path.extension();
+    if (extension == ".vert")
+        return shaderc_vertex_shader;
+    if (extension == ".frag")
+        return shaderc_fragment_shader;
+    return shaderc_compute_shader;
+}
+
+// Same format glslc -MD writes, so IO picks up the includes of the new version of the shader
+bool write_dependencies_file(const CompileJob& job, const std::vector<std::filesystem::path>& dependencies)
+{
+    std::string content = job.output_path.string() + ": " + job.source_path.string();
+    for (const auto& dependency : dependencies)
+        content += " " + dependency.string();
+    content += "\n";
+
+    std::filesystem::path dependencies_path = job.source_path.string() + ".dependencies";
+    return IO::write_binary_file(dependencies_path, content.data(), content.size());
+}
+
+bool compile(const CompileJob& job)
+{
+    auto source_data = IO::read_binary_file(job.source_path);
+    if (source_data.empty())
+        return false;
+
+    std::vector<std::filesystem::path> dependencies;
+
+    shaderc::CompileOptions options;
+    options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_3);
+    options.SetGenerateDebugInfo();
+    options.SetIncluder(std::make_unique<DependencyRecordingIncluder>(dependencies));
+
+    // The compiler is cheap to create and not shared between threads
+    shaderc::Compiler compiler;
+    std::string source_path = job.source_path.string();
+    auto result = compiler.CompileGlslToSpv(reinterpret_cast<const char*>(source_data.data()), source_data.size(), get_shader_kind(job.source_path), source_path.c_str(), options);
+
+    if (result.GetCompilationStatus() != shaderc_compilation_status_success)
+    {
+        printf("%s", result.GetErrorMessage().c_str());
+        return false;
+    }
+
+    std::vector<u32> spirv(result.cbegin(), result.cend());
+    if (!IO::write_binary_file(job.output_path, spirv.data(), spirv.size() * sizeof(u32)))
+        return false;
+
+    return write_dependencies_file(job, dependencies);
+}
+#else
+std::string get_glslc_path()
+{
+    const char* vulkan_sdk_path = std::getenv("VULKAN_SDK");
+    if (vulkan_sdk_path == nullptr)
+        return "glslc"; // Hope it is on the path
+
+#if _WIN32
+    return (std::filesystem::path(vulkan_sdk_path) / "Bin" / "glslc.exe").string();
+#else
+    return (std::filesystem::path(vulkan_sdk_path) / "bin" / "glslc").string();
+#endif
+}
+
+// The same arguments compile_shaders.bat uses, glslc leaves the old output alone when compiling fails
+bool compile(const CompileJob& job)
+{
+    std::string source_path = job.source_path.string();
+    std::string command = "\"" + get_glslc_path() + "\" --target-env=vulkan1.3 -g -MD"
+        + " -MF \"" + source_path + ".dependencies\""
+        + " \"" + source_path + "\""
+        + " -o \"" + job.output_path.string() + "\"";
+
+#if _WIN32
+    // cmd strips the outer quotes of the command line when it starts with one
+    command = "\"" + command + "\"";
+#endif
+
+    return std::system(command.c_str()) == 0;
+}
+#endif
+
+void run_worker()
+{
+    while (true)
+    {
+        CompileJob job;
+        {
+            std::unique_lock lock(internal.mutex);
+            internal.job_queued.wait(lock, []() { return internal.stopping || !internal.queued_jobs.empty(); });
+
+            if (internal.stopping)
+                return;
+
+            job = std::move(internal.queued_jobs.front());
+            internal.queued_jobs.pop_front();
+        }
+
+        u64 start_time = SDL_GetPerformanceCounter();
+        job.succeeded = compile(job);
+        f64 compile_time_ms = static_cast<f64>(SDL_GetPerformanceCounter() - start_time) * 1000.0 / static_cast<f64>(SDL_GetPerformanceFrequency());
+
+        if (job.succeeded)
+            printf("Compiled %s in %.2fms\n", job.source_path.filename().string().c_str(), compile_time_ms);
+        else
+            printf("Failed to compile %s, keeping the previous version\n", job.source_path.filename().string().c_str());
+
+        std::lock_guard lock(internal.mutex);
+        internal.finished_jobs.push_back(std::move(job));
+    }
+}
+
+namespace ShaderCompiler
+{
+    void initialize()
+    {
+        internal.stopping = false;
+        internal.worker = std::thread(run_worker);
+    }
+
+    void terminate()
+    {
+        {
+            std::lock_guard lock(internal.mutex);
+            internal.stopping = true;
+            internal.queued_jobs.clear();
+            internal.finished_jobs.clear();
+        }
+        internal.job_queued.notify_all();
+
+        if (internal.worker.joinable())
+            internal.worker.join();
+    }
+
+    void compile_async(const std::filesystem::path& source_path, const std::filesystem::path& output_path, const std::function<void()>& on_compiled)
+    {
+        // Absolute paths, so the .dependencies file can be found from any working directory
+        std::filesystem::path absolute_source_path = std::filesystem::absolute(source_path);
+        {
+            std::lock_guard lock(internal.mutex);
+
+            // Saving several of its includes at once asks for the same shader more than once
+            for (const auto& queued_job : internal.queued_jobs)
+            {
+                if (queued_job.source_path == absolute_source_path)
+                    return;
+            }
+
+            internal.queued_jobs.push_back(
+            {
+                .source_path = absolute_source_path,
+                .output_path = std::filesystem::absolute(output_path),
+                .on_compiled = on_compiled,
+            });
+        }
+        internal.job_queued.notify_one();
+    }
+
+    void update()
+    {
+        std::vector<CompileJob> finished_jobs;
+        {
+            std::lock_guard lock(internal.mutex);
+            finished_jobs.swap(internal.finished_jobs);
+        }
+
+        for (const auto& job : finished_jobs)
+        {
+            if (job.succeeded)
+                job.on_compiled();
+        }
+    }
+}
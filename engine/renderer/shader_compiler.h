@@ -0,0 +1,22 @@
+﻿#pragma once
+
+#include <filesystem>
+#include <functional>
+
+#include "../../common/types.h"
+
+/* Compiles shaders for hot reloading on a worker thread, so the frame keeps rendering with the old pipeline meanwhile.
+    Built with VV_USE_SHADERC it compiles in process with shaderc, otherwise it runs glslc from the Vulkan SDK on the one shader.
+    Either way a .dependencies file is written next to the source, the same as compile_shaders.bat does.
+*/
+namespace ShaderCompiler
+{
+    void initialize();
+    // Waits for the shader being compiled, the ones still queued are dropped
+    void terminate();
+
+    // on_compiled only runs when the compile succeeded, from update on the main thread
+    void compile_async(const std::filesystem::path& source_path, const std::filesystem::path& output_path, const std::function<void()>& on_compiled);
+    // Runs the callbacks of the shaders that finished compiling since the last call
+    void update();
+}
@@ -1,6 +1,9 @@
 ﻿#include "device_resources.h"
 #include "renderer_core.h"
+#include <algorithm>
+#include <deque>
 #include <unordered_map>
+#include <vector>
 
 enum FunctionQueueLifetime
 {
@@ -10,9 +13,37 @@ enum FunctionQueueLifetime
 
 #include "../../common/function_queue.h"
 
+constexpr VkDeviceSize STAGING_ALIGNMENT { 16 };
+
+struct QueuedCopy
+{
+    VkBuffer source { VK_NULL_HANDLE };
+    VkBuffer destination { VK_NULL_HANDLE };
+    VkBufferCopy copy {};
+};
+
+// Part of the ring that is in use until the transfer that reads it signals timeline_value
+struct StagingRegion
+{
+    u64 end { 0 };
+    u64 timeline_value { 0 };
+};
+
 struct
 {
     std::unordered_map<std::string, DeviceResources::Buffer> buffers;
+
+    struct
+    {
+        DeviceResources::Buffer buffer {};
+        void* mapped_data { nullptr };
+        u64 head { 0 };
+        u64 tail { 0 };
+        std::deque<StagingRegion> in_flight;
+
+        std::vector<QueuedCopy> queued_copies;
+        std::vector<DeviceResources::Buffer> dedicated_buffers; // For uploads that don't fit in the ring, destroyed once they are copied
+    } staging_ring;
 } internal;
 
 DeviceResources::Buffer DeviceResources::create_buffer(const std::string& buffer_name, VkDeviceSize size)
@@ -26,7 +57,7 @@ DeviceResources::Buffer DeviceResources::create_buffer(const std::string& buffer
         {
             .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
             .size = size,
-            .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT,
+            .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
         };
 
         VmaAllocationCreateInfo vma_allocation_create_info
@@ -46,57 +77,233 @@ DeviceResources::Buffer DeviceResources::create_buffer(const std::string& buffer
     return existing_entry->second;
 }
 
+DeviceResources::Buffer DeviceResources::create_readback_buffer(const std::string& buffer_name, VkDeviceSize size)
+{
+    auto existing_entry = internal.buffers.find(buffer_name);
+    if (existing_entry == internal.buffers.end())
+    {
+        Buffer created_buffer {};
+
+        VkBufferCreateInfo buffer_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        };
+
+        VmaAllocationCreateInfo vma_allocation_create_info
+        {
+            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        };
+
+        VmaAllocationInfo allocation_info {};
+        vmaCreateBuffer(Renderer::Core::get_vma_allocator(), &buffer_create_info, &vma_allocation_create_info, &created_buffer.handle, &created_buffer.allocation, &allocation_info);
+
+        // Zeroed so reading a slice the GPU has not written yet gives nothing instead of garbage
+        memset(allocation_info.pMappedData, 0, size);
+        vmaFlushAllocation(Renderer::Core::get_vma_allocator(), created_buffer.allocation, 0, size);
+
+        created_buffer.size = size;
+        created_buffer.mapped_data = allocation_info.pMappedData;
+        internal.buffers[buffer_name] = created_buffer;
+        return created_buffer;
+    }
+    printf("Creating already existing buffer (%s)? Maybe you meant to resize it instead?", buffer_name.c_str());
+
+    return existing_entry->second;
+}
+
+void DeviceResources::invalidate_readback_buffer(const std::string& buffer_name, VkDeviceSize offset, VkDeviceSize size)
+{
+    vmaInvalidateAllocation(Renderer::Core::get_vma_allocator(), get_buffer(buffer_name).allocation, offset, size);
+}
+
 DeviceResources::Buffer DeviceResources::get_buffer(const std::string& buffer_name)
 {
     return internal.buffers.find(buffer_name)->second;
 }
 
-void DeviceResources::immediate_copy_data_to_gpu(const std::string& buffer_name, void* data, VkDeviceSize size_in_bytes)
+void DeviceResources::register_buffer(const std::string& buffer_name, const Buffer& buffer)
+{
+    if (internal.buffers.contains(buffer_name))
+    {
+        printf("Registering already existing buffer (%s)?", buffer_name.c_str());
+        return;
+    }
+
+    internal.buffers[buffer_name] = buffer;
+}
+
+void DeviceResources::unregister_buffer(const std::string& buffer_name)
+{
+    internal.buffers.erase(buffer_name);
+}
+
+/* Offsets in the ring only ever grow, the position in the buffer is the offset modulo the ring size.
+    That way a full ring and an empty ring can't be confused.
+*/
+void reclaim_staging_ring()
+{
+    auto& ring = internal.staging_ring;
+    while (!ring.in_flight.empty() && Renderer::Core::is_transfer_complete(ring.in_flight.front().timeline_value))
+    {
+        ring.tail = ring.in_flight.front().end;
+        ring.in_flight.pop_front();
+    }
+}
+
+DeviceResources::StagingAllocation allocate_dedicated_staging(VkDeviceSize size)
 {
-    Buffer staging_buffer {};
+    DeviceResources::Buffer staging_buffer {};
 
     VkBufferCreateInfo buffer_create_info
     {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .size = size_in_bytes,
-        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
     };
 
     VmaAllocationCreateInfo vma_allocation_create_info
     {
-        .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+        .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
         .usage = VMA_MEMORY_USAGE_AUTO,
     };
 
-    vmaCreateBuffer(Renderer::Core::get_vma_allocator(), &buffer_create_info, &vma_allocation_create_info, &staging_buffer.handle, &staging_buffer.allocation, nullptr);
+    VmaAllocationInfo allocation_info {};
+    vmaCreateBuffer(Renderer::Core::get_vma_allocator(), &buffer_create_info, &vma_allocation_create_info, &staging_buffer.handle, &staging_buffer.allocation, &allocation_info);
+
+    staging_buffer.size = size;
+    staging_buffer.mapped_data = allocation_info.pMappedData;
+    internal.staging_ring.dedicated_buffers.push_back(staging_buffer);
+
+    return { .mapped_data = staging_buffer.mapped_data, .size = size, .buffer = staging_buffer.handle, .offset = 0 };
+}
+
+DeviceResources::StagingAllocation DeviceResources::allocate_staging(VkDeviceSize size)
+{
+    auto& ring = internal.staging_ring;
+    VkDeviceSize aligned = (size + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+
+    if (aligned > DEVICE_RESOURCES_STAGING_RING_SIZE)
+        return allocate_dedicated_staging(size);
+
+    // Allocations never wrap around the end of the ring, the remainder is skipped instead
+    u64 head = ring.head;
+    u64 position = head % DEVICE_RESOURCES_STAGING_RING_SIZE;
+    if (position + aligned > DEVICE_RESOURCES_STAGING_RING_SIZE)
+        head += DEVICE_RESOURCES_STAGING_RING_SIZE - position;
+
+    reclaim_staging_ring();
+    if (head + aligned - ring.tail > DEVICE_RESOURCES_STAGING_RING_SIZE)
+    {
+        /* Out of space. Flushing from here could happen while a frame is recorded, which still uses the buffers the upload
+            would take from it, so the allocation gets a buffer of its own until the ring frees up again.
+        */
+        if (!ring.in_flight.empty() || !ring.queued_copies.empty())
+            return allocate_dedicated_staging(size);
 
-    staging_buffer.size = size_in_bytes;
+        // Nothing is in use anymore, so start over at the beginning of the ring rather than counting the skipped remainder
+        head = ((ring.head + DEVICE_RESOURCES_STAGING_RING_SIZE - 1) / DEVICE_RESOURCES_STAGING_RING_SIZE) * DEVICE_RESOURCES_STAGING_RING_SIZE;
+        ring.tail = head;
+    }
 
-    void* mapped_data;
+    ring.head = head + aligned;
+    position = head % DEVICE_RESOURCES_STAGING_RING_SIZE;
 
-    vmaMapMemory(Renderer::Core::get_vma_allocator(), staging_buffer.allocation, &mapped_data);
-    memcpy(mapped_data, data, size_in_bytes);
-    vmaUnmapMemory(Renderer::Core::get_vma_allocator(), staging_buffer.allocation);
+    return { .mapped_data = static_cast<u8*>(ring.mapped_data) + position, .size = size, .buffer = ring.buffer.handle, .offset = position };
+}
 
-    Renderer::Core::submit_immediate_command([=](VkCommandBuffer cmd) {
-        VkBufferCopy copy;
-        copy.dstOffset = 0;
-        copy.srcOffset = 0;
-        copy.size = size_in_bytes;
-        vkCmdCopyBuffer(cmd, staging_buffer.handle, DeviceResources::get_buffer(buffer_name).handle, 1, &copy);
+void DeviceResources::queue_copy_to_gpu(const StagingAllocation& source, const std::string& buffer_name, VkDeviceSize destination_offset)
+{
+    internal.staging_ring.queued_copies.push_back(
+    {
+        .source = source.buffer,
+        .destination = get_buffer(buffer_name).handle,
+        .copy = { .srcOffset = source.offset, .dstOffset = destination_offset, .size = source.size },
     });
+}
 
-    vmaDestroyBuffer(Renderer::Core::get_vma_allocator(), staging_buffer.handle, staging_buffer.allocation);
+void DeviceResources::copy_data_to_gpu(const std::string& buffer_name, const void* data, VkDeviceSize size_in_bytes)
+{
+    auto staging = allocate_staging(size_in_bytes);
+    memcpy(staging.mapped_data, data, size_in_bytes);
+    queue_copy_to_gpu(staging, buffer_name);
 }
 
+u64 DeviceResources::flush_staging_uploads()
+{
+    auto& ring = internal.staging_ring;
+    if (ring.queued_copies.empty())
+        return 0;
+
+    // The ring may not be host coherent, the dedicated buffers are flushed whole
+    vmaFlushAllocation(Renderer::Core::get_vma_allocator(), ring.buffer.allocation, 0, VK_WHOLE_SIZE);
+    for (auto& dedicated_buffer : ring.dedicated_buffers)
+        vmaFlushAllocation(Renderer::Core::get_vma_allocator(), dedicated_buffer.allocation, 0, VK_WHOLE_SIZE);
+
+    std::vector<VkBuffer> destination_buffers;
+    for (auto& queued_copy : ring.queued_copies)
+    {
+        if (std::find(destination_buffers.begin(), destination_buffers.end(), queued_copy.destination) == destination_buffers.end())
+            destination_buffers.push_back(queued_copy.destination);
+    }
+
+    auto queued_copies = std::move(ring.queued_copies);
+    auto dedicated_buffers = std::move(ring.dedicated_buffers);
+    ring.queued_copies.clear();
+    ring.dedicated_buffers.clear();
+
+    u64 timeline_value = Renderer::Core::submit_transfer_command([queued_copies](VkCommandBuffer cmd)
+    {
+        for (auto& queued_copy : queued_copies)
+            vkCmdCopyBuffer(cmd, queued_copy.source, queued_copy.destination, 1, &queued_copy.copy);
+    },
+    std::move(destination_buffers),
+    [dedicated_buffers]()
+    {
+        for (auto& dedicated_buffer : dedicated_buffers)
+            vmaDestroyBuffer(Renderer::Core::get_vma_allocator(), dedicated_buffer.handle, dedicated_buffer.allocation);
+    });
+
+    ring.in_flight.push_back({ .end = ring.head, .timeline_value = timeline_value });
+    return timeline_value;
+}
 
 void DeviceResources::initialize()
 {
+    auto& ring = internal.staging_ring;
 
+    VkBufferCreateInfo buffer_create_info
+    {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = DEVICE_RESOURCES_STAGING_RING_SIZE,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    };
+
+    VmaAllocationCreateInfo vma_allocation_create_info
+    {
+        .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_AUTO,
+    };
+
+    VmaAllocationInfo allocation_info {};
+    VK_CHECK(vmaCreateBuffer(Renderer::Core::get_vma_allocator(), &buffer_create_info, &vma_allocation_create_info, &ring.buffer.handle, &ring.buffer.allocation, &allocation_info));
+
+    ring.buffer.size = DEVICE_RESOURCES_STAGING_RING_SIZE;
+    ring.mapped_data = allocation_info.pMappedData;
+    VK_NAME(Renderer::Core::get_logical_device(), ring.buffer.handle, VK_OBJECT_TYPE_BUFFER, "staging_ring");
 }
 
 void DeviceResources::terminate()
 {
+    auto& ring = internal.staging_ring;
+    vmaDestroyBuffer(Renderer::Core::get_vma_allocator(), ring.buffer.handle, ring.buffer.allocation);
+
+    // Uploads that were queued but never flushed
+    for (auto& dedicated_buffer : ring.dedicated_buffers)
+        vmaDestroyBuffer(Renderer::Core::get_vma_allocator(), dedicated_buffer.handle, dedicated_buffer.allocation);
+
     for (auto& buffer : internal.buffers)
         vmaDestroyBuffer(Renderer::Core::get_vma_allocator(), buffer.second.handle, buffer.second.allocation);
 
@@ -59,15 +59,24 @@ namespace Renderer::Core
 
         VkSurfaceKHR surface { VK_NULL_HANDLE };
 
+        struct SwapchainImage
+        {
+            VkImage image { VK_NULL_HANDLE };
+            VkImageView view { VK_NULL_HANDLE };
+            // Per image rather than per frame, present may still be waiting on it after the frame slot comes back around
+            VkSemaphore render_semaphore { VK_NULL_HANDLE };
+        };
+
         u32 swapchain_image_count { 0 };
         VkSwapchainKHR swapchain { VK_NULL_HANDLE };
-        uint32_t last_swapchain_image_index { 0 };
         uint32_t current_swapchain_image_index { 0 };
-        VkSemaphore swapchain_semaphore { VK_NULL_HANDLE };
+        std::vector<SwapchainImage> swapchain_images;
 
         VkCommandPool command_pool { VK_NULL_HANDLE };
 
-        PerFrameData* per_frame_data { nullptr };
+        PerFrameData per_frame_data[RENDERER_MAX_FRAMES_IN_FLIGHT];
+        u32 frames_in_flight { RENDERER_DEFAULT_FRAMES_IN_FLIGHT };
+        u32 current_frame_slot { 0 };
 
         struct
         {
@@ -76,6 +85,36 @@ namespace Renderer::Core
             VkCommandBuffer command_buffer;
         } immediate_submit;
 
+        struct TransferSubmission
+        {
+            u64 timeline_value { 0 };
+            VkCommandBuffer command_buffer { VK_NULL_HANDLE };
+            VkCommandBuffer release_command_buffer { VK_NULL_HANDLE }; // Main queue half, done before command_buffer starts
+            std::function<void()> on_complete;
+        };
+
+        struct
+        {
+            VkQueue queue { VK_NULL_HANDLE };
+            u32 queue_family_index { 0 };
+            bool is_dedicated { false }; // Otherwise it is the main queue family and no ownership transfers are needed
+
+            VkCommandPool command_pool { VK_NULL_HANDLE };
+            VkSemaphore timeline_semaphore { VK_NULL_HANDLE };
+            u64 last_submitted_value { 0 };
+
+            // The main queue releasing the written buffers to the transfer queue, once the frames submitted before are done with them
+            VkCommandPool release_command_pool { VK_NULL_HANDLE };
+            VkSemaphore release_timeline_semaphore { VK_NULL_HANDLE };
+            u64 last_release_value { 0 };
+            std::deque<TransferSubmission> in_flight;
+
+            // Acquired by the next frame, which also waits on pending_wait_value
+            std::vector<VkBuffer> pending_acquires;
+            u64 pending_wait_value { 0 };
+            u64 frame_wait_value { 0 };
+        } transfer;
+
     } internal;
 
     const std::vector<const char*> validation_layers = {
@@ -220,22 +259,45 @@ namespace Renderer::Core
             .synchronization2 = VK_TRUE
         };
 
+        VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features
+        {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+            .timelineSemaphore = VK_TRUE
+        };
+
         dynamic_rendering_feature.pNext = &buffer_device_address_features;
         buffer_device_address_features.pNext = &descriptor_buffer_features;
         descriptor_buffer_features.pNext = &synchronization2_features;
+        synchronization2_features.pNext = &timeline_semaphore_features;
+
+        // Optional features are only turned on when the device supports them
+        VkPhysicalDeviceFeatures supported_features {};
+        vkGetPhysicalDeviceFeatures(internal.physical_device, &supported_features);
+
+        VkPhysicalDeviceFeatures& enabled_features = internal.physical_device_properties.enabled_features;
+        enabled_features = {};
+        enabled_features.shaderInt64 = supported_features.shaderInt64;
+        enabled_features.pipelineStatisticsQuery = supported_features.pipelineStatisticsQuery;
 
         VkDeviceCreateInfo device_create_info{};
         device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         device_create_info.pNext = &dynamic_rendering_feature;
+        device_create_info.pEnabledFeatures = &enabled_features;
 
         f32 queue_priority = 1.0f;
-        std::vector<VkDeviceQueueCreateInfo> queue_create_infos(1);
+        std::vector<VkDeviceQueueCreateInfo> queue_create_infos(internal.transfer.is_dedicated ? 2 : 1);
         queue_create_infos[0] = {};
         queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
         queue_create_infos[0].queueFamilyIndex = internal.queue_family_index;
         queue_create_infos[0].queueCount = 1;
         queue_create_infos[0].pQueuePriorities = &queue_priority;
 
+        if (internal.transfer.is_dedicated)
+        {
+            queue_create_infos[1] = queue_create_infos[0];
+            queue_create_infos[1].queueFamilyIndex = internal.transfer.queue_family_index;
+        }
+
         device_create_info.queueCreateInfoCount = queue_create_infos.size();
         device_create_info.pQueueCreateInfos = queue_create_infos.data();
 
@@ -245,6 +307,32 @@ namespace Renderer::Core
         VK_CHECK(vkCreateDevice(internal.physical_device, &device_create_info, nullptr, &internal.device));
         QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroyDevice(internal.device, nullptr))
         vkGetDeviceQueue(internal.device, internal.queue_family_index, 0, &internal.queue);
+        vkGetDeviceQueue(internal.device, internal.transfer.queue_family_index, 0, &internal.transfer.queue);
+    }
+
+    // Prefer a family that only does transfers, those map to the copy engines and run alongside compute work
+    void select_transfer_queue_family()
+    {
+        u32 queue_family_count { 0 };
+        vkGetPhysicalDeviceQueueFamilyProperties(internal.physical_device, &queue_family_count, nullptr);
+        std::vector<VkQueueFamilyProperties> queue_family_properties(queue_family_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(internal.physical_device, &queue_family_count, queue_family_properties.data());
+
+        internal.transfer.queue_family_index = internal.queue_family_index;
+        internal.transfer.is_dedicated = false;
+
+        for (u32 f = 0; f < queue_family_count; f++)
+        {
+            VkQueueFlags& flags = queue_family_properties[f].queueFlags;
+            if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) && !(flags & VK_QUEUE_COMPUTE_BIT))
+            {
+                internal.transfer.queue_family_index = f;
+                internal.transfer.is_dedicated = true;
+                break;
+            }
+        }
+
+        printf("Using %s transfer queue family %u\n", internal.transfer.is_dedicated ? "dedicated" : "shared", internal.transfer.queue_family_index);
     }
 
     void select_vulkan_physical_device()
@@ -390,10 +478,10 @@ namespace Renderer::Core
 
         for (i32 i = 0; i < internal.swapchain_image_count; i++)
         {
-            auto& per_frame_data = internal.per_frame_data[i];
-            swapchain_image_view_create_info.image = per_frame_data.swapchain_image;
-            VK_CHECK(vkCreateImageView(internal.device, &swapchain_image_view_create_info, nullptr, &per_frame_data.swapchain_image_view));
-            QUEUE_FUNCTION(FunctionQueueLifetime::SWAPCHAIN, vkDestroyImageView(internal.device, per_frame_data.swapchain_image_view, nullptr));
+            auto& swapchain_image = internal.swapchain_images[i];
+            swapchain_image_view_create_info.image = swapchain_image.image;
+            VK_CHECK(vkCreateImageView(internal.device, &swapchain_image_view_create_info, nullptr, &swapchain_image.view));
+            QUEUE_FUNCTION(FunctionQueueLifetime::SWAPCHAIN, vkDestroyImageView(internal.device, swapchain_image.view, nullptr));
         }
     }
 
@@ -422,9 +510,6 @@ namespace Renderer::Core
         if (surface_capabilities.maxImageCount > 0 && internal.swapchain_image_count > surface_capabilities.maxImageCount)
             internal.swapchain_image_count = surface_capabilities.maxImageCount;
 
-        if (internal.per_frame_data == nullptr)
-            internal.per_frame_data = new PerFrameData[internal.swapchain_image_count];
-
         u32 available_present_modes_count { 0 };
         VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(internal.physical_device, internal.surface, &available_present_modes_count, nullptr));
         std::vector<VkPresentModeKHR> available_present_modes(available_present_modes_count);
@@ -454,8 +539,9 @@ namespace Renderer::Core
         std::vector<VkImage> swapchain_images(internal.swapchain_image_count);
         VK_CHECK(vkGetSwapchainImagesKHR(internal.device, internal.swapchain, &internal.swapchain_image_count, swapchain_images.data()));
 
+        internal.swapchain_images.assign(internal.swapchain_image_count, {});
         for (i32 i = 0; i < internal.swapchain_image_count; i++)
-            internal.per_frame_data[i].swapchain_image = swapchain_images[i];
+            internal.swapchain_images[i].image = swapchain_images[i];
     }
 
     void create_command_pool()
@@ -477,17 +563,18 @@ namespace Renderer::Core
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
             .commandPool = internal .command_pool,
             .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = internal.swapchain_image_count,
+            .commandBufferCount = RENDERER_MAX_FRAMES_IN_FLIGHT,
         };
 
-        VkCommandBuffer command_buffers[internal.swapchain_image_count];
+        VkCommandBuffer command_buffers[RENDERER_MAX_FRAMES_IN_FLIGHT];
 
         VK_CHECK(vkAllocateCommandBuffers(internal.device, &command_buffer_allocate_info, command_buffers));
 
-        for (i32 i = 0; i < internal.swapchain_image_count; i++)
+        for (i32 i = 0; i < RENDERER_MAX_FRAMES_IN_FLIGHT; i++)
         {
             internal.per_frame_data[i].command_buffer = command_buffers[i];
-            QUEUE_FUNCTION(FunctionQueueLifetime::SWAPCHAIN, vkFreeCommandBuffers(internal.device, internal.command_pool, 1, &internal.per_frame_data[i].command_buffer))
+            internal.per_frame_data[i].frame_slot = i;
+            QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkFreeCommandBuffers(internal.device, internal.command_pool, 1, &internal.per_frame_data[i].command_buffer))
         }
     }
 
@@ -504,19 +591,31 @@ namespace Renderer::Core
             .flags = VK_FENCE_CREATE_SIGNALED_BIT,
         };
 
-        VK_CHECK(vkCreateSemaphore(internal.device, &semaphore_info, nullptr, &internal.swapchain_semaphore));
-        QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroySemaphore(internal.device, internal.swapchain_semaphore, nullptr))
-
-        for (i32 i = 0; i < internal.swapchain_image_count; i++)
+        for (i32 i = 0; i < RENDERER_MAX_FRAMES_IN_FLIGHT; i++)
         {
             auto& per_frame_data = internal.per_frame_data[i];
-            VK_CHECK(vkCreateSemaphore(internal.device, &semaphore_info, nullptr, &per_frame_data.render_semaphore));
+            VK_CHECK(vkCreateSemaphore(internal.device, &semaphore_info, nullptr, &per_frame_data.acquire_semaphore));
             VK_CHECK(vkCreateFence(internal.device, &fence_info, nullptr, &per_frame_data.render_fence));
-            QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroySemaphore(internal.device, per_frame_data.render_semaphore, nullptr))
+            QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroySemaphore(internal.device, per_frame_data.acquire_semaphore, nullptr))
             QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroyFence(internal.device, per_frame_data.render_fence, nullptr))
         }
     }
 
+    void create_swapchain_semaphores()
+    {
+        VkSemaphoreCreateInfo semaphore_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+
+        for (i32 i = 0; i < internal.swapchain_image_count; i++)
+        {
+            auto& swapchain_image = internal.swapchain_images[i];
+            VK_CHECK(vkCreateSemaphore(internal.device, &semaphore_info, nullptr, &swapchain_image.render_semaphore));
+            QUEUE_FUNCTION(FunctionQueueLifetime::SWAPCHAIN, vkDestroySemaphore(internal.device, swapchain_image.render_semaphore, nullptr))
+        }
+    }
+
     void resize_swapchain()
     {
         // Wait until the device is idle to safely destroy resources
@@ -528,7 +627,7 @@ namespace Renderer::Core
         // Recreate the swapchain
         create_swapchain();
         create_swapchain_image_views();
-        create_command_buffers();
+        create_swapchain_semaphores();
     }
 
     void create_immediate_submit_fence_command_buffer_and_pool()
@@ -561,6 +660,117 @@ namespace Renderer::Core
         QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroyFence(Renderer::Core::get_logical_device(), internal.immediate_submit.fence, nullptr));
     }
 
+    void create_transfer_command_pool_and_timeline()
+    {
+        VkCommandPoolCreateInfo command_pool_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = internal.transfer.queue_family_index,
+        };
+
+        VK_CHECK(vkCreateCommandPool(internal.device, &command_pool_create_info, nullptr, &internal.transfer.command_pool));
+        QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroyCommandPool(internal.device, internal.transfer.command_pool, nullptr));
+
+        VkSemaphoreTypeCreateInfo semaphore_type_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue = 0,
+        };
+
+        VkSemaphoreCreateInfo semaphore_create_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = &semaphore_type_create_info,
+        };
+
+        VK_CHECK(vkCreateSemaphore(internal.device, &semaphore_create_info, nullptr, &internal.transfer.timeline_semaphore));
+        QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroySemaphore(internal.device, internal.transfer.timeline_semaphore, nullptr));
+
+        if (!internal.transfer.is_dedicated)
+            return;
+
+        command_pool_create_info.queueFamilyIndex = internal.queue_family_index;
+        VK_CHECK(vkCreateCommandPool(internal.device, &command_pool_create_info, nullptr, &internal.transfer.release_command_pool));
+        QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroyCommandPool(internal.device, internal.transfer.release_command_pool, nullptr));
+
+        VK_CHECK(vkCreateSemaphore(internal.device, &semaphore_create_info, nullptr, &internal.transfer.release_timeline_semaphore));
+        QUEUE_FUNCTION(FunctionQueueLifetime::CORE, vkDestroySemaphore(internal.device, internal.transfer.release_timeline_semaphore, nullptr));
+    }
+
+    void process_completed_transfers()
+    {
+        if (internal.transfer.in_flight.empty())
+            return;
+
+        u64 completed_value { 0 };
+        VK_CHECK(vkGetSemaphoreCounterValue(internal.device, internal.transfer.timeline_semaphore, &completed_value));
+
+        while (!internal.transfer.in_flight.empty() && internal.transfer.in_flight.front().timeline_value <= completed_value)
+        {
+            auto& submission = internal.transfer.in_flight.front();
+            if (submission.on_complete)
+                submission.on_complete();
+
+            vkFreeCommandBuffers(internal.device, internal.transfer.command_pool, 1, &submission.command_buffer);
+            if (submission.release_command_buffer != VK_NULL_HANDLE)
+                vkFreeCommandBuffers(internal.device, internal.transfer.release_command_pool, 1, &submission.release_command_buffer);
+            internal.transfer.in_flight.pop_front();
+        }
+    }
+
+    // One barrier per buffer covering all of it, with equal queue families it is a plain memory barrier
+    void record_buffer_barriers(VkCommandBuffer command_buffer, const std::vector<VkBuffer>& buffers,
+        VkPipelineStageFlags2 src_stage_mask, VkAccessFlags2 src_access_mask, VkPipelineStageFlags2 dst_stage_mask, VkAccessFlags2 dst_access_mask,
+        u32 src_queue_family_index, u32 dst_queue_family_index)
+    {
+        bool ownership_transfer = src_queue_family_index != dst_queue_family_index;
+
+        std::vector<VkBufferMemoryBarrier2> barriers;
+        barriers.reserve(buffers.size());
+        for (VkBuffer buffer : buffers)
+        {
+            barriers.push_back(VkBufferMemoryBarrier2
+            {
+                .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                .srcStageMask = src_stage_mask,
+                .srcAccessMask = src_access_mask,
+                .dstStageMask = dst_stage_mask,
+                .dstAccessMask = dst_access_mask,
+                .srcQueueFamilyIndex = ownership_transfer ? src_queue_family_index : VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = ownership_transfer ? dst_queue_family_index : VK_QUEUE_FAMILY_IGNORED,
+                .buffer = buffer,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE,
+            });
+        }
+
+        VkDependencyInfo dependency_info
+        {
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .bufferMemoryBarrierCount = static_cast<u32>(barriers.size()),
+            .pBufferMemoryBarriers = barriers.data(),
+        };
+
+        vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+    }
+
+    void record_transfer_acquires(VkCommandBuffer command_buffer)
+    {
+        internal.transfer.frame_wait_value = internal.transfer.pending_wait_value;
+        internal.transfer.pending_wait_value = 0;
+
+        if (internal.transfer.pending_acquires.empty())
+            return;
+
+        record_buffer_barriers(command_buffer, internal.transfer.pending_acquires,
+            VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            internal.transfer.queue_family_index, internal.queue_family_index);
+        internal.transfer.pending_acquires.clear();
+    }
+
     AllocatedImage create_image(VkExtent2D extent, VkFormat format, VkImageUsageFlags usage_flags, VkImageAspectFlags aspect_flags, const std::string& name)
     {
         AllocatedImage new_image {};
@@ -625,6 +835,7 @@ namespace Renderer::Core
         create_sdl_surface();
 
         select_vulkan_physical_device();
+        select_transfer_queue_family();
         create_vulkan_device();
         volkLoadDevice(internal.device);
 
@@ -632,11 +843,13 @@ namespace Renderer::Core
 
         create_swapchain();
         create_swapchain_image_views();
+        create_swapchain_semaphores();
 
         create_command_pool();
         create_command_buffers();
         create_sync_objects();
         create_immediate_submit_fence_command_buffer_and_pool();
+        create_transfer_command_pool_and_timeline();
         initalize_imgui();
         ProfilingQueries::initialize(internal.physical_device, internal.device);
         QUEUE_FUNCTION(FunctionQueueLifetime::CORE, ProfilingQueries::terminate(internal.device));
@@ -647,6 +860,7 @@ namespace Renderer::Core
     void terminate()
     {
         vkDeviceWaitIdle(internal.device);
+        process_completed_transfers();
 
         QUEUE_FLUSH(FunctionQueueLifetime::SWAPCHAIN);
         QUEUE_FLUSH(FunctionQueueLifetime::CORE);
@@ -690,16 +904,199 @@ namespace Renderer::Core
         vkResetCommandPool(internal.device, internal.immediate_submit.command_pool, 0);
     }
 
+    VkCommandBuffer begin_transient_command_buffer(VkCommandPool command_pool)
+    {
+        VkCommandBufferAllocateInfo command_buffer_allocate_info
+        {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = command_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+
+        VkCommandBuffer cmd { VK_NULL_HANDLE };
+        VK_CHECK(vkAllocateCommandBuffers(internal.device, &command_buffer_allocate_info, &cmd));
+
+        VkCommandBufferBeginInfo info
+        {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+
+        VK_CHECK(vkBeginCommandBuffer(cmd, &info));
+        return cmd;
+    }
+
+    /* Release half of handing the buffers from the main queue to the transfer queue. It is submitted after every frame so far,
+        so the signaled value also means none of those frames reads or writes the buffers anymore.
+    */
+    VkCommandBuffer submit_transfer_release(const std::vector<VkBuffer>& buffers, u64 release_value)
+    {
+        VkCommandBuffer cmd = begin_transient_command_buffer(internal.transfer.release_command_pool);
+
+        record_buffer_barriers(cmd, buffers,
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+            internal.queue_family_index, internal.transfer.queue_family_index);
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+
+        VkCommandBufferSubmitInfo command_buffer_submit_info
+        {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = cmd,
+        };
+
+        VkSemaphoreSubmitInfo signal_semaphore_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = internal.transfer.release_timeline_semaphore,
+            .value = release_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        };
+
+        VkSubmitInfo2 submit_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = &command_buffer_submit_info,
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = &signal_semaphore_info,
+        };
+
+        VK_CHECK(vkQueueSubmit2(internal.queue, 1, &submit_info, VK_NULL_HANDLE));
+        return cmd;
+    }
+
+    u64 submit_transfer_command(std::function<void(VkCommandBuffer cmd)>&& function, std::vector<VkBuffer>&& written_buffers, std::function<void()>&& on_complete)
+    {
+        // The frames in flight can still be using the buffers, their old contents may be read or partly overwritten
+        VkCommandBuffer release_cmd { VK_NULL_HANDLE };
+        u64 release_value { 0 };
+        if (internal.transfer.is_dedicated && !written_buffers.empty())
+        {
+            release_value = ++internal.transfer.last_release_value;
+            release_cmd = submit_transfer_release(written_buffers, release_value);
+        }
+
+        VkCommandBuffer cmd = begin_transient_command_buffer(internal.transfer.command_pool);
+
+        if (release_cmd != VK_NULL_HANDLE)
+        {
+            // Acquire half, the wait on the release below already covers the frames' accesses
+            record_buffer_barriers(cmd, written_buffers,
+                VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                internal.queue_family_index, internal.transfer.queue_family_index);
+        }
+        else if (!written_buffers.empty())
+        {
+            // Same queue as the frames, so the barrier orders the copies after everything they submitted
+            record_buffer_barriers(cmd, written_buffers,
+                VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+        }
+
+        function(cmd);
+
+        // Release half of handing them back, the acquire half is recorded by the next frame
+        if (release_cmd != VK_NULL_HANDLE)
+        {
+            record_buffer_barriers(cmd, written_buffers,
+                VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                internal.transfer.queue_family_index, internal.queue_family_index);
+
+            internal.transfer.pending_acquires.insert(internal.transfer.pending_acquires.end(), written_buffers.begin(), written_buffers.end());
+        }
+
+        VK_CHECK(vkEndCommandBuffer(cmd));
+
+        u64 timeline_value = ++internal.transfer.last_submitted_value;
+
+        VkCommandBufferSubmitInfo command_buffer_submit_info
+        {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = cmd,
+        };
+
+        VkSemaphoreSubmitInfo wait_semaphore_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = internal.transfer.release_timeline_semaphore,
+            .value = release_value,
+            .stageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        };
+
+        VkSemaphoreSubmitInfo signal_semaphore_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = internal.transfer.timeline_semaphore,
+            .value = timeline_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        };
+
+        VkSubmitInfo2 submit_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+            .waitSemaphoreInfoCount = release_value > 0 ? 1u : 0u,
+            .pWaitSemaphoreInfos = &wait_semaphore_info,
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = &command_buffer_submit_info,
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = &signal_semaphore_info,
+        };
+
+        VK_CHECK(vkQueueSubmit2(internal.transfer.queue, 1, &submit_info, VK_NULL_HANDLE));
+
+        internal.transfer.pending_wait_value = timeline_value;
+        internal.transfer.in_flight.push_back({ timeline_value, cmd, release_cmd, std::move(on_complete) });
+
+        return timeline_value;
+    }
+
+    bool is_transfer_complete(u64 timeline_value)
+    {
+        u64 completed_value { 0 };
+        VK_CHECK(vkGetSemaphoreCounterValue(internal.device, internal.transfer.timeline_semaphore, &completed_value));
+        return completed_value >= timeline_value;
+    }
+
+    void wait_for_transfer(u64 timeline_value)
+    {
+        VkSemaphoreWaitInfo wait_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores = &internal.transfer.timeline_semaphore,
+            .pValues = &timeline_value,
+        };
+
+        VK_CHECK(vkWaitSemaphores(internal.device, &wait_info, UINT64_MAX));
+    }
+
     const PerFrameData& begin_frame()
     {
-        internal.last_swapchain_image_index = internal.current_swapchain_image_index;
-        auto& last_per_frame_data = internal.per_frame_data[internal.last_swapchain_image_index];
+        auto& per_frame_data = internal.per_frame_data[internal.current_frame_slot];
+
+        // Only waits for the frame that last used this slot, the frames after it can still be in flight
+        VK_CHECK(vkWaitForFences(internal.device, 1, &per_frame_data.render_fence, VK_TRUE, UINT64_MAX));
 
-        VkResult acquire_image_result = vkAcquireNextImageKHR(internal.device, internal.swapchain, UINT64_MAX, internal.swapchain_semaphore, nullptr, &internal.current_swapchain_image_index);
-        auto& per_frame_data = internal.per_frame_data[internal.current_swapchain_image_index];
+        VkResult acquire_image_result = vkAcquireNextImageKHR(internal.device, internal.swapchain, UINT64_MAX, per_frame_data.acquire_semaphore, nullptr, &internal.current_swapchain_image_index);
 
         if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR)
+        {
             resize_swapchain();
+            VK_CHECK(vkAcquireNextImageKHR(internal.device, internal.swapchain, UINT64_MAX, per_frame_data.acquire_semaphore, nullptr, &internal.current_swapchain_image_index));
+        }
+
+        // Reset after acquiring, so a failed acquire does not leave the fence unsignaled forever
+        VK_CHECK(vkResetFences(internal.device, 1, &per_frame_data.render_fence));
+
+        auto& swapchain_image = internal.swapchain_images[internal.current_swapchain_image_index];
+        per_frame_data.swapchain_image = swapchain_image.image;
+        per_frame_data.swapchain_image_view = swapchain_image.view;
 
         VkCommandBufferBeginInfo command_buffer_begin_info
         {
@@ -707,7 +1104,12 @@ namespace Renderer::Core
             .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
         };
 
+        // Everything uploaded since the last frame goes out in one submit, this frame then waits on it
+        DeviceResources::flush_staging_uploads();
+        process_completed_transfers();
+
         VK_CHECK(vkBeginCommandBuffer(per_frame_data.command_buffer, &command_buffer_begin_info));
+        record_transfer_acquires(per_frame_data.command_buffer);
         ProfilingQueries::reset_device_profiling_queries(per_frame_data.command_buffer);
 
         ImGui_ImplVulkan_NewFrame();
@@ -719,7 +1121,8 @@ namespace Renderer::Core
 
     void end_frame()
     {
-        auto& per_frame_data = internal.per_frame_data[internal.current_swapchain_image_index];
+        auto& per_frame_data = internal.per_frame_data[internal.current_frame_slot];
+        auto& swapchain_image = internal.swapchain_images[internal.current_swapchain_image_index];
 
         ImGui::Render();
 
@@ -745,30 +1148,78 @@ namespace Renderer::Core
         ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), per_frame_data.command_buffer);
         vkCmdEndRendering(per_frame_data.command_buffer);
 
+        // The renderer leaves the swapchain image as a color attachment for ImGui
+        VkImageMemoryBarrier2 present_barrier
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT,
+            .dstAccessMask = VK_ACCESS_2_NONE,
+            .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = per_frame_data.swapchain_image,
+            .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+        };
+
+        VkDependencyInfo present_dependency_info
+        {
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .imageMemoryBarrierCount = 1,
+            .pImageMemoryBarriers = &present_barrier
+        };
+        vkCmdPipelineBarrier2(per_frame_data.command_buffer, &present_dependency_info);
+
         VK_CHECK(vkEndCommandBuffer(per_frame_data.command_buffer));
-        VK_CHECK(vkResetFences(internal.device, 1, &per_frame_data.render_fence));
 
-        VkPipelineStageFlags stage_flags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        VkSubmitInfo submit_info =
+        VkSemaphoreSubmitInfo wait_semaphore_infos[2]
         {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &internal.swapchain_semaphore,
-            .pWaitDstStageMask = &stage_flags,
-            .commandBufferCount = 1,
-            .pCommandBuffers = &per_frame_data.command_buffer,
-            .signalSemaphoreCount = 1,
-            .pSignalSemaphores = &per_frame_data.render_semaphore,
+            {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = per_frame_data.acquire_semaphore,
+                .stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+            },
+            {
+                // Uploads submitted before this frame started have to land before any of its work reads them
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = internal.transfer.timeline_semaphore,
+                .value = internal.transfer.frame_wait_value,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            },
         };
 
-        VK_CHECK(vkQueueSubmit(internal.queue, 1, &submit_info, per_frame_data.render_fence));
+        VkCommandBufferSubmitInfo command_buffer_submit_info
+        {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = per_frame_data.command_buffer,
+        };
 
-        VK_CHECK(vkWaitForFences(internal.device,1, &per_frame_data.render_fence, VK_TRUE, UINT64_MAX));
+        VkSemaphoreSubmitInfo signal_semaphore_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = swapchain_image.render_semaphore,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        };
+
+        VkSubmitInfo2 submit_info
+        {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+            .waitSemaphoreInfoCount = internal.transfer.frame_wait_value > 0 ? 2u : 1u,
+            .pWaitSemaphoreInfos = wait_semaphore_infos,
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = &command_buffer_submit_info,
+            .signalSemaphoreInfoCount = 1,
+            .pSignalSemaphoreInfos = &signal_semaphore_info,
+        };
+
+        VK_CHECK(vkQueueSubmit2(internal.queue, 1, &submit_info, per_frame_data.render_fence));
 
         VkPresentInfoKHR present_info = {
             .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
             .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &per_frame_data.render_semaphore,
+            .pWaitSemaphores = &swapchain_image.render_semaphore,
             .swapchainCount = 1,
             .pSwapchains = &internal.swapchain,
             .pImageIndices = &internal.current_swapchain_image_index,
@@ -778,6 +1229,8 @@ namespace Renderer::Core
 
         if (present_result == VK_ERROR_OUT_OF_DATE_KHR)
             resize_swapchain();
+
+        internal.current_frame_slot = (internal.current_frame_slot + 1) % internal.frames_in_flight;
         ProfilingQueries::end_frame();
     }
 
@@ -803,6 +1256,23 @@ namespace Renderer::Core
 
     const PerFrameData& get_current_frame_data()
     {
-        return internal.per_frame_data[internal.current_swapchain_image_index];
+        return internal.per_frame_data[internal.current_frame_slot];
+    }
+
+    void set_frames_in_flight(u32 frame_count)
+    {
+        frame_count = std::clamp(frame_count, 1u, static_cast<u32>(RENDERER_MAX_FRAMES_IN_FLIGHT));
+        if (frame_count == internal.frames_in_flight)
+            return;
+
+        // Every fence is signaled once the device is idle, so any slot can be started from
+        vkDeviceWaitIdle(internal.device);
+        internal.frames_in_flight = frame_count;
+        internal.current_frame_slot = 0;
+    }
+
+    u32 get_frames_in_flight()
+    {
+        return internal.frames_in_flight;
     }
 }
@@ -62,6 +62,7 @@ int main( int argc, char* args[] )
         }
 
         Renderer::terminate();
+        IO::terminate();
     }
     else
     {
@@ -1,16 +1,21 @@
 
-struct Ray // 32 Bytes
+struct Ray
 {
     vec3 position;
     vec3 direction;
 };
 
-struct IntersectResult // 32 Bytes
+// Closest hit of a ray in registers, between passes only a packed 8 Byte hit record is stored
+struct IntersectResult
 {
-    vec4 incoming_direction_and_hit_distance;
-    vec4 normal; // last element of vec4 stores debug gpu time
+    float hit_distance; // FLT_MAX on a miss
+    uint face_and_instance; // Face the ray entered through in the low bits, index of the model instance above
+    float debug_value; // Of the current view mode
 };
 
+#define HIT_FACE_MASK 7u // Axis in the low 2 bits, set bit 2 when the ray stepped in the negative direction
+#define HIT_INSTANCE_SHIFT 3u
+
 vec3 get_translation_from_matrix(mat4 matrix)
 {
     return matrix[3].xyz;
@@ -19,6 +24,82 @@ vec3 get_translation_from_matrix(mat4 matrix)
 #define FLT_MAX (1.0 / 0.0)
 #define EPSILON 0.001f
 
+vec3 get_hit_normal(IntersectResult result)
+{
+    uint face = result.face_and_instance & HIT_FACE_MASK;
+    vec3 normal = vec3(0.0f);
+    normal[face & 3u] = face < 3u ? -1.0f : 1.0f;
+    return normal;
+}
+
+uint get_hit_instance(IntersectResult result)
+{
+    return result.face_and_instance >> HIT_INSTANCE_SHIFT;
+}
+
+// Octahedral mapping of unit directions, two floats instead of a vec3 that std430 pads to 16 Bytes
+vec2 encode_octahedral(vec3 direction)
+{
+    direction /= abs(direction.x) + abs(direction.y) + abs(direction.z);
+    vec2 encoded = direction.xy;
+    if (direction.z < 0.0f)
+        encoded = (vec2(1.0f) - abs(direction.yx)) * vec2(direction.x >= 0.0f ? 1.0f : -1.0f, direction.y >= 0.0f ? 1.0f : -1.0f);
+    return encoded;
+}
+
+vec3 decode_octahedral(vec2 encoded)
+{
+    vec3 direction = vec3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+    float fold = max(-direction.z, 0.0f);
+    direction.x += direction.x >= 0.0f ? -fold : fold;
+    direction.y += direction.y >= 0.0f ? -fold : fold;
+    return normalize(direction);
+}
+
+// Primary rays start at the camera, so only their direction is stored
+uvec2 pack_primary_ray(Ray ray)
+{
+    return floatBitsToUint(encode_octahedral(ray.direction));
+}
+
+Ray unpack_primary_ray(uvec2 packed_ray, vec3 camera_position)
+{
+    Ray ray;
+    ray.position = camera_position;
+    ray.direction = decode_octahedral(uintBitsToFloat(packed_ray));
+    return ray;
+}
+
+// The debug value is stored apart from the hit, it is only written and read in view modes that have one
+uvec2 pack_hit(IntersectResult result)
+{
+    return uvec2(floatBitsToUint(result.hit_distance), result.face_and_instance);
+}
+
+IntersectResult unpack_hit(uvec2 packed_hit, float debug_value)
+{
+    IntersectResult result;
+    result.hit_distance = uintBitsToFloat(packed_hit.x);
+    result.face_and_instance = packed_hit.y;
+    result.debug_value = debug_value;
+    return result;
+}
+
+// Bits of push_constants.debug_flags, mirrored in renderer.cpp
+#define DEBUG_FLAG_TRAVERSAL_COUNTERS 1u
+#define DEBUG_FLAG_LINEAR_PIXEL_ORDER 2u // Row major instead of Morton ordered tiles, to compare against
+#define DEBUG_FLAG_SOA_LAYOUT 4u // Ray and hit records as separate planes per word instead of interleaved
+#define DEBUG_FLAG_BEAM_START 8u // Primary rays start at the distance rt_beam.comp found for their tile
+#define DEBUG_FLAG_CLOSEST_HIT_SHADOWS 16u // Shadow rays look for the closest hit instead of any, to compare against
+
+// Values of push_constants.view_mode, mirrored in renderer.cpp
+#define VIEW_MODE_SHADED 0u
+#define VIEW_MODE_NORMALS 1u
+#define VIEW_MODE_DEPTH 2u
+#define VIEW_MODE_CLOCK_COST 3u
+#define VIEW_MODE_BRICK_STEPS 4u
+#define VIEW_MODE_INSTANCE_TESTS 5u
+
 #extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
 #extension GL_ARB_shader_clock : require
 
@@ -0,0 +1,28 @@
+/* Model headers and voxel data, include after common.glsl.
+	The includer picks the binding by defining MODEL_BINDING, traversal.glsl defines it as TRAVERSAL_MODEL_BINDING.
+*/
+
+#define MODEL_INSTANCE_CAPACITY 64
+
+struct ModelHeader
+{
+	ivec4 size_in_bricks;
+	ivec4 brick_index_and_size_in_voxels;
+	mat4 inverse_transform;
+};
+
+layout(set = 0, binding = MODEL_BINDING) buffer ModelIn
+{
+	ModelHeader headers[MODEL_INSTANCE_CAPACITY];
+	uint64_t data[];
+} model_buffer;
+
+// get_hit_normal is in the voxel space of the hit instance, the inverse transpose of the instance matrix takes it to world space
+vec3 get_hit_world_normal(IntersectResult result)
+{
+	if (result.hit_distance == FLT_MAX)
+		return vec3(0.0f);
+
+	mat3 normal_matrix = transpose(mat3(model_buffer.headers[get_hit_instance(result)].inverse_transform));
+	return normalize(normal_matrix * get_hit_normal(result));
+}
@@ -0,0 +1,171 @@
+/* Ray queues of the wavefront path tracer, include after common.glsl and shade.glsl.
+	Each queue is only declared when the includer defines its binding.
+*/
+
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_ballot : require
+
+#define PATH_GROUP_SIZE 64 // Matches PATH_GROUP_SIZE in renderer.cpp
+#define PATH_RAY_OFFSET 0.01f // Along the normal, so secondary rays don't start inside the voxel they left
+#define PATH_MIN_THROUGHPUT 0.01f // Paths carrying less than this are terminated instead of extended
+
+struct QueuedRay // 32 Bytes
+{
+	vec4 position_and_pixel; // Bits of the packed pixel coordinates in w
+	vec4 direction_and_weight; // Throughput of extension rays or contribution of shadow rays in w, packed as unorm rgb
+};
+
+struct DispatchIndirectCommand
+{
+	uint x;
+	uint y;
+	uint z;
+};
+
+#ifdef PATH_QUEUE_STATE_BINDING
+// Mirrored in renderer.cpp
+layout(std430, set = 0, binding = PATH_QUEUE_STATE_BINDING) buffer PathQueueState
+{
+	uint extension_counts[2]; // Extension rays ping-pong between two halves of the queue, by bounce parity
+	uint shadow_count;
+	uint active_extension_count; // What the current bounce was dispatched over, appending doesn't change these
+	uint active_shadow_count;
+	DispatchIndirectCommand extension_dispatch;
+	DispatchIndirectCommand shadow_dispatch;
+	uint traced_extension_count; // Summed over the bounces of the frame, read back for the ray rates
+	uint traced_shadow_count;
+} queue_state;
+#endif
+
+#ifdef PATH_EXTENSION_QUEUE_BINDING
+layout(std430, set = 0, binding = PATH_EXTENSION_QUEUE_BINDING) buffer PathExtensionQueue
+{
+	QueuedRay extension_rays[]; // Two halves of queue_capacity
+};
+#endif
+
+#ifdef PATH_SHADOW_QUEUE_BINDING
+layout(std430, set = 0, binding = PATH_SHADOW_QUEUE_BINDING) buffer PathShadowQueue
+{
+	QueuedRay shadow_rays[];
+};
+#endif
+
+QueuedRay make_queued_ray(vec3 position, uint pixel, vec3 direction, vec3 weight)
+{
+	QueuedRay queued_ray;
+	queued_ray.position_and_pixel = vec4(position, uintBitsToFloat(pixel));
+	queued_ray.direction_and_weight = vec4(direction, uintBitsToFloat(packUnorm4x8(vec4(weight, 0.0f))));
+	return queued_ray;
+}
+
+Ray get_queued_ray(QueuedRay queued_ray)
+{
+	Ray ray;
+	ray.position = queued_ray.position_and_pixel.xyz;
+	ray.direction = queued_ray.direction_and_weight.xyz;
+	return ray;
+}
+
+uint get_queued_ray_pixel(QueuedRay queued_ray)
+{
+	return floatBitsToUint(queued_ray.position_and_pixel.w);
+}
+
+vec3 get_queued_ray_weight(QueuedRay queued_ray)
+{
+	return unpackUnorm4x8(floatBitsToUint(queued_ray.direction_and_weight.w)).rgb;
+}
+
+// Per pixel buffers are in tile order, so queued rays carry the coordinates instead of a row major index
+uint pack_pixel_coordinates(ivec2 pixel)
+{
+	return uint(pixel.x) | (uint(pixel.y) << 16u);
+}
+
+ivec2 unpack_pixel_coordinates(uint pixel)
+{
+	return ivec2(pixel & 0xffffu, pixel >> 16u);
+}
+
+uint pcg_hash(uint value)
+{
+	uint state = value * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+uint get_path_seed(uint pixel, uint bounce_index, uint frame_index)
+{
+	return pcg_hash(pixel ^ pcg_hash(bounce_index + pcg_hash(frame_index)));
+}
+
+float random_float(inout uint seed)
+{
+	seed = pcg_hash(seed);
+	return float(seed >> 8u) * (1.0f / 16777216.0f);
+}
+
+// Cosine weighted, so the pdf cancels the Lambert BRDF and the throughput is only multiplied by the albedo
+vec3 sample_cosine_hemisphere(vec3 normal, inout uint seed)
+{
+	float radius = sqrt(random_float(seed));
+	float angle = 6.28318530718f * random_float(seed);
+
+	// Orthonormal basis from "Building an Orthonormal Basis, Revisited" (Duff et al. 2017)
+	float s = normal.z >= 0.0f ? 1.0f : -1.0f;
+	float a = -1.0f / (s + normal.z);
+	float b = normal.x * normal.y * a;
+	vec3 tangent = vec3(1.0f + s * normal.x * normal.x * a, s * b, -s * normal.x);
+	vec3 bitangent = vec3(b, s + normal.y * normal.y * a, -normal.y);
+
+	vec2 disk = radius * vec2(cos(angle), sin(angle));
+	return normalize(tangent * disk.x + bitangent * disk.y + normal * sqrt(max(0.0f, 1.0f - radius * radius)));
+}
+
+#if defined(PATH_QUEUE_STATE_BINDING) && defined(PATH_EXTENSION_QUEUE_BINDING) && defined(PATH_SHADOW_QUEUE_BINDING)
+/* Stream compaction, the appending invocations of a subgroup get consecutive slots for a single atomic.
+	Has to be called by every active invocation, not only the ones appending.
+*/
+uint append_shadow_ray(bool append)
+{
+	uvec4 ballot = subgroupBallot(append);
+	uint append_count = subgroupBallotBitCount(ballot);
+
+	uint base = 0u;
+	if (subgroupElect() && append_count > 0u)
+		base = atomicAdd(queue_state.shadow_count, append_count);
+
+	return subgroupBroadcastFirst(base) + subgroupBallotExclusiveBitCount(ballot);
+}
+
+uint append_extension_ray(bool append, uint queue_half)
+{
+	uvec4 ballot = subgroupBallot(append);
+	uint append_count = subgroupBallotBitCount(ballot);
+
+	uint base = 0u;
+	if (subgroupElect() && append_count > 0u)
+		base = atomicAdd(queue_state.extension_counts[queue_half], append_count);
+
+	return subgroupBroadcastFirst(base) + subgroupBallotExclusiveBitCount(ballot);
+}
+
+// Queues the sun shadow ray and the next bounce of a path, terminated paths append nothing
+void continue_path(bool hit, vec3 position, vec3 normal, uint pixel, vec3 throughput, bool extend, uint queue_half, uint queue_capacity, inout uint seed)
+{
+	vec3 ray_position = position + normal * PATH_RAY_OFFSET;
+
+	float sun_cosine = dot(normal, SUN_DIRECTION);
+	bool emit_shadow_ray = hit && sun_cosine > 0.0f;
+	uint shadow_index = append_shadow_ray(emit_shadow_ray);
+	if (emit_shadow_ray)
+		shadow_rays[shadow_index] = make_queued_ray(ray_position, pixel, SUN_DIRECTION, throughput * ALBEDO * sun_cosine);
+
+	vec3 next_throughput = throughput * ALBEDO;
+	bool emit_extension_ray = hit && extend && max(next_throughput.r, max(next_throughput.g, next_throughput.b)) > PATH_MIN_THROUGHPUT;
+	uint extension_index = append_extension_ray(emit_extension_ray, queue_half);
+	if (emit_extension_ray)
+		extension_rays[queue_half * queue_capacity + extension_index] = make_queued_ray(ray_position, pixel, sample_cosine_hemisphere(normal, seed), next_throughput);
+}
+#endif
@@ -0,0 +1,77 @@
+/* Thread to pixel mapping shared by every per pixel kernel, include after common.glsl.
+	Kernels run one 1D workgroup per 8x8 tile of the image and walk the tile in Morton order,
+	so neighbouring invocations trace neighbouring rays and fetch the same voxel_data bricks.
+	Per pixel buffers are indexed by the invocation, which keeps them in the same tiled order.
+
+	Rays and hits are stored as two word records, interleaved by default or as one plane
+	per word when DEBUG_FLAG_SOA_LAYOUT is set.
+*/
+
+#define PIXEL_TILE_SIZE 8
+#define PIXEL_TILE_PIXELS 64 // Also the workgroup size, mirrored in renderer.cpp
+
+// Gathers the even bits of a 6 bit Morton code
+uint compact_morton_bits(uint code)
+{
+	return (code & 1u) | ((code >> 1u) & 2u) | ((code >> 2u) & 4u);
+}
+
+uvec2 decode_tile_morton(uint tile_index)
+{
+	return uvec2(compact_morton_bits(tile_index), compact_morton_bits(tile_index >> 1u));
+}
+
+// Spreads 3 bits out to the even bits of a Morton code
+uint spread_morton_bits(uint value)
+{
+	return (value & 1u) | ((value & 2u) << 1u) | ((value & 4u) << 2u);
+}
+
+uint encode_tile_morton(uvec2 local_position)
+{
+	return spread_morton_bits(local_position.x) | (spread_morton_bits(local_position.y) << 1u);
+}
+
+// False for invocations outside the image, edge tiles overhang it and linear order rounds up to whole workgroups
+bool get_invocation_pixel(uint invocation_index, ivec2 render_extent, uint debug_flags, out ivec2 pixel)
+{
+	if ((debug_flags & DEBUG_FLAG_LINEAR_PIXEL_ORDER) != 0u)
+	{
+		pixel = ivec2(int(invocation_index) % render_extent.x, int(invocation_index) / render_extent.x);
+	}
+	else
+	{
+		int tile_columns = (render_extent.x + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE;
+		int tile = int(invocation_index / PIXEL_TILE_PIXELS);
+		pixel = ivec2(tile % tile_columns, tile / tile_columns) * PIXEL_TILE_SIZE + ivec2(decode_tile_morton(invocation_index % PIXEL_TILE_PIXELS));
+	}
+
+	return pixel.x < render_extent.x && pixel.y < render_extent.y;
+}
+
+// Inverse of get_invocation_pixel, for reading the records of other pixels
+uint get_pixel_invocation_index(ivec2 pixel, ivec2 render_extent, uint debug_flags)
+{
+	if ((debug_flags & DEBUG_FLAG_LINEAR_PIXEL_ORDER) != 0u)
+		return uint(pixel.y * render_extent.x + pixel.x);
+
+	int tile_columns = (render_extent.x + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE;
+	ivec2 tile = pixel / PIXEL_TILE_SIZE;
+	return uint(tile.y * tile_columns + tile.x) * PIXEL_TILE_PIXELS + encode_tile_morton(uvec2(pixel % PIXEL_TILE_SIZE));
+}
+
+// Records in a per pixel buffer, the image rounded up to whole tiles
+uint get_pixel_record_capacity(ivec2 render_extent)
+{
+	ivec2 tiles = (render_extent + ivec2(PIXEL_TILE_SIZE - 1)) / PIXEL_TILE_SIZE;
+	return uint(tiles.x * tiles.y) * PIXEL_TILE_PIXELS;
+}
+
+// Indices of both words of a record in a per pixel buffer of uints
+uvec2 get_pixel_record_words(uint index, ivec2 render_extent, uint debug_flags)
+{
+	if ((debug_flags & DEBUG_FLAG_SOA_LAYOUT) != 0u)
+		return uvec2(index, index + get_pixel_record_capacity(render_extent));
+
+	return uvec2(index * 2u, index * 2u + 1u);
+}
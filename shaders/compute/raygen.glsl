@@ -0,0 +1,39 @@
+// Primary ray generation shared by rt_raygen.comp, rt_primary.comp and rt_beam.comp, include after common.glsl
+
+#define PINHOLE_FOV 90.0f
+
+// Through any point of the image, (0, 0) is the top left corner of the first pixel
+vec3 generate_pinhole_ray_direction_through(vec2 image_position, ivec2 image_size, mat4 matrix)
+{
+	float tan_half_angle = tan(radians(PINHOLE_FOV) / 2.0f);
+	float aspect_scale = image_size.y / 2.0f;
+  
+	vec2 pixel = image_position - (image_size / 2.0f);
+  
+	vec3 direction = normalize(vec3(vec2(pixel.x, -pixel.y) * tan_half_angle / aspect_scale, -1));
+  
+	return (matrix * vec4(direction, 0.0f)).xyz;
+}
+
+vec3 generate_pinhole_ray_direction(uvec2 pixel_position, ivec2 image_size, mat4 matrix)
+{
+	return generate_pinhole_ray_direction_through(vec2(pixel_position) + vec2(0.5f), image_size, matrix);
+}
+
+// Inverse of generate_pinhole_ray_direction, pixel p covers [p, p + 1) of the result. Only for points in front of the camera
+vec2 project_pinhole(vec3 view_position, ivec2 image_size)
+{
+	float tan_half_angle = tan(radians(PINHOLE_FOV) / 2.0f);
+	float aspect_scale = image_size.y / 2.0f;
+
+	vec2 pixel = view_position.xy / -view_position.z * aspect_scale / tan_half_angle;
+	return vec2(pixel.x, -pixel.y) + (image_size / 2.0f);
+}
+
+Ray generate_primary_ray(uvec2 pixel_position, ivec2 image_size, mat4 camera_matrix)
+{
+	Ray generated_ray;
+	generated_ray.position = get_translation_from_matrix(camera_matrix);
+	generated_ray.direction = generate_pinhole_ray_direction(pixel_position, image_size, camera_matrix);
+	return generated_ray;
+}
@@ -0,0 +1,61 @@
+// Shading shared by rt_shade.comp, rt_primary.comp and the path tracing kernels, include after common.glsl
+
+const vec3 SUN_DIRECTION = normalize(vec3(0.4f, 1.0f, 0.6f));
+const vec3 SUN_COLOR = vec3(1.0f);
+const vec3 SKY_COLOR = vec3(0.55f, 0.7f, 0.9f);
+const vec3 ALBEDO = vec3(0.8f); // Every voxel is the same diffuse grey for now
+
+// Hashing taken from https://www.shadertoy.com/view/NtjyWw for now
+const uint k = 1103515245U;  // GLIB C
+
+vec3 uhash3( uvec3 x )         // iq version
+{
+    x = ((x>>8U)^x.yzx)*k;
+    x = ((x>>8U)^x.yzx)*k;
+    x = ((x>>8U)^x.yzx)*k;
+
+    return vec3(x)/float(0xffffffffU);
+}
+
+vec3 hash( vec3 f )
+{
+    return uhash3( floatBitsToUint(f) );
+}
+
+// normal is the world space normal of the hit, see get_hit_world_normal in model.glsl
+vec3 shade(IntersectResult result, vec3 normal, uint view_mode, float debug_view_max)
+{
+    bool hit = result.hit_distance != FLT_MAX;
+
+    vec3 color = vec3(0.0f);
+    switch (view_mode)
+    {
+        case VIEW_MODE_SHADED:
+        {
+            if (hit)
+            {
+                float diffuse = max(dot(normal, SUN_DIRECTION), 0.0f);
+                color = ALBEDO * (diffuse * 0.8f + 0.2f);
+            }
+            else
+            {
+                color = SKY_COLOR;
+            }
+            break;
+        }
+        case VIEW_MODE_NORMALS:
+        {
+            if (hit)
+                color = normal * 0.5f + vec3(0.5f);
+            break;
+        }
+        default:
+        {
+            // Every other view mode is a heatmap of the value trace_ray wrote
+            color = viridis_quintic(result.debug_value / max(debug_view_max, EPSILON));
+            break;
+        }
+    }
+
+    return color;
+}
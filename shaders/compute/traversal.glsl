@@ -0,0 +1,452 @@
+/* Voxel traversal shared by rt_intersect.comp, rt_primary.comp and the path kernels, include after common.glsl.
+	The includer picks the bindings by defining TRAVERSAL_MODEL_BINDING and TRAVERSAL_COUNTERS_BINDING.
+*/
+
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_arithmetic : require
+
+#define MODEL_BINDING TRAVERSAL_MODEL_BINDING
+#include "model.glsl"
+
+/* Specialization constants, the ids are mirrored in renderer.cpp.
+	Without TRAVERSAL_INSTRUMENTED step counting, the traversal counters and clock timing are compiled out.
+	MODEL_INSTANCE_COUNT is how many instances are loaded, so the loop doesn't read the empty headers after them.
+	TRAVERSAL_BIT_PARALLEL_BRICKS finds the voxel a ray hits in a brick with Sub_Brick_Bitmask instead of Sub_Brick_DDA.
+*/
+layout(constant_id = 0) const bool TRAVERSAL_INSTRUMENTED = true;
+layout(constant_id = 1) const uint MODEL_INSTANCE_COUNT = MODEL_INSTANCE_CAPACITY;
+layout(constant_id = 2) const bool TRAVERSAL_BIT_PARALLEL_BRICKS = false;
+
+#define VOXEL_BRICK_SIZE 4
+#define VOXELS_PER_BRICK 64
+
+// Only written when DEBUG_FLAG_TRAVERSAL_COUNTERS is set, cleared by the renderer every frame
+layout(std430, set = 0, binding = TRAVERSAL_COUNTERS_BINDING) buffer TraversalCountersOut
+{
+	uint rays;
+	uint brick_steps;
+	uint voxel_steps;
+	uint instance_tests;
+	uint brick_fetches;
+} traversal_counters;
+
+// Per invocation, summed per subgroup at the end so only one atomic per counter per subgroup is needed
+uint brick_steps_counted = 0;
+uint voxel_steps_counted = 0;
+uint instance_tests_counted = 0;
+uint brick_fetches_counted = 0;
+
+struct IntersectionState
+{
+	vec4 t_normal_axis_instance_and_nothing;
+};
+
+uint from_3d_to_1d(ivec3 in_3d, ivec3 model_size, int model_offset)
+{
+	int index = model_offset + (in_3d[0] + in_3d[1] * model_size.x + in_3d[2] * model_size.x * model_size.y);
+	return index;
+}
+
+uint64_t get_voxel_occupancy_brick(uvec3 brick_position, ivec3 model_size_in_bricks, int model_brick_index)
+{
+	const uint brick_position_1d =
+	(brick_position.x) +
+	(brick_position.y * model_size_in_bricks.x) +
+	(brick_position.z * model_size_in_bricks.x * model_size_in_bricks.y);
+
+	if (TRAVERSAL_INSTRUMENTED)
+		brick_fetches_counted += 1;
+	return model_buffer.data[model_brick_index + brick_position_1d];
+}
+
+uint unpack_voxel_from_occupancy_brick(uvec3 local_position, uint64_t brick)
+{
+	const uint brick_local_position_1d =
+	(local_position.x) +
+	(local_position.y * VOXEL_BRICK_SIZE) +
+	(local_position.z * (VOXEL_BRICK_SIZE * VOXEL_BRICK_SIZE));
+
+	return uint(brick >> brick_local_position_1d) & 1u;
+}
+
+vec2 Sub_Brick_DDA(inout IntersectionState state, vec3 entry_position, inout ModelHeader header, ivec3 t_sign, vec3 t_delta, inout int brick_steps_taken, inout uint64_t current_occupancy_brick)
+{
+	uvec3 voxel_position = uvec3(entry_position);
+	ivec3 size = header.brick_index_and_size_in_voxels.gba;
+	ivec3 size_in_bricks = header.size_in_bricks.rgb;
+
+	uvec3 brick_position = uvec3(voxel_position) >> uvec3(2);
+
+	// Voxel Marching
+	vec3 t_max = abs(fract(entry_position) - max(t_sign, vec3(0.0f))) * t_delta;
+
+	while (current_occupancy_brick != 0)
+	{
+		// Find the smallest t_max component
+		int axis = (t_max[2] < min(t_max[0], t_max[1])) ? 2 : int(t_max[0] > t_max[1]);
+
+		voxel_position[axis] += t_sign[axis];
+		t_max[axis] += t_delta[axis];
+		if (TRAVERSAL_INSTRUMENTED)
+			voxel_steps_counted += 1;
+
+		if (any(notEqual(brick_position, voxel_position >> ivec3(2))))
+		{
+			brick_steps_taken += 1;
+			brick_position = (voxel_position >> ivec3(2));
+			// Check bounds, since we know are always aligned to a brick at least, we can do it here
+			if (voxel_position[axis] < 0 || voxel_position[axis] >= size[axis])
+				break;
+
+			current_occupancy_brick = get_voxel_occupancy_brick(brick_position, size_in_bricks, header.brick_index_and_size_in_voxels.r);
+		}
+
+		if (current_occupancy_brick != 0 && unpack_voxel_from_occupancy_brick(voxel_position & uvec3(3u), current_occupancy_brick) != 0u)
+		{
+			return vec2(t_max[axis] - t_delta[axis], uintBitsToFloat(axis + (t_sign[axis] < 0.0 ? 4u : 0u)));
+		}
+	}
+	return vec2(FLT_MAX, 0.0f);
+}
+
+/* Mirrors a brick along the axes set in flip, so rays going down an axis can be handled like ones going up it.
+	Going up every axis the voxel index x + 4y + 16z only grows along the ray, so lower set bits are crossed first
+*/
+uint64_t mirror_occupancy_brick(uint64_t brick, bvec3 flip)
+{
+	// Reverse the 4 voxels of every row
+	if (flip.x)
+	{
+		brick = ((brick >> 1) & 0x5555555555555555UL) | ((brick & 0x5555555555555555UL) << 1);
+		brick = ((brick >> 2) & 0x3333333333333333UL) | ((brick & 0x3333333333333333UL) << 2);
+	}
+	// The 4 rows of every slice
+	if (flip.y)
+	{
+		brick = ((brick >> 4) & 0x0F0F0F0F0F0F0F0FUL) | ((brick & 0x0F0F0F0F0F0F0F0FUL) << 4);
+		brick = ((brick >> 8) & 0x00FF00FF00FF00FFUL) | ((brick & 0x00FF00FF00FF00FFUL) << 8);
+	}
+	// The 4 slices
+	if (flip.z)
+	{
+		brick = ((brick >> 16) & 0x0000FFFF0000FFFFUL) | ((brick & 0x0000FFFF0000FFFFUL) << 16);
+		brick = (brick >> 32) | (brick << 32);
+	}
+	return brick;
+}
+
+// The voxels of a brick from low to high, both inclusive. Each axis is a few shifts, a table indexed per ray would end up in scratch memory
+uint64_t get_brick_box_mask(uvec3 low, uvec3 high)
+{
+	uint64_t rows = uint64_t((0xFu << low.x) & (0xFu >> (3u - high.x))) * 0x1111111111111111UL;
+	uint64_t slices = uint64_t((0xFFFFu << (low.y * 4u)) & (0xFFFFu >> ((3u - high.y) * 4u))) * 0x0001000100010001UL;
+	uint64_t columns = (~0UL << (low.z * 16u)) & (~0UL >> ((3u - high.z) * 16u));
+	return rows & slices & columns;
+}
+
+/* Finds the voxel a ray hits in one brick without stepping through it. The box the ray covers from its entry voxel to where it leaves
+	the brick is masked out of the occupancy, and the set voxels in it are tried from the lowest bit up until one is actually crossed.
+	Returns the same as Sub_Brick_DDA, but only for this brick, the ones after it are left to Brick_DDA.
+*/
+vec2 Sub_Brick_Bitmask(vec3 entry_position, uvec3 brick_position, ivec3 t_sign, vec3 t_delta, uint64_t occupancy_brick)
+{
+	bvec3 flip = lessThan(t_sign, ivec3(0));
+
+	// Everything from here on is mirrored, so the ray goes up every axis
+	vec3 local_entry = entry_position - vec3(brick_position) * VOXEL_BRICK_SIZE;
+	local_entry = mix(local_entry, vec3(VOXEL_BRICK_SIZE) - local_entry, flip);
+	uvec3 entry_voxel = uvec3(entry_position) & uvec3(3u);
+	entry_voxel = mix(entry_voxel, uvec3(3u) - entry_voxel, flip);
+
+	// t_delta is how far the ray goes per voxel along each axis
+	vec3 t_exit_axis = (vec3(VOXEL_BRICK_SIZE) - local_entry) * t_delta;
+	float t_exit = min(t_exit_axis.x, min(t_exit_axis.y, t_exit_axis.z));
+	vec3 local_exit = min(local_entry + t_exit / t_delta + EPSILON, vec3(VOXEL_BRICK_SIZE - EPSILON));
+	uvec3 exit_voxel = max(uvec3(local_exit), entry_voxel);
+
+	uint64_t candidates = mirror_occupancy_brick(occupancy_brick, flip) & get_brick_box_mask(entry_voxel, exit_voxel);
+	while (candidates != 0)
+	{
+		uint low_bits = uint(candidates);
+		uint bit = low_bits != 0u ? uint(findLSB(low_bits)) : 32u + uint(findLSB(uint(candidates >> 32)));
+		vec3 voxel = vec3(bit & 3u, (bit >> 2u) & 3u, bit >> 4u);
+		if (TRAVERSAL_INSTRUMENTED)
+			voxel_steps_counted += 1;
+
+		// Where the ray enters and leaves the voxel, the box holds voxels next to the ray's path too
+		vec3 t_near_axis = (voxel - local_entry) * t_delta;
+		vec3 t_far_axis = (voxel + vec3(1.0f) - local_entry) * t_delta;
+		float t_near = max(t_near_axis.x, max(t_near_axis.y, t_near_axis.z));
+		float t_far = min(t_far_axis.x, min(t_far_axis.y, t_far_axis.z));
+		if (t_near <= t_far)
+		{
+			int axis = (t_near_axis[2] > max(t_near_axis[0], t_near_axis[1])) ? 2 : int(t_near_axis[1] > t_near_axis[0]);
+			return vec2(t_near, uintBitsToFloat(axis + (t_sign[axis] < 0 ? 4u : 0u)));
+		}
+
+		candidates &= candidates - 1UL;
+	}
+	return vec2(FLT_MAX, 0.0f);
+}
+
+// Bricks the ray enters at or past max_distance aren't looked at
+vec2 Brick_DDA(inout IntersectionState state, Ray ray, inout ModelHeader header, float max_distance)
+{
+	ivec3 size_in_bricks = header.size_in_bricks.rgb;
+
+	uvec3 brick_position = uvec3(ray.position) >> uvec3(2);
+	uint64_t current_occupancy_brick = get_voxel_occupancy_brick(brick_position, size_in_bricks, header.brick_index_and_size_in_voxels.r);
+
+	// Voxel Marching
+	const ivec3 t_sign = ivec3(sign(ray.direction));
+	const vec3 t_delta = abs(vec3(1.0f) / ray.direction);
+	vec3 t_max = abs(fract(ray.position * 0.25f) - max(t_sign, vec3(0.0f))) * t_delta;
+
+	int inner_brick_steps_taken = 0; // Used for bricks traversed by Sub_Brick_DDA
+
+	// The loop steps out of the brick the ray starts in before looking at anything, so it is tested here
+	if (current_occupancy_brick != 0)
+	{
+		vec2 dda_t_axis = vec2(0.0f, 0.0f);
+		if (unpack_voxel_from_occupancy_brick(uvec3(ray.position) & uvec3(3u), current_occupancy_brick) == 0u)
+		{
+			if (TRAVERSAL_BIT_PARALLEL_BRICKS)
+				dda_t_axis = Sub_Brick_Bitmask(ray.position, brick_position, t_sign, t_delta, current_occupancy_brick);
+			else
+				dda_t_axis = Sub_Brick_DDA(state, ray.position, header, t_sign, t_delta, inner_brick_steps_taken, current_occupancy_brick);
+		}
+
+		if (dda_t_axis.r != FLT_MAX)
+			return dda_t_axis;
+	}
+
+	while (true)
+	{
+		// Find the smallest t_max component
+		int axis = (t_max[2] < min(t_max[0], t_max[1])) ? 2 : int(t_max[0] > t_max[1]);
+
+		brick_position[axis] += t_sign[axis];
+		t_max[axis] += t_delta[axis];
+		if (TRAVERSAL_INSTRUMENTED)
+			brick_steps_counted += 1;
+
+		if (brick_position[axis] < 0 || brick_position[axis] >= size_in_bricks[axis])
+			break;
+
+		if ((t_max[axis] - t_delta[axis]) * 4.0f >= max_distance)
+			break;
+
+		// maybe continue here
+		if (inner_brick_steps_taken > 0)
+		{
+			inner_brick_steps_taken -= 1;
+			continue;
+		}
+
+		current_occupancy_brick = get_voxel_occupancy_brick(brick_position, size_in_bricks, header.brick_index_and_size_in_voxels.r);
+
+		if (current_occupancy_brick != 0)
+		{
+			vec3 brick_entry_position = ray.position + ray.direction * (t_max[axis] - t_delta[axis]) * 4.0f;
+			brick_entry_position = clamp(brick_entry_position, vec3(brick_position) * 4.0f + vec3(EPSILON), vec3(brick_position + vec3(1.0f - EPSILON)) * 4.0f);
+
+			// We assume the first voxel is solid and only go down a level if not
+			vec2 dda_t_axis = vec2(0.0f, uintBitsToFloat(axis + (t_sign[axis] < 0.0 ? 4u : 0u)));
+			if (unpack_voxel_from_occupancy_brick(uvec3(brick_entry_position) & uvec3(3u), current_occupancy_brick) == 0u)
+			{
+				if (TRAVERSAL_BIT_PARALLEL_BRICKS)
+					dda_t_axis = Sub_Brick_Bitmask(brick_entry_position, brick_position, t_sign, t_delta, current_occupancy_brick);
+				else
+					dda_t_axis = Sub_Brick_DDA(state, brick_entry_position, header, t_sign, t_delta, inner_brick_steps_taken, current_occupancy_brick);
+			}
+
+			if (dda_t_axis.r != FLT_MAX)
+			{
+				// t_max is in bricks, the sub brick traversal in voxels
+				return vec2((t_max[axis] - t_delta[axis]) * 4.0f + dda_t_axis.r, dda_t_axis.g);
+			}
+		}
+	}
+	return vec2(FLT_MAX, 0.0f);
+}
+
+vec2 intersect_aabb(vec3 aabbmin, vec3 aabbmax, Ray ray)
+{
+	vec3 inv_dir = 1.0f / ray.direction;
+	vec3 ti = (aabbmin - ray.position) * inv_dir;
+	vec3 ta = (aabbmax - ray.position) * inv_dir;
+	vec3 axis_min = min(ti, ta);
+	vec3 axis_max = max(ti, ta);
+	float tmin = max(axis_min.x, max(axis_min.y, axis_min.z));
+	float tmax = min(axis_max.x, min(axis_max.y, axis_max.z));
+
+	if (tmax >= tmin && tmin > 0.0f)
+	{
+		vec3 normal = -(vec3(1.0f) - step(axis_min, vec3(tmin) - EPSILON)) * sign(ray.direction);
+		uint axis = (abs(normal.z) > max(abs(normal.x), abs(normal.y))) ? 2u : (abs(normal.y) > abs(normal.x) ? 1u : 0u);
+
+		axis += normal[axis] < 0.0 ? 4u : 0u;
+
+		return vec2(tmin, uintBitsToFloat(axis));
+	}
+	else
+	{
+		return vec2(FLT_MAX, 0.0f);
+	}
+}
+
+/* The ray in the voxel grid of the instance, starting where it enters the bounds or at its origin when that is inside them.
+	False when it misses the bounds
+*/
+bool enter_instance(Ray ray, ModelHeader model_header, out Ray instance_ray, out vec2 t_normal_axis)
+{
+	ivec3 model_size = model_header.brick_index_and_size_in_voxels.yzw;
+	vec3 half_size = vec3(model_size) * 0.5f;
+
+	instance_ray.position = (model_header.inverse_transform * vec4(ray.position, 1.0f)).rgb;
+	instance_ray.direction = normalize(model_header.inverse_transform * vec4(ray.direction, 0.0f)).rgb;
+
+	t_normal_axis = vec2(0.0f, 0.0f);
+	if (TRAVERSAL_INSTRUMENTED)
+		instance_tests_counted += 1;
+	// If not inside the AABB
+	if (instance_ray.position != clamp(instance_ray.position, -half_size, half_size))
+	{
+		t_normal_axis = intersect_aabb(-half_size, half_size, instance_ray);
+		if (t_normal_axis.x == FLT_MAX)
+			return false;
+	}
+
+	vec3 hit_pos = ray.position + ray.direction * (t_normal_axis.x - EPSILON);
+	vec3 in_volume_position = (model_header.inverse_transform * vec4(hit_pos, 1.0f)).xyz + half_size;
+	instance_ray.position = clamp(in_volume_position, vec3(EPSILON), model_size - vec3(EPSILON));
+	return true;
+}
+
+void intersect(inout IntersectionState state, Ray ray)
+{
+	for(int i = 0; i < int(MODEL_INSTANCE_COUNT); i++)
+	{
+		ModelHeader model_header = model_buffer.headers[i];
+		ivec3 model_size = model_header.brick_index_and_size_in_voxels.yzw;
+
+		if (model_size.x + model_size.y + model_size.z == 0)
+		break;
+
+		Ray instance_ray;
+		vec2 t_normal_axis;
+		if (!enter_instance(ray, model_header, instance_ray, t_normal_axis))
+			continue;
+
+		// Closer than current hit
+		if (t_normal_axis.x < state.t_normal_axis_instance_and_nothing.x)
+		{
+			//vec4 dda_t_normal = DDA(state, instance_ray, model_header);
+			vec2 dda_t_normal_axis = Brick_DDA(state, instance_ray, model_header, state.t_normal_axis_instance_and_nothing.x - t_normal_axis.x);
+
+			float total_distance = t_normal_axis.x + dda_t_normal_axis.x;
+			if (total_distance < state.t_normal_axis_instance_and_nothing.x)
+			{
+				state.t_normal_axis_instance_and_nothing.r = min(state.t_normal_axis_instance_and_nothing.r, total_distance);
+				state.t_normal_axis_instance_and_nothing.g = (dda_t_normal_axis.x <= EPSILON) ? t_normal_axis.g : dda_t_normal_axis.g;
+				state.t_normal_axis_instance_and_nothing.b = uintBitsToFloat(uint(i));
+			}
+		}
+	}
+}
+
+/* Whether the ray hits anything closer than max_distance, FLT_MAX for anywhere. For shadow and occlusion rays that need no distance or face,
+	instances and bricks past max_distance are skipped and the first instance that is hit ends it instead of looking for the closest
+*/
+bool trace_occlusion_ray(Ray ray, float max_distance)
+{
+	IntersectionState state;
+	for(int i = 0; i < int(MODEL_INSTANCE_COUNT); i++)
+	{
+		ModelHeader model_header = model_buffer.headers[i];
+		ivec3 model_size = model_header.brick_index_and_size_in_voxels.yzw;
+
+		if (model_size.x + model_size.y + model_size.z == 0)
+			break;
+
+		Ray instance_ray;
+		vec2 t_normal_axis;
+		if (!enter_instance(ray, model_header, instance_ray, t_normal_axis) || t_normal_axis.x >= max_distance)
+			continue;
+
+		float remaining_distance = max_distance - t_normal_axis.x;
+		if (Brick_DDA(state, instance_ray, model_header, remaining_distance).x < remaining_distance)
+			return true;
+	}
+	return false;
+}
+
+void write_traversal_counters()
+{
+	if (!TRAVERSAL_INSTRUMENTED)
+		return;
+
+	uvec4 subgroup_counts = subgroupAdd(uvec4(brick_steps_counted, voxel_steps_counted, instance_tests_counted, brick_fetches_counted));
+	uint subgroup_rays = subgroupAdd(1u);
+
+	if (subgroupElect())
+	{
+		atomicAdd(traversal_counters.rays, subgroup_rays);
+		atomicAdd(traversal_counters.brick_steps, subgroup_counts.x);
+		atomicAdd(traversal_counters.voxel_steps, subgroup_counts.y);
+		atomicAdd(traversal_counters.instance_tests, subgroup_counts.z);
+		atomicAdd(traversal_counters.brick_fetches, subgroup_counts.w);
+	}
+}
+
+// Closest hit of a ray, with the debug value of the view mode
+IntersectResult trace_ray(Ray ray, uint view_mode)
+{
+	IntersectionState state;
+	state.t_normal_axis_instance_and_nothing = vec4(FLT_MAX, 0.0f, 0.0f, 0.0f);
+
+	// Only time the traversal when it is being looked at, the push constant branch is uniform so this is free otherwise
+	float debug_value = 0.0f;
+	if (TRAVERSAL_INSTRUMENTED && view_mode == VIEW_MODE_CLOCK_COST)
+	{
+		uint64_t start = clockARB();
+		intersect(state, ray);
+		uint64_t end = clockARB();
+		debug_value = float(end - start);
+	}
+	else
+	{
+		intersect(state, ray);
+	}
+
+	if (view_mode == VIEW_MODE_DEPTH)
+		debug_value = state.t_normal_axis_instance_and_nothing.r != FLT_MAX ? state.t_normal_axis_instance_and_nothing.r : 0.0f;
+	else if (view_mode == VIEW_MODE_BRICK_STEPS)
+		debug_value = float(brick_steps_counted);
+	else if (view_mode == VIEW_MODE_INSTANCE_TESTS)
+		debug_value = float(instance_tests_counted);
+
+	IntersectResult result;
+	result.hit_distance = state.t_normal_axis_instance_and_nothing.r;
+	result.face_and_instance = floatBitsToUint(state.t_normal_axis_instance_and_nothing.g) | (floatBitsToUint(state.t_normal_axis_instance_and_nothing.b) << HIT_INSTANCE_SHIFT);
+	result.debug_value = debug_value;
+	return result;
+}
+
+/* Closest hit of a ray that can't hit anything closer than start_distance, the traversal starts there instead of at the origin.
+	The hit distance and the depth debug value are still measured from the origin
+*/
+IntersectResult trace_ray_from(Ray ray, float start_distance, uint view_mode)
+{
+	Ray start_ray = ray;
+	start_ray.position += ray.direction * start_distance;
+
+	IntersectResult result = trace_ray(start_ray, view_mode);
+	if (result.hit_distance != FLT_MAX)
+	{
+		result.hit_distance += start_distance;
+		if (view_mode == VIEW_MODE_DEPTH)
+			result.debug_value = result.hit_distance;
+	}
+	return result;
+}